@@ -0,0 +1,112 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "src/env/batchEnv.h"
+
+/* Random agent over a BatchEnv: every step each instance holds one random
+   key or none, instances that stopped on an error are reset. Prints the
+   steps and guest frames per second and the reward collected, which is
+   what a training loop pays for the emulation alone.
+   -e selects the engine, but not profile, whose counters are
+   process-wide; -n the instances (default 64), -k the frames per step
+   (frame skip), -s the steps, -r the address of the reward byte in hex,
+   -j the worker threads, -S the seed of the instances' Cxkk streams
+   (default 0). */
+
+#define AGENTINSTANCES 64
+#define AGENTSTEPS 10000
+
+int main(int argc, char **argv)
+{
+  const char *engineName = "interp";
+  int instances = AGENTINSTANCES;
+  int frameSkip = DEFAULTFRAMESKIP;
+  long steps = AGENTSTEPS;
+  uint16_t rewardAddress = 0;
+  int threads = 1;
+  uint64_t seed = 0;
+  int first = 1;
+
+  while (first + 1 < argc && argv[first][0] == '-')
+  {
+    if (strcmp(argv[first], "-e") == 0)
+      engineName = argv[first + 1];
+    else if (strcmp(argv[first], "-n") == 0)
+      instances = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-k") == 0)
+      frameSkip = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-s") == 0)
+      steps = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-r") == 0)
+      rewardAddress = strtol(argv[first + 1], NULL, 16);
+    else if (strcmp(argv[first], "-j") == 0)
+      threads = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-S") == 0)
+      seed = strtoull(argv[first + 1], NULL, 0);
+    else
+      break;
+    first += 2;
+  }
+
+  if (first + 1 != argc || argv[first][0] == '-' || strcmp(engineName, "profile") == 0)
+  {
+    fprintf(stderr, "Usage: agent [-e interp|threaded|jit] [-n instances] [-k frameskip] "
+                    "[-s steps] [-r address] [-j threads] [-S seed] ROM\n");
+    exit(1);
+  }
+
+  BatchEnv env(argv[first], instances, engineName, frameSkip, INSTRPERFRAME, threads, seed);
+  if (env.status() != OK)
+  {
+    fprintf(stderr, "%s: cannot start, error %d\n", argv[first], env.status());
+    exit(1);
+  }
+
+  env.setRewardByte(rewardAddress);
+  env.reset();
+
+  uint16_t *actions = (uint16_t*) calloc(instances, sizeof(uint16_t));
+  if (actions == NULL)
+  {
+    fprintf(stderr, "Bad allocation\n");
+    exit(1);
+  }
+
+  uint32_t random = 2463534242u;
+  double reward = 0;
+  long episodes = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (long s = 0; s < steps; s++)
+  {
+    for (int i = 0; i < instances; i++)
+    {
+      random ^= random << 13;
+      random ^= random >> 17;
+      random ^= random << 5;
+      actions[i] = (random % (KEYCOUNT + 1)) < KEYCOUNT ? 1 << (random % (KEYCOUNT + 1)) : 0;
+    }
+
+    env.step(actions);
+
+    for (int i = 0; i < instances; i++)
+    {
+      reward += env.rewards()[i];
+      episodes += env.done()[i];
+    }
+
+    env.reset(env.done());
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  printf("%d instances, %ld steps of %d frames: %.0f steps/s %.0f frames/s\n", instances,
+         steps, frameSkip, instances * steps / elapsed.count(),
+         instances * steps * frameSkip / elapsed.count());
+  printf("reward %.0f, %ld episodes ended on an error\n", reward, episodes);
+
+  free(actions);
+  return 0;
+}
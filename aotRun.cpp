@@ -0,0 +1,53 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "src/chip8/chip8.h"
+#include "src/engine/aotEngine.h"
+
+/* Headless runner linked against one recomp output: runs the ROM the code
+   was generated from for a number of frames and reports the speed.
+   Built by 'make aot ROM=roms/NAME'. */
+
+#define RUNFRAMES 100000
+#define CYCLESPERFRAME 10
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 3)
+  {
+    fprintf(stderr, "Usage: aot ROM [FRAMES]   (translated from %s)\n", AotEngine::romName());
+    exit(1);
+  }
+
+  long frames = argc == 3 ? atol(argv[2]) : RUNFRAMES;
+
+  Chip8 emulator;
+
+  if (emulator.okConstruct == false || emulator.loadBinary(argv[1]) != OK)
+  {
+    fprintf(stderr, "Bad opening\n");
+    exit(1);
+  }
+
+  AotEngine engine(emulator);
+
+  if (!engine.matches())
+    fprintf(stderr, "%s is not %s, running interpreted\n", argv[1], AotEngine::romName());
+
+  long executed = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (long f = 0; f < frames && emulator.errorCode() == OK; f++)
+  {
+    executed += engine.run(CYCLESPERFRAME);
+    emulator.decreaseTimers();
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  printf("%s: %ld instr %.3f s %.0f instr/s%s\n", argv[1], executed, elapsed.count(),
+         executed / elapsed.count(), emulator.errorCode() != OK ? "  (stopped on error)" : "");
+
+  return 0;
+}
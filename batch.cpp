@@ -0,0 +1,249 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "src/chip8/chip8.h"
+#include "src/engine/engine.h"
+#include "src/engine/lockstepEngine.h"
+#include "src/thread/workPool.h"
+
+/* Headless batch runner: runs many independent Chip8 instances across all
+   cores, instance i playing ROM i modulo the ROM count, each for a fixed
+   number of frames or until it stops on an error. Prints one line per
+   instance (instructions, error code, final PC and a hash of the screen)
+   and the aggregate throughput.
+   -e selects the engine: interp (default), threaded or jit; the profile
+   engine keeps process-wide counters and is not allowed here. lockstep
+   runs the instances of each ROM LANES at a time in a LockstepEngine.
+   -q forces a quirk profile, -n sets the number of instances (default
+   one per ROM), -f the frames per instance, -j the worker threads (0 for
+   one per hardware thread), -S the seed: instance i draws Cxkk from
+   seed + i, 0 by default, so the output of two runs can be compared. */
+
+#define BATCHFRAMES 36000
+#define CYCLESPERFRAME 10
+
+struct instanceResult
+{
+    long executed;
+    int status;
+    uint16_t pc;
+    uint64_t screenHash;
+};
+
+struct batchJob
+{
+    const char *engineName;
+    profile id;
+    long frames;
+    uint64_t seed;
+    char **roms;
+    int romCount;
+    long instances;
+    instanceResult *results;
+};
+
+static uint64_t hashScreen(const uint64_t *rows)
+{
+  uint64_t hash = 0xCBF29CE484222325ULL;
+
+  for (int y = 0; y < WIDTH; y++)
+    for (int shift = 0; shift < HEIGHT; shift += BYTESIZE)
+    {
+      hash ^= (rows[y] >> shift) & 0xFF;
+      hash *= 0x100000001B3ULL;
+    }
+
+  return hash;
+}
+
+static void runInstance(long index, void *context)
+{
+  batchJob *batch = (batchJob*) context;
+  instanceResult *result = &batch->results[index];
+
+  Chip8 emulator;
+
+  result->executed = 0;
+  result->status = emulator.okConstruct ? OK : BADALLOC;
+
+  if (result->status == OK)
+    result->status = emulator.loadBinary(batch->roms[index % batch->romCount]);
+
+  if (result->status != OK)
+    return;
+
+  if (batch->id != PROFILECOUNT)
+    emulator.setProfile(batch->id);
+
+  emulator.seed(batch->seed + index);
+
+  Engine *engine = createEngine(batch->engineName, emulator);
+  if (engine == NULL)
+  {
+    result->status = BADARGUMENT;
+    return;
+  }
+
+  for (long f = 0; f < batch->frames && emulator.errorCode() == OK; f++)
+  {
+    result->executed += engine->run(CYCLESPERFRAME);
+    emulator.decreaseTimers();
+  }
+
+  delete engine;
+
+  result->status = emulator.errorCode();
+  result->pc = emulator.programCounter();
+  result->screenHash = hashScreen(emulator.screen());
+}
+
+/* Job index of the lockstep engine: ROM index % romCount, instances
+   romCount apart, LANES of them per job */
+
+static void runLockstep(long index, void *context)
+{
+  batchJob *batch = (batchJob*) context;
+  long rom = index % batch->romCount;
+  long first = index / batch->romCount * LANES;
+  int lanes = 0;
+
+  long instance[LANES];
+  for (; lanes < LANES; lanes++)
+  {
+    instance[lanes] = rom + (first + lanes) * batch->romCount;
+    if (instance[lanes] >= batch->instances)
+      break;
+    batch->results[instance[lanes]].status = BADALLOC;
+  }
+
+  if (lanes == 0)
+    return;
+
+  Chip8 emulator;
+  LockstepEngine engine;
+
+  if (emulator.okConstruct == false || engine.okConstruct == false)
+    return;
+
+  int status = emulator.loadBinary(batch->roms[rom]);
+  if (status != OK)
+  {
+    for (int lane = 0; lane < lanes; lane++)
+      batch->results[instance[lane]].status = status;
+    return;
+  }
+
+  if (batch->id != PROFILECOUNT)
+    emulator.setProfile(batch->id);
+
+  for (int lane = 0; lane < lanes; lane++)
+  {
+    emulator.seed(batch->seed + instance[lane]);
+    engine.load(lane, emulator);
+  }
+
+  for (long f = 0; f < batch->frames && engine.liveLanes() != 0; f++)
+  {
+    engine.run(CYCLESPERFRAME);
+    engine.decreaseTimers();
+  }
+
+  for (int lane = 0; lane < lanes; lane++)
+  {
+    instanceResult *result = &batch->results[instance[lane]];
+    uint64_t rows[WIDTH];
+
+    engine.copyScreen(lane, rows);
+
+    result->executed = engine.executed(lane);
+    result->status = engine.errorCode(lane);
+    result->pc = engine.programCounter(lane);
+    result->screenHash = hashScreen(rows);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *engineName = "interp";
+  profile id = PROFILECOUNT;
+  long instances = 0;
+  long frames = BATCHFRAMES;
+  int threads = 0;
+  uint64_t seed = 0;
+  int first = 1;
+
+  while (first + 1 < argc && argv[first][0] == '-')
+  {
+    if (strcmp(argv[first], "-e") == 0)
+      engineName = argv[first + 1];
+    else if (strcmp(argv[first], "-q") == 0 && Chip8::profileByName(argv[first + 1]) != PROFILECOUNT)
+      id = Chip8::profileByName(argv[first + 1]);
+    else if (strcmp(argv[first], "-n") == 0)
+      instances = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-f") == 0)
+      frames = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-j") == 0)
+      threads = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-S") == 0)
+      seed = strtoull(argv[first + 1], NULL, 0);
+    else
+      break;
+    first += 2;
+  }
+
+  if (first >= argc || argv[first][0] == '-' || strcmp(engineName, "profile") == 0)
+  {
+    fprintf(stderr, "Usage: batch [-e interp|threaded|jit|lockstep] [-q classic|vip|chip48|schip] "
+                    "[-n instances] [-f frames] [-j threads] [-S seed] ROM [ROM...]\n");
+    exit(1);
+  }
+
+  int romCount = argc - first;
+  if (instances <= 0)
+    instances = romCount;
+
+  instanceResult *results = (instanceResult*) calloc(instances, sizeof(instanceResult));
+  if (results == NULL)
+  {
+    fprintf(stderr, "Bad allocation\n");
+    exit(1);
+  }
+
+  batchJob batch = { engineName, id, frames, seed, argv + first, romCount, instances, results };
+  WorkPool pool(threads);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (strcmp(engineName, "lockstep") == 0)
+  {
+    long perRom = (instances + romCount - 1) / romCount;
+    pool.run((perRom + LANES - 1) / LANES * romCount, runLockstep, &batch);
+  }
+  else
+    pool.run(instances, runInstance, &batch);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  long totalExecuted = 0;
+  long failed = 0;
+
+  for (long i = 0; i < instances; i++)
+  {
+    instanceResult *result = &results[i];
+
+    printf("%6ld %-16s %10ld instr  status %d  PC %03X  screen %016llx\n", i,
+           argv[first + i % romCount], result->executed, result->status, result->pc,
+           (unsigned long long) result->screenHash);
+
+    totalExecuted += result->executed;
+    if (result->status != OK)
+      failed++;
+  }
+
+  printf("%ld instances on %d threads (%ld steals), %ld stopped on error\n", instances,
+         pool.threads(), pool.steals(), failed);
+  printf("%ld instr %.3f s %.0f instr/s\n", totalExecuted, elapsed.count(),
+         totalExecuted / elapsed.count());
+
+  free(results);
+  return 0;
+}
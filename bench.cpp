@@ -0,0 +1,373 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "src/chip8/chip8.h"
+#include "src/engine/engine.h"
+#include "src/engine/profileEngine.h"
+#include "src/render/frameDelta.h"
+#include "src/thread/emulationThread.h"
+
+/* Headless throughput benchmark: runs every ROM given on the command line
+   for a fixed number of instructions and prints instructions per second,
+   counting the ones the engines skipped in timer wait loops. A ROM
+   waiting on Fx0A stops early, no key is ever pressed.
+   -e selects the engine: interp (default), threaded, jit or profile; the
+   profile engine also prints the pair-frequency report used to pick the
+   fused instructions in src/engine/fusion.def.
+   -q forces a quirk profile instead of the one picked for each ROM.
+   BENCH_CYCLES and BENCH_FRAME override the instruction count per ROM and
+   the instructions run between two timer ticks. With BENCH_DELTA set the
+   changed rows are delta encoded after every frame and the average delta
+   size is printed with each ROM. With BENCH_STATE set the machine is
+   saved and restored STATEROUNDS times after the run and the cost of
+   each is printed in microseconds; a non-empty value is also used as the
+   path of a save state file to time the file save and mapped load.
+   With BENCH_STARTUP set the start of a machine is timed STARTUPROUNDS
+   times per ROM before its run: a new machine loading the file, a reset
+   one loading the file, a reset one loading the ROM bytes read once, as
+   a batch host does for many instances, and a copy of a loaded machine.
+   Every run starts from BENCH_SEED, 0 by default, so runs of one build
+   execute the same instructions. With BENCH_REPLAY set to an input log
+   recorded by emu -R, each ROM instead replays the log on the emulation
+   thread in turbo mode and the final state is checked against the
+   recording, to bisect a change in speed or behaviour offline. */
+
+#define BENCHCYCLES 20000000
+#define CYCLESPERFRAME 10
+#define REPORTLINES 24
+#define STATEROUNDS 10000
+#define STATEFILEROUNDS 100
+#define STARTUPROUNDS 1000
+
+struct stateCost
+{
+    double save;
+    double restore;
+    double fileSave;
+    double fileLoad;
+};
+
+struct startupCost
+{
+    double construct;
+    double file;
+    double bytes;
+    double copy;
+};
+
+static double microseconds(std::chrono::steady_clock::time_point from, long rounds)
+{
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - from;
+  return elapsed.count() / rounds;
+}
+
+/* Times save states of emulator in memory, and through path if not empty */
+
+static bool measureStates(Chip8& emulator, const char *path, stateCost *cost)
+{
+  uint8_t *buffer = (uint8_t*) malloc(Chip8::stateSize());
+  if (buffer == NULL)
+    return false;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STATEROUNDS; i++)
+    emulator.saveState(buffer);
+  cost->save = microseconds(start, STATEROUNDS);
+
+  bool ok = true;
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STATEROUNDS; i++)
+    ok &= emulator.loadState(buffer, Chip8::stateSize()) == OK;
+  cost->restore = microseconds(start, STATEROUNDS);
+
+  free(buffer);
+
+  cost->fileSave = cost->fileLoad = 0;
+  if (path[0] == '\0')
+    return ok;
+
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STATEFILEROUNDS; i++)
+    ok &= emulator.saveState(path) == OK;
+  cost->fileSave = microseconds(start, STATEFILEROUNDS);
+
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STATEFILEROUNDS; i++)
+    ok &= emulator.loadState(path) == OK;
+  cost->fileLoad = microseconds(start, STATEFILEROUNDS);
+
+  return ok;
+}
+
+/* Times the ways a machine can start on the ROM at path */
+
+static bool measureStartup(const char *path, startupCost *cost)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  uint8_t rom[MEMORYSIZE];
+  size_t size = fread(rom, 1, sizeof(rom), file);
+  fclose(file);
+
+  Chip8 *loaded = new Chip8();
+  Chip8 *emulator = new Chip8();
+  bool ok = loaded->okConstruct && emulator->okConstruct && loaded->loadBinary(path) == OK;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STARTUPROUNDS && ok; i++)
+  {
+    Chip8 *fresh = new Chip8();
+    ok &= fresh->okConstruct && fresh->loadBinary(path) == OK;
+    delete fresh;
+  }
+  cost->construct = microseconds(start, STARTUPROUNDS);
+
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STARTUPROUNDS && ok; i++)
+  {
+    emulator->reset();
+    ok &= emulator->loadBinary(path) == OK;
+  }
+  cost->file = microseconds(start, STARTUPROUNDS);
+
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STARTUPROUNDS && ok; i++)
+  {
+    emulator->reset();
+    ok &= emulator->loadProgram(rom, size) == OK;
+  }
+  cost->bytes = microseconds(start, STARTUPROUNDS);
+
+  start = std::chrono::steady_clock::now();
+  for (long i = 0; i < STARTUPROUNDS && ok; i++)
+    emulator->copyState(*loaded);
+  cost->copy = microseconds(start, STARTUPROUNDS);
+
+  delete emulator;
+  delete loaded;
+  return ok;
+}
+
+/* Replays log on path at turbo speed; matches tells whether the final
+   state is the recorded one */
+
+static double replayRom(const char *path, const char *engineName, InputLog& log,
+                        long *executed, int *status, bool *matches)
+{
+  Chip8 emulator;
+
+  if (emulator.okConstruct == false || emulator.loadBinary(path) != OK ||
+      log.prepare(emulator) != OK)
+    return -1.0;
+
+  Engine *engine = createEngine(engineName, emulator);
+  if (engine == NULL)
+    return -1.0;
+
+  TripleBuffer frames;
+  InputQueue input;
+  EmulationThread emulation(emulator, *engine, frames, input, log.ips());
+
+  emulation.setTurbo(0);
+  emulation.setReplay(&log);
+  emulation.start();
+
+  while (emulation.running())
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  emulation.stop();
+
+  *executed = emulation.instructions();
+  *status = emulator.errorCode();
+  *matches = emulation.guestFrames() == log.frames() && emulator.checksum() == log.finalChecksum();
+
+  delete engine;
+  return emulation.seconds();
+}
+
+static double benchRom(const char *path, const char *engineName, profile id, uint64_t seed,
+                       long cycles, long perFrame, long *executed, long *elided, int *status,
+                       bool *waiting, double *deltaBytes, const char *statePath,
+                       stateCost *states)
+{
+  Chip8 emulator;
+
+  if (emulator.okConstruct == false || emulator.loadBinary(path) != OK)
+    return -1.0;
+
+  if (id != PROFILECOUNT)
+    emulator.setProfile(id);
+
+  emulator.seed(seed);
+
+  Engine *engine = createEngine(engineName, emulator);
+  if (engine == NULL)
+    return -1.0;
+
+  *executed = 0;
+
+  uint8_t delta[DELTAMAXSIZE];
+  long frames = 0;
+  long encoded = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  /* nothing presses a key, so a guest on Fx0A would wait for ever */
+  while (*executed < cycles && emulator.errorCode() == OK && !emulator.waitingForKey())
+  {
+    *executed += engine->run(perFrame);
+    emulator.decreaseTimers();
+
+    if (deltaBytes != NULL)
+    {
+      encoded += encodeDelta(emulator.screen(), emulator.changedRows(), delta);
+      emulator.clearChangedRows();
+      frames++;
+    }
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  *elided = emulator.idleCycles();
+  *status = emulator.errorCode();
+  *waiting = emulator.waitingForKey();
+
+  if (deltaBytes != NULL)
+    *deltaBytes = frames > 0 ? (double) encoded / frames : 0.0;
+
+  if (statePath != NULL && !measureStates(emulator, statePath, states))
+    fprintf(stderr, "%s: save state did not restore\n", path);
+
+  delete engine;
+  return elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+  const char *engineName = "interp";
+  profile id = PROFILECOUNT;
+  int first = 1;
+
+  while (first + 1 < argc && argv[first][0] == '-')
+  {
+    if (strcmp(argv[first], "-e") == 0)
+      engineName = argv[first + 1];
+    else if (strcmp(argv[first], "-q") == 0 && Chip8::profileByName(argv[first + 1]) != PROFILECOUNT)
+      id = Chip8::profileByName(argv[first + 1]);
+    else
+      break;
+    first += 2;
+  }
+
+  if (first >= argc || argv[first][0] == '-')
+  {
+    fprintf(stderr, "Usage: bench [-e interp|threaded|jit|profile] [-q classic|vip|chip48|schip] ROM [ROM...]\n");
+    exit(1);
+  }
+
+  long cycles = BENCHCYCLES;
+  if (getenv("BENCH_CYCLES"))
+    cycles = atol(getenv("BENCH_CYCLES"));
+
+  long perFrame = CYCLESPERFRAME;
+  if (getenv("BENCH_FRAME"))
+    perFrame = atol(getenv("BENCH_FRAME"));
+
+  uint64_t seed = 0;
+  if (getenv("BENCH_SEED"))
+    seed = strtoull(getenv("BENCH_SEED"), NULL, 0);
+
+  bool measureDelta = getenv("BENCH_DELTA") != NULL;
+  const char *statePath = getenv("BENCH_STATE");
+  bool measureStart = getenv("BENCH_STARTUP") != NULL;
+
+  InputLog log;
+  const char *replayPath = getenv("BENCH_REPLAY");
+  if (replayPath != NULL && log.load(replayPath) != OK)
+  {
+    fprintf(stderr, "Cannot read the input log %s\n", replayPath);
+    exit(1);
+  }
+
+  long totalExecuted = 0;
+  double totalSeconds = 0;
+
+  printf("engine: %s\n", engineName);
+
+  for (int i = first; i < argc; i++)
+  {
+    long executed = 0;
+    long elided = 0;
+    int status = OK;
+    bool waiting = false;
+    double deltaBytes = 0;
+    stateCost states;
+    startupCost startup;
+    bool matches = false;
+    double seconds;
+
+    if (measureStart)
+    {
+      if (measureStartup(argv[i], &startup))
+        printf("%-16s %8.3f us new machine %8.3f us file %8.3f us bytes %8.3f us copy\n",
+               argv[i], startup.construct, startup.file, startup.bytes, startup.copy);
+      else
+        fprintf(stderr, "%s: cannot time the start\n", argv[i]);
+    }
+
+    if (replayPath != NULL)
+      seconds = replayRom(argv[i], engineName, log, &executed, &status, &matches);
+    else
+      seconds = benchRom(argv[i], engineName, id, seed, cycles, perFrame, &executed, &elided,
+                         &status, &waiting, measureDelta ? &deltaBytes : NULL, statePath,
+                         &states);
+
+    if (seconds < 0)
+    {
+      fprintf(stderr, "%s: cannot load\n", argv[i]);
+      continue;
+    }
+
+    printf("%-16s %10ld instr %8.3f s %12.0f instr/s%s\n", argv[i], executed,
+           seconds, executed / seconds, status != OK ? "  (stopped on error)" :
+           waiting ? "  (stopped waiting for a key)" : "");
+
+    if (replayPath != NULL)
+      printf("%-16s replay of %ld frames, %ld key events: %s\n", "", log.frames(), log.events(),
+             matches ? "final state matches" : "FINAL STATE DIFFERS");
+
+    if (elided > 0)
+      printf("%-16s %10ld instr skipped in idle loops (%.1f%%)\n", "", elided,
+             100.0 * elided / executed);
+
+    if (measureDelta)
+      printf("%-16s %10.1f delta bytes/frame of %d\n", "", deltaBytes, (int) DELTAMAXSIZE);
+
+    if (statePath != NULL)
+    {
+      printf("%-16s %10.3f us save %8.3f us restore of %d bytes\n", "", states.save,
+             states.restore, (int) Chip8::stateSize());
+      if (statePath[0] != '\0')
+        printf("%-16s %10.3f us file save %8.3f us mapped load\n", "", states.fileSave,
+               states.fileLoad);
+    }
+
+    totalExecuted += executed;
+    totalSeconds += seconds;
+  }
+
+  if (totalSeconds > 0)
+    printf("%-16s %10ld instr %8.3f s %12.0f instr/s\n", "TOTAL", totalExecuted,
+           totalSeconds, totalExecuted / totalSeconds);
+
+  if (strcmp(engineName, "profile") == 0)
+  {
+    printf("\n");
+    ProfileEngine::report(stdout, REPORTLINES);
+  }
+
+  return 0;
+}
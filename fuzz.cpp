@@ -0,0 +1,210 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "src/chip8/chip8.h"
+#include "src/engine/engine.h"
+
+/* Fuzz target for the core: every input is a ROM, run for FUZZFRAMES
+   frames of FUZZINSTR instructions on the interpreter, the threaded
+   engine and the JIT, each on a machine of its own put back with
+   reset(). Key f % 16 is held during frame f, so Ex9E, ExA1 and Fx0A go
+   on. Any engine ending in another state than the interpreter, or having
+   run another number of instructions, aborts, as an out-of-bounds access
+   does under the sanitizers.
+   'make libfuzz' builds it for libFuzzer with clang, which then reports
+   exec/s itself. Otherwise main() runs the files given, then mutations
+   of them, or random inputs without files, for -s seconds (default 10)
+   and prints the execs per second and what stopped the guests. */
+
+#define FUZZFRAMES 64
+#define FUZZINSTR 64
+#define FUZZSECONDS 10
+#define FUZZMAXSIZE 1024
+
+static const char *const engineNames[] = { "interp", "threaded", "jit" };
+#define FUZZENGINES ((int)(sizeof(engineNames) / sizeof(engineNames[0])))
+
+static Chip8 *machines[FUZZENGINES];
+static Engine *engines[FUZZENGINES];
+static long outcomes[BADLOG + 1];
+
+static long runInput(Chip8& cpu, Engine& engine)
+{
+  long executed = 0;
+
+  for (int f = 0; f < FUZZFRAMES && cpu.errorCode() == OK; f++)
+  {
+    cpu.pressKey(f % KEYCOUNT);
+    executed += engine.run(FUZZINSTR);
+    cpu.releaseKey(f % KEYCOUNT);
+    cpu.decreaseTimers();
+  }
+
+  return executed;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  uint64_t reference = 0;
+  long referenceCount = 0;
+
+  for (int e = 0; e < FUZZENGINES; e++)
+  {
+    if (machines[e] == NULL)
+    {
+      machines[e] = new Chip8();
+      engines[e] = createEngine(engineNames[e], *machines[e]);
+
+      /* no JIT on this host */
+      if (engines[e] == NULL)
+        engines[e] = createEngine("interp", *machines[e]);
+    }
+
+    Chip8& cpu = *machines[e];
+
+    cpu.reset();
+    engines[e]->flush();
+
+    if (cpu.loadProgram(data, size) != OK)
+      return 0;
+
+    long executed = runInput(cpu, *engines[e]);
+
+    if (e == 0)
+    {
+      reference = cpu.checksum();
+      referenceCount = executed;
+      outcomes[cpu.errorCode()]++;
+    }
+    else if (cpu.checksum() != reference)
+    {
+      fprintf(stderr, "%s ends in another state than interp\n", engineNames[e]);
+      abort();
+    }
+    /* e.g. an engine going on with Fx0A while the guest waits */
+    else if (executed != referenceCount)
+    {
+      fprintf(stderr, "%s ran %ld instructions, interp %ld\n", engineNames[e], executed,
+              referenceCount);
+      abort();
+    }
+  }
+
+  return 0;
+}
+
+#ifndef LIBFUZZER
+
+static uint32_t nextRandom(uint32_t *random)
+{
+  *random ^= *random << 13;
+  *random ^= *random >> 17;
+  *random ^= *random << 5;
+  return *random;
+}
+
+/* A few bytes of seed overwritten, or all of it random without a seed */
+
+static size_t mutate(uint8_t *out, const uint8_t *seed, size_t seedSize, uint32_t *random)
+{
+  if (seedSize == 0)
+  {
+    size_t size = nextRandom(random) % FUZZMAXSIZE + 1;
+    for (size_t i = 0; i < size; i++)
+      out[i] = nextRandom(random);
+    return size;
+  }
+
+  memcpy(out, seed, seedSize);
+
+  int flips = nextRandom(random) % 8 + 1;
+  for (int i = 0; i < flips; i++)
+    out[nextRandom(random) % seedSize] = nextRandom(random);
+
+  return seedSize;
+}
+
+static size_t readInput(const char *path, uint8_t *out)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return 0;
+
+  size_t size = fread(out, 1, MEMORYSIZE, file);
+  fclose(file);
+  return size;
+}
+
+int main(int argc, char **argv)
+{
+  double seconds = FUZZSECONDS;
+  int first = 1;
+
+  if (first + 1 < argc && strcmp(argv[first], "-s") == 0)
+  {
+    seconds = atof(argv[first + 1]);
+    first += 2;
+  }
+
+  if (first < argc && argv[first][0] == '-')
+  {
+    fprintf(stderr, "Usage: fuzz [-s seconds] [ROM...]\n");
+    exit(1);
+  }
+
+  int seeds = argc - first;
+  uint8_t *corpus = (uint8_t*) calloc(seeds > 0 ? seeds : 1, MEMORYSIZE);
+  size_t *sizes = (size_t*) calloc(seeds > 0 ? seeds : 1, sizeof(size_t));
+  uint8_t input[MEMORYSIZE];
+
+  if (corpus == NULL || sizes == NULL)
+  {
+    fprintf(stderr, "Bad allocation\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < seeds; i++)
+  {
+    sizes[i] = readInput(argv[first + i], corpus + i * MEMORYSIZE);
+    LLVMFuzzerTestOneInput(corpus + i * MEMORYSIZE, sizes[i]);
+  }
+
+  uint32_t random = 2463534242u;
+  long execs = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed(0);
+
+  while (elapsed.count() < seconds)
+  {
+    /* the clock is read once per batch */
+    for (int i = 0; i < 256; i++)
+    {
+      int seed = seeds > 0 ? nextRandom(&random) % seeds : 0;
+      size_t size = mutate(input, corpus + seed * MEMORYSIZE, seeds > 0 ? sizes[seed] : 0, &random);
+
+      LLVMFuzzerTestOneInput(input, size);
+      execs++;
+    }
+
+    elapsed = std::chrono::steady_clock::now() - start;
+  }
+
+  printf("%ld execs in %.2f s: %.0f execs/s, %d engines each\n", execs, elapsed.count(),
+         elapsed.count() > 0 ? execs / elapsed.count() : 0.0, FUZZENGINES);
+  printf("guests: %ld ran all frames, %ld STACKERROR, %ld ADDRESSERR, %ld UNKNOWN\n",
+         outcomes[OK], outcomes[STACKERROR], outcomes[ADDRESSERR], outcomes[UNKNOWN]);
+
+  for (int e = 0; e < FUZZENGINES; e++)
+  {
+    delete engines[e];
+    delete machines[e];
+  }
+
+  free(corpus);
+  free(sizes);
+  return 0;
+}
+
+#endif
@@ -1,14 +1,13 @@
 
 #include <SFML/Graphics.hpp>
+#include <cstring>
+#include <ctime>
 #include "src/chip8/chip8.h"
+#include "src/engine/engine.h"
+#include "src/render/renderer.h"
+#include "src/thread/emulationThread.h"
 
-#define SCALE 10
-
-const float FREQUENCY = 1000.0 / 60.0;
-
-int error = OK;
-
-int eventInput(sf::RenderWindow& window, sf::Event& event, Chip8& emulator)
+int eventInput(sf::RenderWindow& window, sf::Event& event, InputQueue& input)
 {
    switch(event.type)
       {
@@ -19,44 +18,46 @@ int eventInput(sf::RenderWindow& window, sf::Event& event, Chip8& emulator)
         case(sf::Event::KeyPressed):
           switch(event.key.code)
           {
-              case sf::Keyboard::Num1:  emulator.keyboard.pressKey(0x1); break;
-              case sf::Keyboard::Num2:  emulator.keyboard.pressKey(0x2); break;
-              case sf::Keyboard::Num3:  emulator.keyboard.pressKey(0x3); break;
-              case sf::Keyboard::Num4:  emulator.keyboard.pressKey(0xc); break;
-              case sf::Keyboard::Q:     emulator.keyboard.pressKey(0x4); break;
-              case sf::Keyboard::W:     emulator.keyboard.pressKey(0x5); break;
-              case sf::Keyboard::E:     emulator.keyboard.pressKey(0x6); break;
-              case sf::Keyboard::R:     emulator.keyboard.pressKey(0xd); break;
-              case sf::Keyboard::A:     emulator.keyboard.pressKey(0x7); break;
-              case sf::Keyboard::S:     emulator.keyboard.pressKey(0x8); break;
-              case sf::Keyboard::D:     emulator.keyboard.pressKey(0x9); break;
-              case sf::Keyboard::F:     emulator.keyboard.pressKey(0xe); break;
-              case sf::Keyboard::Z:     emulator.keyboard.pressKey(0xa); break;
-              case sf::Keyboard::X:     emulator.keyboard.pressKey(0x0); break;
-              case sf::Keyboard::C:     emulator.keyboard.pressKey(0xb); break;
-              case sf::Keyboard::V:     emulator.keyboard.pressKey(0xf); break;
+              case sf::Keyboard::Num1:  input.push(0x1, true);  break;
+              case sf::Keyboard::Num2:  input.push(0x2, true);  break;
+              case sf::Keyboard::Num3:  input.push(0x3, true);  break;
+              case sf::Keyboard::Num4:  input.push(0xc, true);  break;
+              case sf::Keyboard::Q:     input.push(0x4, true);  break;
+              case sf::Keyboard::W:     input.push(0x5, true);  break;
+              case sf::Keyboard::E:     input.push(0x6, true);  break;
+              case sf::Keyboard::R:     input.push(0xd, true);  break;
+              case sf::Keyboard::A:     input.push(0x7, true);  break;
+              case sf::Keyboard::S:     input.push(0x8, true);  break;
+              case sf::Keyboard::D:     input.push(0x9, true);  break;
+              case sf::Keyboard::F:     input.push(0xe, true);  break;
+              case sf::Keyboard::Z:     input.push(0xa, true);  break;
+              case sf::Keyboard::X:     input.push(0x0, true);  break;
+              case sf::Keyboard::C:     input.push(0xb, true);  break;
+              case sf::Keyboard::V:     input.push(0xf, true);  break;
+              case sf::Keyboard::BackSpace: input.push(REWINDKEY, true); break;
           }
           break;
 
         case(sf::Event::KeyReleased):
             switch(event.key.code)
             {
-              case sf::Keyboard::Num1:  emulator.keyboard.releaseKey(0x1); break;
-              case sf::Keyboard::Num2:  emulator.keyboard.releaseKey(0x2); break;
-              case sf::Keyboard::Num3:  emulator.keyboard.releaseKey(0x3); break;
-              case sf::Keyboard::Num4:  emulator.keyboard.releaseKey(0xc); break;
-              case sf::Keyboard::Q:     emulator.keyboard.releaseKey(0x4); break;
-              case sf::Keyboard::W:     emulator.keyboard.releaseKey(0x5); break;
-              case sf::Keyboard::E:     emulator.keyboard.releaseKey(0x6); break;
-              case sf::Keyboard::R:     emulator.keyboard.releaseKey(0xd); break;
-              case sf::Keyboard::A:     emulator.keyboard.releaseKey(0x7); break;
-              case sf::Keyboard::S:     emulator.keyboard.releaseKey(0x8); break;
-              case sf::Keyboard::D:     emulator.keyboard.releaseKey(0x9); break;
-              case sf::Keyboard::F:     emulator.keyboard.releaseKey(0xe); break;
-              case sf::Keyboard::Z:     emulator.keyboard.releaseKey(0xa); break;
-              case sf::Keyboard::X:     emulator.keyboard.releaseKey(0x0); break;
-              case sf::Keyboard::C:     emulator.keyboard.releaseKey(0xb); break;
-              case sf::Keyboard::V:     emulator.keyboard.releaseKey(0xf); break;
+              case sf::Keyboard::Num1:  input.push(0x1, false); break;
+              case sf::Keyboard::Num2:  input.push(0x2, false); break;
+              case sf::Keyboard::Num3:  input.push(0x3, false); break;
+              case sf::Keyboard::Num4:  input.push(0xc, false); break;
+              case sf::Keyboard::Q:     input.push(0x4, false); break;
+              case sf::Keyboard::W:     input.push(0x5, false); break;
+              case sf::Keyboard::E:     input.push(0x6, false); break;
+              case sf::Keyboard::R:     input.push(0xd, false); break;
+              case sf::Keyboard::A:     input.push(0x7, false); break;
+              case sf::Keyboard::S:     input.push(0x8, false); break;
+              case sf::Keyboard::D:     input.push(0x9, false); break;
+              case sf::Keyboard::F:     input.push(0xe, false); break;
+              case sf::Keyboard::Z:     input.push(0xa, false); break;
+              case sf::Keyboard::X:     input.push(0x0, false); break;
+              case sf::Keyboard::C:     input.push(0xb, false); break;
+              case sf::Keyboard::V:     input.push(0xf, false); break;
+              case sf::Keyboard::BackSpace: input.push(REWINDKEY, false); break;
 
             }
             break;
@@ -64,79 +65,73 @@ int eventInput(sf::RenderWindow& window, sf::Event& event, Chip8& emulator)
   return 0;
 }
 
-int draw(sf::RenderWindow& window, Chip8& emulator)
-{
-  sf::RectangleShape rectangle;
-  rectangle.setSize(sf::Vector2f(10, 10));
-  
-  if (emulator.drawStatus())
-  {
-    sf::Color lightGrey(40, 40, 40);
-    sf::Color darkGrey(169, 169, 169);
-    for (int i = 0; i < SCREENSIZE; i++)
-    {
-      rectangle.setPosition((i % 64) * 10, (i / 64) * 10);
-      if (emulator.m_gfx[i] == 1)
-        rectangle.setFillColor(lightGrey);
-          else
-            rectangle.setFillColor(darkGrey);
-          window.draw(rectangle);
-    }
-      window.display();
-  }
-
-}
-
+/* The guest runs on the emulation thread; this UI thread only forwards
+   input and shows the newest frame it published. Returns the guest frames
+   run; failed tells whether the guest stopped on an error. */
 
-int run(Chip8& emulator)
+long run(Chip8& emulator, Engine& engine, Renderer& renderer, long ips, int turbo,
+         RewindBuffer *rewind, InputLog *record, InputLog *replay, RollbackSession *netplay,
+         bool *failed)
 {
 
-  sf::RenderWindow window(sf::VideoMode(HEIGHT * SCALE, WIDTH * SCALE), "Chip8");
+  int scale = renderer.scale();
+  sf::RenderWindow window(sf::VideoMode(HEIGHT * scale, WIDTH * scale), "Chip8");
 
   // clear the window with black color
   window.clear(sf::Color::Yellow);
 
-  sf::Clock clocks;
+  TripleBuffer frames;
+  InputQueue input;
+  EmulationThread emulation(emulator, engine, frames, input, ips);
 
-  sf::Time time1;
-  sf::Time time2;
+  emulation.setTurbo(turbo);
+  emulation.setRewind(rewind);
+  if (replay != NULL)
+    emulation.setReplay(replay);
+  else
+    emulation.setRecording(record);
+  emulation.setNetplay(netplay);
+  emulation.start();
 
-  time1 = clocks.getElapsedTime();
-
-  int opcodesPerSecond = 0;
-  int limit = 10;
-
-  while (window.isOpen())
+  while (window.isOpen() && emulation.running())
   {
     sf::Event event;
 
     while (window.pollEvent(event))
-      eventInput(window, event, emulator);
+      eventInput(window, event, input);
 
-    if (opcodesPerSecond < limit)
-    {
-      emulator.doCycle();
-      if(error != OK)
-      {
-        fprintf(stderr, "Some problem with executing rom. Change this.\n");
-        exit(1);
-      }
-      opcodesPerSecond++;
-    }
+    if (frames.acquire())
+      renderer.present(window, frames.front().rows);
+    else
+      sf::sleep(sf::milliseconds(1));
+  }
 
-    time2 = clocks.getElapsedTime();
+  emulation.stop();
 
-    if (time2.asMilliseconds() - time1.asMilliseconds() >= FREQUENCY)
-    {
-      emulator.decreaseTimers();     
+  /* the input log of a failed session is still saved, to replay it */
+  *failed = emulation.failed();
+  if (*failed)
+  {
+    fprintf(stderr, "Some problem with executing rom. Change this.\n");
+    return emulation.guestFrames();
+  }
 
-      time1 = clocks.getElapsedTime();
-      
-      draw(window, emulator);  
-      opcodesPerSecond = 0;
-    }
+  if (turbo != TURBOOFF)
+  {
+    double seconds = emulation.seconds();
+    if (seconds > 0)
+      fprintf(stderr, "%ld guest frames in %.1f s: %.1fx, %.0f instr/s\n",
+              emulation.guestFrames(), seconds, emulation.guestFrames() / seconds / TIMERHZ,
+              emulation.instructions() / seconds);
+    return emulation.guestFrames();
   }
-  return 0;
+
+  const Scheduler& pacing = emulation.scheduler();
+  fprintf(stderr, "%ld ticks at %ld instr/s: oversleep %.1f us average, %ld us worst; "
+                  "%ld early wake-ups, %ld late ticks, %ld resyncs\n",
+          pacing.ticks(), pacing.ips(), pacing.averageOvershoot(), pacing.worstOvershoot(),
+          pacing.undershoots(), pacing.missed(), pacing.resyncs());
+  return emulation.guestFrames();
 }
   
 void whatErrorAndDie(int whatErr)
@@ -163,6 +158,16 @@ void whatErrorAndDie(int whatErr)
         fprintf(stderr, "Too big file\n");
         exit(1);
       }
+    case BADROM:
+      {
+        fprintf(stderr, "Empty rom\n");
+        exit(1);
+      }
+    default:
+      {
+        fprintf(stderr, "Error %d loading the rom\n", whatErr);
+        exit(1);
+      }
   }
 
 }
@@ -179,18 +184,218 @@ int main(int argc, char **argv)
   }
 
 
-  if (argc != 2)
+  const char *engineName = "interp";
+  const char *profileName = NULL;
+  int scale = DEFAULTSCALE;
+  long ips = DEFAULTIPS;
+  int turbo = TURBOOFF;
+  long rewindKB = DEFAULTREWINDKB;
+  int keyframe = DEFAULTKEYFRAME;
+  const char *recordPath = NULL;
+  const char *replayPath = NULL;
+  uint64_t seed = time(NULL);
+  bool seeded = false;
+  int netPort = 0;
+  const char *peer = NULL;
+  palette colors = Renderer::defaultPalette();
+  int romArg = 1;
+
+  while (romArg + 2 < argc && argv[romArg][0] == '-')
+  {
+    if (strcmp(argv[romArg], "-e") == 0)
+      engineName = argv[romArg + 1];
+    else if (strcmp(argv[romArg], "-q") == 0)
+      profileName = argv[romArg + 1];
+    else if (strcmp(argv[romArg], "-i") == 0)
+      ips = atol(argv[romArg + 1]);
+    else if (strcmp(argv[romArg], "-t") == 0)
+      turbo = atoi(argv[romArg + 1]);
+    else if (strcmp(argv[romArg], "-s") == 0)
+      scale = atoi(argv[romArg + 1]);
+    else if (strcmp(argv[romArg], "-r") == 0)
+      rewindKB = atol(argv[romArg + 1]);
+    else if (strcmp(argv[romArg], "-k") == 0)
+      keyframe = atoi(argv[romArg + 1]);
+    else if (strcmp(argv[romArg], "-R") == 0)
+      recordPath = argv[romArg + 1];
+    else if (strcmp(argv[romArg], "-P") == 0)
+      replayPath = argv[romArg + 1];
+    else if (strcmp(argv[romArg], "-S") == 0)
+    {
+      seed = strtoull(argv[romArg + 1], NULL, 0);
+      seeded = true;
+    }
+    else if (strcmp(argv[romArg], "-N") == 0)
+      netPort = atoi(argv[romArg + 1]);
+    else if (strcmp(argv[romArg], "-C") == 0)
+      peer = argv[romArg + 1];
+    else if (strcmp(argv[romArg], "-p") == 0)
+    {
+      if (Renderer::parsePalette(argv[romArg + 1], &colors) == false)
+      {
+        fprintf(stderr, "Palette must be RRGGBB,RRGGBB (lit, dark)\n");
+        exit(1);
+      }
+    }
+    else
+      break;
+    romArg += 2;
+  }
+
+  if (argc != romArg + 1 || scale < 1 || ips < 1 || turbo < TURBOOFF || rewindKB < 0 ||
+      keyframe < 1 || (peer != NULL) != (netPort > 0) ||
+      (peer != NULL && (turbo != TURBOOFF || recordPath != NULL || replayPath != NULL)))
   {
-    fprintf(stderr, "Usage: ROM file is missing\n");
+    fprintf(stderr, "Usage: emu [-e interp|threaded|jit] [-q classic|vip|chip48|schip] "
+                    "[-i instr/s] [-t render every N frames, 0 for 60 Hz] "
+                    "[-s scale] [-p RRGGBB,RRGGBB] [-r rewind KB, 0 for none] "
+                    "[-k keyframe every N frames] [-R record keys to FILE] "
+                    "[-P replay keys from FILE] [-S random seed] "
+                    "[-N local UDP port -C peer host:port, paced only] ROM\n");
     exit(1);
   }
 
-  int whatErr = emulator.loadBinary(argv[1]);
+  int whatErr = emulator.loadBinary(argv[romArg]);
 
   if(whatErr != OK)
     whatErrorAndDie(whatErr);
-  
-  run(emulator);
+
+  /* -q overrides the profile loadBinary picked for the ROM */
+  if (profileName != NULL)
+  {
+    profile id = Chip8::profileByName(profileName);
+    if (id == PROFILECOUNT)
+    {
+      fprintf(stderr, "Unknown quirk profile %s\n", profileName);
+      exit(1);
+    }
+    emulator.setProfile(id);
+  }
+
+  /* A replay takes seed, profile and speed from its log, and cannot be
+     rewound since the log has the keys of one timeline only */
+  InputLog log;
+
+  if (replayPath != NULL)
+  {
+    whatErr = log.load(replayPath);
+    if (whatErr == OK)
+      whatErr = log.prepare(emulator);
+    if (whatErr != OK)
+    {
+      fprintf(stderr, "Cannot replay %s on this ROM\n", replayPath);
+      exit(1);
+    }
+    ips = log.ips();
+    rewindKB = 0;
+  }
+  else
+  {
+    /* both peers of a netplay session must start from the same machine */
+    if (peer != NULL && !seeded)
+      seed = 0;
+
+    emulator.seed(seed);
+    if (recordPath != NULL)
+      log.begin(emulator, seed, ips);
+  }
+
+  Engine *engine = createEngine(engineName, emulator);
+
+  if (engine == NULL)
+  {
+    fprintf(stderr, "Engine %s is not available\n", engineName);
+    exit(1);
+  }
+
+  Renderer renderer(scale, colors);
+
+  if (renderer.okConstruct == false)
+  {
+    fprintf(stderr, "Cannot create the display texture\n");
+    exit(1);
+  }
+
+  /* Rollbacks restore states of their own, the peer could not follow a
+     rewind */
+  RollbackSession *netplay = NULL;
+  if (peer != NULL)
+  {
+    netplay = new RollbackSession(emulator, *engine, ips);
+    if (netplay->connect(netPort, peer) != OK)
+    {
+      fprintf(stderr, "Cannot play with %s from UDP port %d\n", peer, netPort);
+      exit(1);
+    }
+    rewindKB = 0;
+  }
+
+  /* Backspace held rewinds; the history is kept at the paced speed only */
+  RewindBuffer *rewind = NULL;
+  if (rewindKB > 0)
+  {
+    rewind = new RewindBuffer(rewindKB * 1024, keyframe);
+    if (rewind->okConstruct == false)
+    {
+      fprintf(stderr, "Cannot keep a rewind history in %ld KB\n", rewindKB);
+      exit(1);
+    }
+  }
+
+  bool failed = false;
+  long frames = run(emulator, *engine, renderer, ips, turbo, rewind,
+                    recordPath != NULL ? &log : NULL, replayPath != NULL ? &log : NULL, netplay,
+                    &failed);
+
+  fprintf(stderr, "%ld frames, %.1f us average, %ld us worst\n",
+          renderer.frames(), renderer.averageFrameTime(), renderer.worstFrameTime());
+
+  if (rewind != NULL)
+  {
+    fprintf(stderr, "rewind: %d frames (%.1f s) in %zu of %zu KB, keyframe every %d, "
+                    "%.1f bytes and %.2f us per frame\n",
+            rewind->frames(), (double) rewind->frames() / TIMERHZ, rewind->bytesUsed() / 1024,
+            rewind->budget() / 1024, rewind->keyframeInterval(), rewind->averageEntrySize(),
+            rewind->averageCaptureTime());
+    delete rewind;
+  }
+
+  if (netplay != NULL)
+  {
+    fprintf(stderr, "netplay: %ld frames, %ld rollbacks running %ld frames again, %ld stalls, "
+                    "%ld desyncs, %.3f us snapshot, %.3f us restore\n",
+            netplay->frame(), netplay->rollbacks(), netplay->resimulatedFrames(),
+            netplay->stalls(), netplay->desyncs(), netplay->averageSnapshotTime(),
+            netplay->averageRestoreTime());
+    if (netplay->foreignPackets() > 0)
+      fprintf(stderr, "netplay: %ld packets from a peer running another ROM or seed\n",
+              netplay->foreignPackets());
+    delete netplay;
+  }
+
+  if (recordPath != NULL && replayPath == NULL)
+  {
+    if (log.save(recordPath) != OK)
+      fprintf(stderr, "Cannot write the input log %s\n", recordPath);
+    else
+      fprintf(stderr, "input log: %ld events over %ld frames, seed %llu\n", log.events(),
+              log.frames(), (unsigned long long) log.seed());
+  }
+
+  if (replayPath != NULL)
+  {
+    if (frames < log.frames())
+      fprintf(stderr, "replay: stopped at frame %ld of %ld\n", frames, log.frames());
+    else if (emulator.checksum() != log.finalChecksum())
+      fprintf(stderr, "replay: %ld frames, the final state differs from the recording\n", frames);
+    else
+      fprintf(stderr, "replay: %ld frames, the final state matches the recording\n", frames);
+  }
+
+  if (failed)
+    exit(1);
+
+  delete engine;
  
   return 0;
 
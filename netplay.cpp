@@ -0,0 +1,217 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include "src/chip8/chip8.h"
+#include "src/engine/engine.h"
+#include "src/net/rollbackSession.h"
+
+/* Loopback test of rollback netplay: two peers, each with its own Chip8,
+   engine and thread, play a ROM against each other over UDP on this host.
+   Each holds random keys of its half of the keypad for a few frames at a
+   time. Peers are paced at 60 Hz, the second one starting -d ms after the
+   first so the keys of the other side always arrive late; -u runs them as
+   fast as the rollback window lets them, which rolls back far more.
+   Prints the rollback statistics of both peers and checks they ended in
+   the same state.
+   -e selects the engine, -f the frames, -i the instructions per second,
+   -p the first of the two UDP ports. */
+
+#define NETFRAMES 3600
+#define NETPORT 47800
+#define NETOFFSETMS 8
+#define HOLDFRAMES 12
+
+struct peerJob
+{
+    const char *rom;
+    const char *engineName;
+    int player;
+    int port;
+    long frames;
+    long ips;
+    bool paced;
+    int offsetMs;
+
+    int status;
+    double seconds;
+    RollbackSession *session;
+    Chip8 *cpu;
+    Engine *engine;
+};
+
+/* Keys 0-7 for the first player, 8-F for the second */
+
+static uint16_t nextKeys(uint32_t *random, int player)
+{
+  *random ^= *random << 13;
+  *random ^= *random >> 17;
+  *random ^= *random << 5;
+
+  if (*random % 3 == 0)
+    return 0;
+  return 1 << ((*random >> 8) % (KEYCOUNT / 2) + player * (KEYCOUNT / 2));
+}
+
+static void runPeer(peerJob *job)
+{
+  Chip8& cpu = *job->cpu;
+  RollbackSession& session = *job->session;
+  Scheduler pacing(job->ips);
+  uint32_t random = 2463534242u + job->player;
+  uint16_t keys = 0;
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(job->player * job->offsetMs));
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  pacing.start();
+
+  while (session.frame() < job->frames)
+  {
+    if (job->paced)
+      pacing.waitTick();
+
+    if (session.frame() % HOLDFRAMES == 0)
+      keys = nextKeys(&random, job->player);
+
+    if (!session.advance(keys))
+    {
+      job->status = cpu.errorCode();
+      return;
+    }
+
+    if (!job->paced)
+      std::this_thread::yield();
+  }
+
+  /* until the last frame ran with the peer's real keys */
+  while (session.confirmedFrame() < job->frames - 1)
+  {
+    if (!session.poll())
+    {
+      job->status = cpu.errorCode();
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  job->seconds = elapsed.count();
+  job->status = OK;
+}
+
+int main(int argc, char **argv)
+{
+  const char *engineName = "interp";
+  long frames = NETFRAMES;
+  long ips = DEFAULTIPS;
+  int port = NETPORT;
+  int offsetMs = NETOFFSETMS;
+  bool paced = true;
+  int first = 1;
+
+  while (first < argc && argv[first][0] == '-')
+  {
+    if (strcmp(argv[first], "-u") == 0)
+    {
+      paced = false;
+      first++;
+      continue;
+    }
+
+    if (first + 1 >= argc)
+      break;
+
+    if (strcmp(argv[first], "-e") == 0)
+      engineName = argv[first + 1];
+    else if (strcmp(argv[first], "-f") == 0)
+      frames = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-i") == 0)
+      ips = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-p") == 0)
+      port = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-d") == 0)
+      offsetMs = atoi(argv[first + 1]);
+    else
+      break;
+    first += 2;
+  }
+
+  if (first + 1 != argc || argv[first][0] == '-' || frames < 1 || ips < 1)
+  {
+    fprintf(stderr, "Usage: netplay [-e interp|threaded|jit] [-f frames] [-i instr/s] "
+                    "[-p UDP port] [-d offset ms] [-u] ROM\n");
+    exit(1);
+  }
+
+  peerJob jobs[2];
+  char peers[2][32];
+
+  for (int i = 0; i < 2; i++)
+  {
+    peerJob& job = jobs[i];
+
+    job.rom = argv[first];
+    job.engineName = engineName;
+    job.player = i;
+    job.port = port + i;
+    job.frames = frames;
+    job.ips = ips;
+    job.paced = paced;
+    job.offsetMs = offsetMs;
+    job.status = BADARGUMENT;
+    job.seconds = 0;
+
+    job.cpu = new Chip8();
+    if (!job.cpu->okConstruct || job.cpu->loadBinary(job.rom) != OK)
+    {
+      fprintf(stderr, "%s: cannot load\n", job.rom);
+      exit(1);
+    }
+    job.cpu->seed(0);
+
+    job.engine = createEngine(engineName, *job.cpu);
+    if (job.engine == NULL)
+    {
+      fprintf(stderr, "Engine %s is not available\n", engineName);
+      exit(1);
+    }
+
+    snprintf(peers[i], sizeof(peers[i]), "127.0.0.1:%d", port + 1 - i);
+    job.session = new RollbackSession(*job.cpu, *job.engine, ips);
+    if (job.session->connect(job.port, peers[i]) != OK)
+    {
+      fprintf(stderr, "Cannot bind UDP port %d\n", job.port);
+      exit(1);
+    }
+  }
+
+  std::thread second(runPeer, &jobs[1]);
+  runPeer(&jobs[0]);
+  second.join();
+
+  for (int i = 0; i < 2; i++)
+  {
+    peerJob& job = jobs[i];
+    RollbackSession& session = *job.session;
+
+    printf("peer %d: %ld frames in %.2f s, %ld rollbacks running %ld frames again, "
+           "%ld stalls, %ld desyncs, %.3f us snapshot, %.3f us restore%s\n",
+           i + 1, session.frame(), job.seconds, session.rollbacks(), session.resimulatedFrames(),
+           session.stalls(), session.desyncs(), session.averageSnapshotTime(),
+           session.averageRestoreTime(), job.status != OK ? "  (stopped on error)" : "");
+  }
+
+  bool same = jobs[0].cpu->checksum() == jobs[1].cpu->checksum();
+  printf("final states %s\n", same ? "match" : "DIFFER");
+
+  for (int i = 0; i < 2; i++)
+  {
+    delete jobs[i].session;
+    delete jobs[i].engine;
+    delete jobs[i].cpu;
+  }
+
+  return same ? 0 : 1;
+}
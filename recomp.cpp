@@ -0,0 +1,454 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "src/chip8/chip8.h"
+
+/* Ahead-of-time recompiler: walks a ROM from ENTRYPOINT, finds the code
+   reachable through static control flow and writes a C++ translation unit
+   implementing AotEngine::runGenerated() for it. Each basic block becomes
+   a label; static successors are direct gotos, Ret and Bnnn go through a
+   switch over the known block starts, and anything else is left to the
+   interpreter. The code follows the quirk profile Chip8::loadBinary picks
+   for the ROM. */
+
+static uint8_t memory[MEMORYSIZE];
+static int romSize;
+
+static bool leader[MEMORYSIZE];
+static bool reached[MEMORYSIZE];
+
+static Chip8 *decoder;
+
+/* quirks of the ROM's profile and the name of its policy type */
+static quirkSet quirks;
+static const char *policy;
+
+static const char* policyName(profile id)
+{
+  switch (id)
+  {
+    case PROFILE_VIP:    return "QuirksVip";
+    case PROFILE_CHIP48: return "QuirksChip48";
+    case PROFILE_SCHIP:  return "QuirksSuperChip";
+    default:             return "QuirksClassic";
+  }
+}
+
+static uint16_t opcodeAt(int pc)
+{
+  return (memory[pc] << BYTESIZE) | memory[pc + 1];
+}
+
+static command codeAt(int pc)
+{
+  return Chip8::FSM[decoder->decode(opcodeAt(pc))].code;
+}
+
+/* an instruction the generated code runs itself; the rest is interpreted */
+static bool translatable(int pc)
+{
+  if (pc < ENTRYPOINT || pc + 1 >= ENTRYPOINT + romSize)
+    return false;
+
+  command code = codeAt(pc);
+  uint16_t nnn = ADDRESSMASK(opcodeAt(pc));
+
+  if (code == TRAP)
+    return false;
+  if ((code == JP || code == CALL) && nnn < ENTRYPOINT)
+    return false;
+  return true;
+}
+
+static bool endsBlock(command code)
+{
+  switch (code)
+  {
+    case JP: case CALL: case RET: case JP_REG: case LD_KEY:
+    case SE_CONST: case SNE_CONST: case SE_REG: case SNE_REG:
+    case SKP: case SKNP: case TRAP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void discover()
+{
+  std::vector<int> work;
+
+  leader[ENTRYPOINT] = true;
+  work.push_back(ENTRYPOINT);
+
+  while (!work.empty())
+  {
+    int pc = work.back();
+    work.pop_back();
+
+    if (pc + 1 >= MEMORYSIZE || reached[pc])
+      continue;
+    reached[pc] = true;
+
+    std::vector<int> next;
+
+    if (!translatable(pc))
+    {
+      /* the interpreter runs it; where it goes from there is unknown */
+    }
+    else
+    {
+      uint16_t cmd = opcodeAt(pc);
+
+      switch (codeAt(pc))
+      {
+        case JP:
+          next.push_back(ADDRESSMASK(cmd));
+          break;
+        case CALL:
+          next.push_back(ADDRESSMASK(cmd));
+          next.push_back(pc + NEXT);
+          break;
+        case RET:
+        case JP_REG:
+          break;
+        case SE_CONST: case SNE_CONST: case SE_REG: case SNE_REG:
+        case SKP: case SKNP:
+          next.push_back(pc + NEXT);
+          next.push_back(pc + 2 * NEXT);
+          break;
+        case LD_KEY:
+          next.push_back(pc);
+          next.push_back(pc + NEXT);
+          break;
+        default:
+          next.push_back(pc + NEXT);
+          break;
+      }
+
+      bool branches = endsBlock(codeAt(pc));
+      for (size_t i = 0; i < next.size(); i++)
+      {
+        if (next[i] + 1 >= MEMORYSIZE)
+          continue;
+        if (branches)
+          leader[next[i]] = true;
+        work.push_back(next[i]);
+      }
+    }
+  }
+
+  /* a reached instruction overlapping another one starts its own block */
+  for (int pc = ENTRYPOINT; pc + 1 < MEMORYSIZE; pc++)
+    if (reached[pc] && !translatable(pc))
+      leader[pc] = true;
+}
+
+/* direct jump to a block, or through the dispatcher if it has no label */
+static void emitGoto(FILE *out, int target, const char *indent)
+{
+  if (target + 1 < MEMORYSIZE && reached[target] && leader[target])
+    fprintf(out, "%sgoto b_%03X;\n", indent, target);
+  else
+    fprintf(out, "%s{\n%s  m_cpu.m_PC = 0x%03X;\n%s  goto dispatch;\n%s}\n",
+            indent, indent, target, indent, indent);
+}
+
+/* After a handler that can fail: stop where the interpreter does, past
+   the instruction, with the rest of the block given back */
+static void emitErrorExit(FILE *out, int pc, int remaining)
+{
+  fprintf(out, "  if (m_cpu.m_error != OK)\n");
+  fprintf(out, "  {\n    m_cpu.m_PC = 0x%03X;\n    left += %d;\n    return budget - left;\n  }\n",
+          pc + NEXT, remaining);
+}
+
+static void emitOp(FILE *out, int pc, int remaining)
+{
+  uint16_t cmd = opcodeAt(pc);
+  int x = XMASK(cmd);
+  int y = YMASK(cmd);
+  int kk = CONSTMASK(cmd);
+  int nnn = ADDRESSMASK(cmd);
+
+  fprintf(out, "  /* %03X: %04X */\n", pc, cmd);
+
+  switch (codeAt(pc))
+  {
+    case LD_CONST:  fprintf(out, "  V[%d] = 0x%02X;\n", x, kk); break;
+    case ADD_CONST: fprintf(out, "  V[%d] += 0x%02X;\n", x, kk); break;
+    case LD_REG:    fprintf(out, "  V[%d] = V[%d];\n", x, y); break;
+    case OR:        fprintf(out, "  V[%d] |= V[%d];\n", x, y); break;
+    case AND:       fprintf(out, "  V[%d] &= V[%d];\n", x, y); break;
+    case XOR:       fprintf(out, "  V[%d] ^= V[%d];\n", x, y); break;
+
+    /* same order of VF updates as chip8.cpp */
+    case ADD_REG:
+      fprintf(out, "  V[VF] = (int(V[%d]) + int(V[%d]) < BYTE) ? 0 : 1;\n", x, y);
+      fprintf(out, "  V[%d] += V[%d];\n", x, y);
+      break;
+    case SUB:
+      fprintf(out, "  V[VF] = (V[%d] >= V[%d]) ? 1 : 0;\n", x, y);
+      fprintf(out, "  V[%d] -= V[%d];\n", x, y);
+      break;
+    case SHR:
+      fprintf(out, "  V[VF] = V[%d] & 1;\n", quirks.shiftUsesVy ? y : x);
+      fprintf(out, "  V[%d] = V[%d] >> 1;\n", x, quirks.shiftUsesVy ? y : x);
+      break;
+    case SUBN:
+      fprintf(out, "  V[VF] = (V[%d] >= V[%d]) ? 1 : 0;\n", y, x);
+      fprintf(out, "  V[%d] = V[%d] - V[%d];\n", x, y, x);
+      break;
+    case SHL:
+      fprintf(out, "  V[VF] = V[%d] >> 7;\n", quirks.shiftUsesVy ? y : x);
+      fprintf(out, "  V[%d] = V[%d] << 1;\n", x, quirks.shiftUsesVy ? y : x);
+      break;
+
+    case LD_I:      fprintf(out, "  m_cpu.m_I = 0x%03X;\n", nnn); break;
+    case ADD_I:     fprintf(out, "  m_cpu.m_I += V[%d];\n", x); break;
+    case LD_SPR:    fprintf(out, "  m_cpu.m_I = V[%d] * NUMBERLENGTH;\n", x); break;
+    case LD_REG_DT: fprintf(out, "  V[%d] = m_cpu.m_DelayTimer;\n", x); break;
+    case LD_DT:     fprintf(out, "  m_cpu.m_DelayTimer = V[%d];\n", x); break;
+    case LD_ST:     fprintf(out, "  m_cpu.m_SoundTimer = V[%d];\n", x); break;
+
+    /* reading past the end: the interpreter raises the error */
+    case LD_REG_LOAD:
+      fprintf(out, "  if (m_cpu.m_I + %d > MEMORYSIZE)\n", x + 1);
+      fprintf(out, "  {\n    m_cpu.m_PC = 0x%03X;\n    left += %d;\n    goto interpret;\n  }\n",
+              pc, remaining + 1);
+      fprintf(out, "  for (int i = 0; i <= %d; i++)\n", x);
+      fprintf(out, "    V[i] = m_cpu.m_memory[m_cpu.m_I + i];\n");
+      fprintf(out, "  m_cpu.m_I += %d;\n", memoryStep(quirks.memory, x));
+      break;
+
+    case CLS:       fprintf(out, "  m_cpu.Cls(0x%04X);\n", cmd); break;
+    case RND:       fprintf(out, "  m_cpu.Rnd(0x%04X);\n", cmd); break;
+    case DRW:
+      fprintf(out, "  m_cpu.Drw<%s>(0x%04X);\n", policy, cmd);
+      emitErrorExit(out, pc, remaining);
+      break;
+
+    /* a write into translated code hands over to the interpreter */
+    case LD_BCD:
+    case LD_REG_MEM:
+      fprintf(out, "  from = m_cpu.m_I;\n");
+      if (codeAt(pc) == LD_BCD)
+        fprintf(out, "  m_cpu.Ld_Bcd(0x%04X);\n", cmd);
+      else
+        fprintf(out, "  m_cpu.Ld_Reg_Mem<%s>(0x%04X);\n", policy, cmd);
+      emitErrorExit(out, pc, remaining);
+      fprintf(out, "  if (noteWrite(from, from + %d))\n", codeAt(pc) == LD_BCD ? 3 : x + 1);
+      fprintf(out, "  {\n    m_cpu.m_PC = 0x%03X;\n    left += %d;\n    goto dispatch;\n  }\n",
+              pc + NEXT, remaining);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void emitTerminator(FILE *out, int pc)
+{
+  uint16_t cmd = opcodeAt(pc);
+  int x = XMASK(cmd);
+  int y = YMASK(cmd);
+  int kk = CONSTMASK(cmd);
+  int nnn = ADDRESSMASK(cmd);
+  const char *cond = NULL;
+  char buffer[64];
+
+  fprintf(out, "  /* %03X: %04X */\n", pc, cmd);
+
+  switch (codeAt(pc))
+  {
+    case JP:
+      emitGoto(out, nnn, "  ");
+      return;
+
+    case CALL:
+      fprintf(out, "  if (m_cpu.m_SP >= STACKSIZE)\n");
+      fprintf(out, "  {\n    m_cpu.m_PC = 0x%03X;\n    left++;\n    goto interpret;\n  }\n", pc);
+      fprintf(out, "  m_cpu.m_stack[m_cpu.m_SP++] = 0x%03X;\n", pc);
+      emitGoto(out, nnn, "  ");
+      return;
+
+    case RET:
+      fprintf(out, "  if (m_cpu.m_SP <= 0 || m_cpu.m_SP > STACKSIZE)\n");
+      fprintf(out, "  {\n    m_cpu.m_PC = 0x%03X;\n    left++;\n    goto interpret;\n  }\n", pc);
+      fprintf(out, "  m_cpu.m_PC = m_cpu.m_stack[--m_cpu.m_SP] + NEXT;\n");
+      fprintf(out, "  goto dispatch;\n");
+      return;
+
+    case JP_REG:
+      fprintf(out, "  m_cpu.m_PC = 0x%03X;\n", pc);
+      fprintf(out, "  if (m_cpu.Jp_Reg<%s>(0x%04X) == 0)\n    m_cpu.m_PC += NEXT;\n", policy, cmd);
+      fprintf(out, "  goto dispatch;\n");
+      return;
+
+    case LD_KEY:
+      fprintf(out, "  m_cpu.m_PC = 0x%03X;\n", pc);
+      fprintf(out, "  m_cpu.Ld_Key(0x%04X);\n", cmd);
+      fprintf(out, "  return budget - left;\n");
+      return;
+
+    case SE_CONST:  snprintf(buffer, sizeof(buffer), "V[%d] == 0x%02X", x, kk); cond = buffer; break;
+    case SNE_CONST: snprintf(buffer, sizeof(buffer), "V[%d] != 0x%02X", x, kk); cond = buffer; break;
+    case SE_REG:    snprintf(buffer, sizeof(buffer), "V[%d] == V[%d]", x, y); cond = buffer; break;
+    case SNE_REG:   snprintf(buffer, sizeof(buffer), "V[%d] != V[%d]", x, y); cond = buffer; break;
+    case SKP:       snprintf(buffer, sizeof(buffer), "m_cpu.keyboard.isKeyPressed(V[%d])", x); cond = buffer; break;
+    case SKNP:      snprintf(buffer, sizeof(buffer), "!m_cpu.keyboard.isKeyPressed(V[%d])", x); cond = buffer; break;
+
+    default:
+      break;
+  }
+
+  fprintf(out, "  if (%s)\n", cond);
+  emitGoto(out, pc + 2 * NEXT, "    ");
+  emitGoto(out, pc + NEXT, "  ");
+}
+
+static void emitBlock(FILE *out, int start)
+{
+  fprintf(out, "\nb_%03X:\n", start);
+
+  if (!translatable(start))
+  {
+    fprintf(out, "  m_cpu.m_PC = 0x%03X;\n  goto interpret;\n", start);
+    return;
+  }
+
+  int count = 0;
+  int pc = start;
+  while (true)
+  {
+    count++;
+    if (endsBlock(codeAt(pc)) || pc + NEXT + 1 >= MEMORYSIZE || leader[pc + NEXT] ||
+        !translatable(pc + NEXT))
+      break;
+    pc += NEXT;
+  }
+
+  fprintf(out, "  if (left < %d)\n  {\n    m_cpu.m_PC = 0x%03X;\n    goto interpret;\n  }\n",
+          count, start);
+  fprintf(out, "  left -= %d;\n", count);
+
+  pc = start;
+  for (int i = 0; i < count; i++, pc += NEXT)
+  {
+    if (i == count - 1 && endsBlock(codeAt(pc)))
+    {
+      emitTerminator(out, pc);
+      return;
+    }
+    emitOp(out, pc, count - i - 1);
+  }
+
+  emitGoto(out, pc, "  ");
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: recomp ROM OUTPUT.cpp\n");
+    exit(1);
+  }
+
+  FILE *rom = fopen(argv[1], "rb");
+  if (!rom)
+  {
+    fprintf(stderr, "Bad opening\n");
+    exit(1);
+  }
+
+  romSize = fread(memory + ENTRYPOINT, 1, MEMORYSIZE - ENTRYPOINT + 1, rom);
+  fclose(rom);
+
+  if (romSize <= 0 || romSize > MEMORYSIZE - ENTRYPOINT)
+  {
+    fprintf(stderr, "Too big file\n");
+    exit(1);
+  }
+
+  decoder = new Chip8();
+  decoder->loadBinary(argv[1]);
+  quirks = decoder->quirks();
+  policy = policyName(decoder->quirkProfile());
+  discover();
+
+  FILE *out = fopen(argv[2], "w");
+  if (!out)
+  {
+    fprintf(stderr, "Bad opening\n");
+    exit(1);
+  }
+
+  const char *name = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+
+  fprintf(out, "/* Generated by recomp from %s, do not edit */\n\n", name);
+  fprintf(out, "#include \"src/engine/aotEngine.h\"\n\n");
+  fprintf(out, "const char AotEngine::s_romName[] = \"%s\";\n\n", name);
+  fprintf(out, "const int AotEngine::s_romSize = %d;\n\n", romSize);
+  fprintf(out, "const profile AotEngine::s_profile = %s::id;\n\n", policy);
+
+  fprintf(out, "const uint8_t AotEngine::s_rom[] =\n{");
+  for (int i = 0; i < romSize; i++)
+    fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n  " : " ", memory[ENTRYPOINT + i]);
+  fprintf(out, "\n};\n\n");
+
+  uint8_t code[MEMORYSIZE / BYTESIZE];
+  memset(code, 0, sizeof(code));
+  for (int pc = ENTRYPOINT; pc + 1 < MEMORYSIZE; pc++)
+    if (reached[pc] && translatable(pc))
+    {
+      code[pc / BYTESIZE] |= 1 << (pc % BYTESIZE);
+      code[(pc + 1) / BYTESIZE] |= 1 << ((pc + 1) % BYTESIZE);
+    }
+
+  fprintf(out, "const uint8_t AotEngine::s_code[MEMORYSIZE / BYTESIZE] =\n{");
+  for (int i = 0; i < MEMORYSIZE / BYTESIZE; i++)
+    fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n  " : " ", code[i]);
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "long AotEngine::runGenerated(long budget)\n{\n");
+  fprintf(out, "  uint8_t *V = m_cpu.m_register;\n");
+  fprintf(out, "  long left = budget;\n");
+  fprintf(out, "  int from;\n\n");
+  fprintf(out, "dispatch:\n");
+  fprintf(out, "  if (left <= 0 || m_cpu.m_error != OK || m_cpu.m_keyWait || m_tainted)\n"
+               "    return budget - left;\n\n");
+  fprintf(out, "  switch (m_cpu.m_PC)\n  {\n");
+
+  int blocks = 0;
+  for (int pc = ENTRYPOINT; pc + 1 < MEMORYSIZE; pc++)
+    if (leader[pc] && reached[pc])
+    {
+      fprintf(out, "    case 0x%03X: goto b_%03X;\n", pc, pc);
+      blocks++;
+    }
+
+  fprintf(out, "    default: break;\n  }\n\n");
+  fprintf(out, "interpret:\n");
+  fprintf(out, "  if (left <= 0)\n");
+  fprintf(out, "    return budget - left;\n");
+  fprintf(out, "  stepInterpreted();\n");
+  fprintf(out, "  left--;\n");
+  fprintf(out, "  goto dispatch;\n");
+
+  for (int pc = ENTRYPOINT; pc + 1 < MEMORYSIZE; pc++)
+    if (leader[pc] && reached[pc])
+      emitBlock(out, pc);
+
+  fprintf(out, "}\n");
+  fclose(out);
+
+  int instructions = 0;
+  for (int pc = ENTRYPOINT; pc + 1 < MEMORYSIZE; pc++)
+    if (reached[pc] && translatable(pc))
+      instructions++;
+
+  printf("%s: %d blocks, %d instructions translated\n", name, blocks, instructions);
+
+  delete decoder;
+  return 0;
+}
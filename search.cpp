@@ -0,0 +1,120 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "src/search/stateSearch.h"
+#include "src/thread/scheduler.h"
+
+/* Breadth-first search of the key inputs of a ROM, e.g. to solve a
+   puzzle: prints the states of every level and how fast they were found,
+   and with a goal the shortest key sequence reaching it.
+   -e selects the engine, -j the worker threads (0 for one per hardware
+   thread), -d the deepest level, -k the frames a key is held and then
+   released, -i the instructions per frame, -m the most states kept, -g
+   the goal as address=value in hex. */
+
+#define SEARCHDEPTH 8
+
+int main(int argc, char **argv)
+{
+  const char *engineName = "interp";
+  int threads = 0;
+  int maxDepth = SEARCHDEPTH;
+  int holdFrames = DEFAULTHOLDFRAMES;
+  long instrPerFrame = DEFAULTIPS / 60;
+  long maxStates = DEFAULTMAXSTATES;
+  const char *goal = NULL;
+  int first = 1;
+
+  while (first + 1 < argc && argv[first][0] == '-')
+  {
+    if (strcmp(argv[first], "-e") == 0)
+      engineName = argv[first + 1];
+    else if (strcmp(argv[first], "-j") == 0)
+      threads = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-d") == 0)
+      maxDepth = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-k") == 0)
+      holdFrames = atoi(argv[first + 1]);
+    else if (strcmp(argv[first], "-i") == 0)
+      instrPerFrame = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-m") == 0)
+      maxStates = atol(argv[first + 1]);
+    else if (strcmp(argv[first], "-g") == 0)
+      goal = argv[first + 1];
+    else
+      break;
+    first += 2;
+  }
+
+  char *value = goal != NULL ? (char*) strchr(goal, '=') : NULL;
+
+  if (first + 1 != argc || argv[first][0] == '-' || maxDepth < 1 || instrPerFrame < 1 ||
+      (goal != NULL && value == NULL))
+  {
+    fprintf(stderr, "Usage: search [-e interp|threaded|jit] [-j threads] [-d depth] "
+                    "[-k hold frames] [-i instr/frame] [-m max states] [-g address=value] ROM\n");
+    exit(1);
+  }
+
+  StateSearch search(argv[first], engineName, holdFrames, instrPerFrame, maxStates, threads);
+  if (search.status() != OK)
+  {
+    fprintf(stderr, "%s: cannot start, error %d\n", argv[first], search.status());
+    exit(1);
+  }
+
+  if (goal != NULL)
+    search.setGoal(strtol(goal, NULL, 16), strtol(value + 1, NULL, 16));
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  while (search.depth() < maxDepth)
+  {
+    std::chrono::steady_clock::time_point level = std::chrono::steady_clock::now();
+    long expanded = search.frontier();
+
+    if (!search.expand())
+      break;
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - level;
+
+    printf("depth %2d: %8ld new states, %9ld seen, %.0f forks/s\n", search.depth(),
+           search.frontier(), search.visited(), expanded * SEARCHACTIONS / elapsed.count());
+
+    if (search.found())
+      break;
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  printf("%ld states in %.2f s%s\n", search.visited(), elapsed.count(),
+         search.truncated() ? ", some dropped for lack of room (-m)" : "");
+
+  if (search.status() != OK)
+  {
+    fprintf(stderr, "Search stopped, error %d\n", search.status());
+    exit(1);
+  }
+
+  if (goal == NULL)
+    return 0;
+
+  uint8_t actions[MAXSEARCHDEPTH];
+  int length = search.path(actions);
+
+  if (length < 0)
+  {
+    printf("goal not reached\n");
+    return 1;
+  }
+
+  printf("goal reached in %d actions:", length);
+  for (int i = 0; i < length; i++)
+    if (actions[i] == NOKEY)
+      printf(" -");
+    else
+      printf(" %X", actions[i]);
+  printf("\n");
+
+  return 0;
+}
@@ -1,50 +1,164 @@
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <type_traits>
 #include "chip8.h"
 
-#define ind(x, y) ( ((y + WIDTH) % WIDTH) * HEIGHT + ((x + HEIGHT) % HEIGHT) )
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define ROTR(row, n) (((row) >> (n)) | ((row) << ((HEIGHT - (n)) % HEIGHT)))
+
+template <class Q>
+const struct Chip8::transaction Chip8::Profile<Q>::FSM[FSMSIZE] =
+{
+    [0]  = {CLS,         &Chip8::Cls},
+    [1]  = {RET,         &Chip8::Ret},
+    [2]  = {JP,          &Chip8::Jp},
+    [3]  = {CALL,        &Chip8::Call},
+    [4]  = {SE_CONST,    &Chip8::Se_Const},
+    [5]  = {SNE_CONST,   &Chip8::Sne_Const},
+    [6]  = {SE_REG,      &Chip8::Se_Reg},
+    [7]  = {LD_CONST,    &Chip8::Ld_Const},
+    [8]  = {ADD_CONST,   &Chip8::Add_Const},
+    [9]  = {LD_REG,      &Chip8::Ld_Reg},
+    [10] = {OR,          &Chip8::Or},
+    [11] = {AND,         &Chip8::And},
+    [12] = {XOR,         &Chip8::Xor},
+    [13] = {ADD_REG,     &Chip8::Add_Reg},
+    [14] = {SUB,         &Chip8::Sub},
+    [15] = {SHR,         &Chip8::Shr<Q>},
+    [16] = {SUBN,        &Chip8::SubN},
+    [17] = {SHL,         &Chip8::Shl<Q>},
+    [18] = {SNE_REG,     &Chip8::Sne_Reg},
+    [19] = {LD_I,        &Chip8::Ld_I},
+    [20] = {JP_REG,      &Chip8::Jp_Reg<Q>},
+    [21] = {RND,         &Chip8::Rnd},
+    [22] = {DRW,         &Chip8::Drw<Q>},
+    [23] = {SKP,         &Chip8::Skp},
+    [24] = {SKNP,        &Chip8::Sknp},
+    [25] = {LD_REG_DT,   &Chip8::Ld_Reg_Dt},
+    [26] = {LD_KEY,      &Chip8::Ld_Key},
+    [27] = {LD_DT,       &Chip8::Ld_Dt},
+    [28] = {LD_ST,       &Chip8::Ld_St},
+    [29] = {ADD_I,       &Chip8::Add_I},
+    [30] = {LD_SPR,      &Chip8::Ld_Spr},
+    [31] = {LD_BCD,      &Chip8::Ld_Bcd},
+    [32] = {LD_REG_MEM,  &Chip8::Ld_Reg_Mem<Q>},
+    [33] = {LD_REG_LOAD, &Chip8::Ld_Reg_Load<Q>},
+    [34] = {TRAP,        &Chip8::Trap}
+};
+
+const struct Chip8::transaction (&Chip8::FSM)[FSMSIZE] = Chip8::Profile<QuirksClassic>::FSM;
+
+struct profileEntry
+{
+    const char *name;
+    const struct Chip8::transaction *fsm;
+    quirkSet quirks;
+};
+
+#define PROFILE(name, Q) \
+  { name, Chip8::Profile<Q>::FSM, { Q::shiftUsesVy, Q::memory, Q::clipSprites, Q::jumpUsesVx } }
+
+/* indexed by enum profile */
+static const struct profileEntry profiles[PROFILECOUNT] =
+{
+    PROFILE("classic", QuirksClassic),
+    PROFILE("vip",     QuirksVip),
+    PROFILE("chip48",  QuirksChip48),
+    PROFILE("schip",   QuirksSuperChip)
+};
+
+/* ROMs of the corpus that need another profile, by FNV-1a checksum */
+static const struct
+{
+    uint32_t checksum;
+    profile id;
+} romProfiles[] =
+{
+    { 0x49E5336B, PROFILE_VIP }   /* BLITZ: sprites clip at the bottom */
+};
+
+uint8_t Chip8::s_dispatch[OPCODESPACE];
+
+static_assert(std::is_trivially_copyable<Chip8State>::value, "save states copy Chip8State as bytes");
+static_assert(std::is_trivial<Chip8State>::value, "reset() clears Chip8State as bytes");
+static_assert(sizeof(Chip8State) % CACHELINE == 0, "state blocks are whole cache lines");
+static_assert(offsetof(Chip8State, m_random) + sizeof(uint64_t) == sizeof(Chip8State),
+              "Chip8 members would live in the tail padding of the state");
 
 Chip8::Chip8() : BaseCPU(REGNUM, TIMERSNUM),
-                 m_PC(ENTRYPOINT),
-                 m_SP(0),
-                 m_I(0),
-                 m_DelayTimer(0),
-                 m_SoundTimer(0)
+                 m_fsm(FSM)
 {
+    /* thread-safe one-time table build */
+    static bool dispatchReady = buildDispatch();
+    (void)dispatchReady;
+
     okConstruct = true;
 
-    m_memory   = (uint8_t*)  calloc(MEMORYSIZE, sizeof(uint8_t));
-    m_stack    = (uint16_t*) calloc(STACKSIZE, sizeof(uint16_t));
-    m_register = (uint8_t*)  calloc(m_RegCount, sizeof(uint8_t));
+    reset();
+    m_random = randomState(time(NULL));
+}
 
-    m_gfx = (int*) calloc(SCREENSIZE, sizeof(int));
+void Chip8::reset()
+{
+    /* padding included, so equal machines save equal bytes */
+    memset(static_cast<Chip8State*>(this), 0, sizeof(Chip8State));
 
     m_PC = ENTRYPOINT;
     m_SP = 0;
+    m_I = 0;
 
-    drawFlag = true;
+    m_DelayTimer = 0;
+    m_SoundTimer = 0;
 
-    if(m_memory == NULL || m_stack == NULL || m_register == NULL || m_gfx == NULL)
-      okConstruct = false;
+    setProfile(PROFILE_CLASSIC);
 
-    if (okConstruct)
-    {
-      for(int i = 0; i < FONTSIZE; i++)
-        m_memory[i] = Chip8_fontset[i];
-    }
+    m_dirtyRows = ALLROWS;
+    m_idleCycles = 0;
+
+    m_error = OK;
+    m_random = randomState(0);
+
+    m_keyWait = false;
+    m_waitRegister = 0;
+    m_waitKey = -1;
 
+    memcpy(m_memory, Chip8_fontset, FONTSIZE);
 }
 
 Chip8::~Chip8()
 {
-    free(m_memory);
-    free(m_stack);
-    free(m_register);
+}
+
+void* Chip8::operator new(size_t size) noexcept
+{
+    void *block;
+    return posix_memalign(&block, alignof(Chip8), size) == 0 ? block : NULL;
+}
+
+void* Chip8::operator new[](size_t size) noexcept
+{
+    void *block;
+    return posix_memalign(&block, alignof(Chip8), size) == 0 ? block : NULL;
+}
+
+void Chip8::operator delete(void *block)
+{
+    free(block);
+}
 
-    m_memory = NULL;
-    m_stack = NULL;
-    m_register = NULL;
+void Chip8::operator delete[](void *block)
+{
+    free(block);
 }
 
 void Chip8::dump()
@@ -61,58 +175,381 @@ void Chip8::dump()
 
 }
 
-int FileSize(FILE *file)
+/* The size is checked before anything is written, then the file is read
+   straight into guest memory: no buffer, no second copy. Mapping it costs
+   more than the read for files this small. */
+
+int Chip8::loadBinary(const char* path)
 {
-    if (!file)
-        return BADARGUMENT;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return BADOPEN;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+      close(fd);
+      return BADREAD;
+    }
+
+    size_t size = info.st_size;
+    if (size == 0 || size > MEMORYSIZE - ENTRYPOINT)
+    {
+      close(fd);
+      return size == 0 ? BADROM : BIGFILE;
+    }
 
-    fseek(file, 0, SEEK_END);
+    /* read() may return less than asked for; a ROM cut short is not
+       left over the previous program */
+    uint8_t *program = m_memory + ENTRYPOINT;
+    size_t done = 0;
+    while (done < size)
+    {
+      ssize_t result = read(fd, program + done, size - done);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result <= 0)
+        break;
+      done += result;
+    }
+    close(fd);
 
-    size_t size = ftell(file);
+    if (done != size)
+    {
+      memset(program, 0, MEMORYSIZE - ENTRYPOINT);
+      return BADREAD;
+    }
 
-    rewind(file);
-    return size;
+    setProfile(romProfile(program, size));
+    return OK;
 }
 
-int Chip8::loadBinary(const char* path)
+int Chip8::loadProgram(const uint8_t *rom, size_t size)
 {
+    if (size == 0)
+      return BADROM;
+    if (size > MEMORYSIZE - ENTRYPOINT)
+      return BIGFILE;
 
-    FILE *rom = fopen(path, "rb");
+    memcpy(m_memory + ENTRYPOINT, rom, size);
+    setProfile(romProfile(rom, size));
 
-    if (!rom)
-        return BADOPEN;
+    return OK;
+}
 
-    size_t romSize = FileSize(rom);
+profile Chip8::romProfile(const uint8_t *rom, size_t size)
+{
+    uint32_t checksum = 2166136261u;
 
-    uint8_t *romBuffer = (uint8_t*) calloc(romSize, sizeof(uint8_t));
-    if (romBuffer == NULL)
-        return BADALLOC;
+    for (size_t i = 0; i < size; i++)
+      checksum = (checksum ^ rom[i]) * 16777619u;
 
-    /* Load Chip8 file to buffer */
+    for (size_t i = 0; i < sizeof(romProfiles) / sizeof(romProfiles[0]); i++)
+      if (romProfiles[i].checksum == checksum)
+        return romProfiles[i].id;
 
-    size_t result = fread(romBuffer, sizeof(uint8_t), romSize, rom);
+    return PROFILE_CLASSIC;
+}
 
-    fclose(rom);
+void Chip8::setProfile(profile id)
+{
+    if (id < 0 || id >= PROFILECOUNT)
+      id = PROFILE_CLASSIC;
 
-    if (result != romSize)
-        return BADREAD;
+    m_profile = id;
+    m_fsm = profiles[id].fsm;
+}
 
-    /* Valid memory */
-    if (romSize > MEMORYSIZE - ENTRYPOINT)
-        return BIGFILE;
+profile Chip8::quirkProfile() const
+{
+    return m_profile;
+}
 
-    for (size_t i = 0; i < romSize; i++)
-        m_memory[m_PC + i] = romBuffer[i];
+const quirkSet& Chip8::quirks() const
+{
+    return profiles[m_profile].quirks;
+}
 
-    free(romBuffer);
+const char* Chip8::profileName(profile id)
+{
+    return profiles[id].name;
+}
 
-    return OK;
+profile Chip8::profileByName(const char *name)
+{
+    for (int i = 0; i < PROFILECOUNT; i++)
+      if (strcmp(profiles[i].name, name) == 0)
+        return (profile) i;
 
+    return PROFILECOUNT;
 }
 
 bool Chip8::drawStatus() const
 {
-    return drawFlag;
+    return m_dirtyRows != 0;
+}
+
+uint32_t Chip8::changedRows() const
+{
+    return m_dirtyRows;
+}
+
+void Chip8::clearChangedRows()
+{
+    m_dirtyRows = 0;
+}
+
+bool Chip8::pixel(int x, int y) const
+{
+    return (m_gfx[y] >> (HEIGHT - 1 - x)) & 1;
+}
+
+const uint64_t* Chip8::screen() const
+{
+    return m_gfx;
+}
+
+const uint8_t* Chip8::memory() const
+{
+    return m_memory;
+}
+
+void Chip8::copyState(const Chip8& other)
+{
+    static_cast<Chip8State&>(*this) = other;
+
+    setProfile(m_profile);
+    m_dirtyRows = ALLROWS;
+}
+
+size_t Chip8::stateBlockSize()
+{
+    return sizeof(Chip8State);
+}
+
+void Chip8::copyStateTo(uint8_t *block) const
+{
+    memcpy(block, static_cast<const Chip8State*>(this), sizeof(Chip8State));
+}
+
+void Chip8::copyStateFrom(const uint8_t *block)
+{
+    memcpy(static_cast<Chip8State*>(this), block, sizeof(Chip8State));
+
+    setProfile(m_profile);
+    m_dirtyRows = ALLROWS;
+}
+
+size_t Chip8::stateSize()
+{
+    return sizeof(stateHeader) + sizeof(Chip8State);
+}
+
+#define HASHPRIME1 0x9E3779B185EBCA87ULL
+#define HASHPRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t hashRound(uint64_t lane, uint64_t word)
+{
+    lane += word * HASHPRIME2;
+    lane = (lane << 31) | (lane >> 33);
+    return lane * HASHPRIME1;
+}
+
+/* Four independent multiply-rotate lanes over 32-byte stripes, as in
+   xxHash64, then folded and mixed: four multiplies in flight instead of
+   one chain, which matters once every searched state is hashed.
+   sizeof(Chip8State) is a whole number of stripes. */
+
+static uint64_t stateChecksum(const uint8_t *data, size_t size)
+{
+    uint64_t lanes[4] = { HASHPRIME1 + HASHPRIME2, HASHPRIME2, 0, 0 - HASHPRIME1 };
+
+    for (size_t i = 0; i + 4 * sizeof(uint64_t) <= size; i += 4 * sizeof(uint64_t))
+      for (int lane = 0; lane < 4; lane++)
+      {
+        uint64_t word;
+        memcpy(&word, data + i + lane * sizeof(uint64_t), sizeof(word));
+        lanes[lane] = hashRound(lanes[lane], word);
+      }
+
+    uint64_t hash = size;
+    for (int lane = 0; lane < 4; lane++)
+      hash = (hash ^ hashRound(0, lanes[lane])) * HASHPRIME1 + lane;
+
+    hash ^= hash >> 33;
+    hash *= HASHPRIME2;
+    hash ^= hash >> 29;
+    hash *= HASHPRIME1;
+    return hash ^ (hash >> 32);
+}
+
+void Chip8::saveState(uint8_t *out) const
+{
+    stateHeader header;
+    const uint8_t *state = (const uint8_t*) static_cast<const Chip8State*>(this);
+
+    header.magic = STATEMAGIC;
+    header.version = STATEVERSION;
+    header.size = sizeof(Chip8State);
+    header.reserved = 0;
+    header.checksum = stateChecksum(state, sizeof(Chip8State));
+
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), state, sizeof(Chip8State));
+}
+
+/* The checksum only catches accidents, anyone can forge it: the fields
+   the handlers use as indices are checked before the block is taken */
+
+template <class T>
+static T stateField(const uint8_t *state, size_t offset)
+{
+    T value;
+    memcpy(&value, state + offset, sizeof(value));
+    return value;
+}
+
+static bool stateFieldsValid(const uint8_t *state)
+{
+    int waitRegister = stateField<int>(state, offsetof(Chip8State, m_waitRegister));
+    int waitKey = stateField<int>(state, offsetof(Chip8State, m_waitKey));
+    uint16_t sp = stateField<uint16_t>(state, offsetof(Chip8State, m_SP));
+    profile p = stateField<profile>(state, offsetof(Chip8State, m_profile));
+
+    return waitRegister >= 0 && waitRegister < REGNUM &&
+           sp <= STACKSIZE &&
+           waitKey >= -1 && waitKey < KEYCOUNT &&
+           p >= 0 && p < PROFILECOUNT;
+}
+
+int Chip8::loadState(const uint8_t *data, size_t size)
+{
+    stateHeader header;
+
+    if (size != stateSize())
+      return BADSTATE;
+
+    memcpy(&header, data, sizeof(header));
+    data += sizeof(header);
+
+    if (header.magic != STATEMAGIC || header.version != STATEVERSION ||
+        header.size != sizeof(Chip8State) ||
+        header.checksum != stateChecksum(data, sizeof(Chip8State)) ||
+        !stateFieldsValid(data))
+      return BADSTATE;
+
+    memcpy(static_cast<Chip8State*>(this), data, sizeof(Chip8State));
+
+    /* a bool byte other than 0 or 1 is undefined to read */
+    uint8_t *keyWait = (uint8_t*) &m_keyWait;
+    *keyWait = *keyWait != 0;
+    keyboard.normalise();
+
+    setProfile(m_profile);
+    m_dirtyRows = ALLROWS;
+    return OK;
+}
+
+int Chip8::saveState(const char *path) const
+{
+    uint8_t *buffer = (uint8_t*) malloc(stateSize());
+    if (buffer == NULL)
+      return BADALLOC;
+
+    saveState(buffer);
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+      free(buffer);
+      return BADOPEN;
+    }
+
+    size_t written = fwrite(buffer, 1, stateSize(), file);
+    int closed = fclose(file);
+
+    free(buffer);
+    return written == stateSize() && closed == 0 ? OK : BADREAD;
+}
+
+int Chip8::loadState(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+      return BADOPEN;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size != stateSize())
+    {
+      close(fd);
+      return BADSTATE;
+    }
+
+    void *mapped = mmap(NULL, stateSize(), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+      return BADREAD;
+
+    int result = loadState((const uint8_t*) mapped, stateSize());
+
+    munmap(mapped, stateSize());
+    return result;
+}
+
+uint64_t Chip8::checksum() const
+{
+    return stateChecksum((const uint8_t*) static_cast<const Chip8State*>(this), sizeof(Chip8State));
+}
+
+void Chip8::seed(uint64_t value)
+{
+    m_random = randomState(value);
+}
+
+/* XORs count masks into consecutive rows, returns the OR of the pixels
+   the masks hit that were already lit */
+
+static uint64_t xorRows(uint64_t *rows, const uint64_t *masks, int count)
+{
+  uint64_t hit = 0;
+  int i = 0;
+
+#if defined(__AVX2__)
+  __m256i wide = _mm256_setzero_si256();
+  for (; i + 4 <= count; i += 4)
+  {
+    __m256i row  = _mm256_loadu_si256((const __m256i*) (rows + i));
+    __m256i mask = _mm256_loadu_si256((const __m256i*) (masks + i));
+
+    wide = _mm256_or_si256(wide, _mm256_and_si256(row, mask));
+    _mm256_storeu_si256((__m256i*) (rows + i), _mm256_xor_si256(row, mask));
+  }
+  __m128i acc = _mm_or_si128(_mm256_castsi256_si128(wide), _mm256_extracti128_si256(wide, 1));
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+#endif
+
+#if defined(__SSE2__)
+  for (; i + 2 <= count; i += 2)
+  {
+    __m128i row  = _mm_loadu_si128((const __m128i*) (rows + i));
+    __m128i mask = _mm_loadu_si128((const __m128i*) (masks + i));
+
+    acc = _mm_or_si128(acc, _mm_and_si128(row, mask));
+    _mm_storeu_si128((__m128i*) (rows + i), _mm_xor_si128(row, mask));
+  }
+  acc = _mm_or_si128(acc, _mm_unpackhi_epi64(acc, acc));
+  hit = (uint64_t) _mm_cvtsi128_si64(acc);
+#endif
+
+  for (; i < count; i++)
+  {
+    hit |= rows[i] & masks[i];
+    rows[i] ^= masks[i];
+  }
+
+  return hit;
 }
 
 /* @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@ */
@@ -123,8 +560,11 @@ bool Chip8::drawStatus() const
 
 int Chip8::Cls(int opcode)
 {
-    for (int i = 0; i < SCREENSIZE; i++)
-      m_gfx[i] = 0;
+    for (int y = 0; y < WIDTH; y++)
+      if (m_gfx[y] != 0)
+        m_dirtyRows |= 1u << y;
+
+    memset(m_gfx, 0, ROWBYTES);
 
     return 0;
 }
@@ -134,9 +574,9 @@ int Chip8::Cls(int opcode)
 int Chip8::Ret(int opcode)
 {
 
-  if (m_SP <= 0 || m_SP >= STACKSIZE)
+  if (m_SP <= 0 || m_SP > STACKSIZE)
   {
-    error = STACKERROR;
+    m_error = STACKERROR;
     return 0;
   }
 
@@ -152,7 +592,7 @@ int Chip8::Jp(int opcode)
 
   if (address < ENTRYPOINT || address >= MEMORYSIZE)
   {
-    error = ADDRESSERR;
+    m_error = ADDRESSERR;
     return 0;
   }
 
@@ -168,9 +608,16 @@ int Chip8::Call(int opcode)
 
   if (address < ENTRYPOINT || address >= MEMORYSIZE)
   {
-    error = ADDRESSERR;
+    m_error = ADDRESSERR;
+    return 0;
+  }
+
+  if (m_SP >= STACKSIZE)
+  {
+    m_error = STACKERROR;
     return 0;
   }
+
   m_stack[m_SP++] = m_PC;
   m_PC = address;
   return 1;
@@ -312,12 +759,14 @@ int Chip8::Sub(int opcode)
 
 // 8xy6 - SHR Vx {, Vy}
 
+template <class Q>
 int Chip8::Shr(int opcode)
 {
   int x_reg = XMASK(opcode);
+  int src = Q::shiftUsesVy ? YMASK(opcode) : x_reg;
 
-  m_register[VF] = m_register[x_reg] & 1;
-  m_register[x_reg] >>= 1;
+  m_register[VF] = m_register[src] & 1;
+  m_register[x_reg] = m_register[src] >> 1;
   return 0;
 }
 
@@ -339,12 +788,14 @@ int Chip8::SubN(int opcode)
 
 // 8xyE - SHL Vx, {, Vy}
 
+template <class Q>
 int Chip8::Shl(int opcode)
 {
   int x_reg = XMASK(opcode);
+  int src = Q::shiftUsesVy ? YMASK(opcode) : x_reg;
 
-  m_register[VF] = m_register[x_reg] >> 7; // TO DO
-  m_register[x_reg] <<= 1;
+  m_register[VF] = m_register[src] >> 7; // TO DO
+  m_register[x_reg] = m_register[src] << 1;
   return 0;
 }
 
@@ -370,19 +821,20 @@ int Chip8::Ld_I(int opcode)
   return 0;
 }
 
-// Bnnn - JP V0, addr
+// Bnnn - JP V0, addr (Bxnn - JP Vx, xnn with jumpUsesVx)
 
+template <class Q>
 int Chip8::Jp_Reg(int opcode)
 {
   uint16_t address = ADDRESSMASK(opcode);
 
   if (address < ENTRYPOINT || address >= MEMORYSIZE)
   {
-    error = ADDRESSERR;
+    m_error = ADDRESSERR;
     return 0;
   }
 
-  m_PC = m_register[V0] + address;
+  m_PC = m_register[Q::jumpUsesVx ? XMASK(opcode) : V0] + address;
   return 1;
 }
 
@@ -393,44 +845,58 @@ int Chip8::Rnd(int opcode)
   int x_reg  = XMASK(opcode);
   int kk = (CONSTMASK(opcode));
 
-  srand( time(NULL) );
-  m_register[x_reg] = (rand() % 255) & kk; // TO DO
+  m_register[x_reg] = randomByte(&m_random) & kk;
   return 0;
 }
 
 // DXYN - Drw sprite(N bytes) begining Vx, Vy
 
+template <class Q>
 int Chip8::Drw(int opcode)
 {
   int x_reg = XMASK(opcode);
   int y_reg = YMASK(opcode);
   int n = NIBBLE(opcode);
 
-  int startX = m_register[x_reg];
-  int startY = m_register[y_reg];
-  drawFlag = false;
+  if (m_I + n > MEMORYSIZE)
+  {
+    m_error = ADDRESSERR;
+    return 0;
+  }
+
+  /* both profiles wrap the start, only wrapping rotates the rest around */
+  int startX = m_register[x_reg] % HEIGHT;
+  int startY = m_register[y_reg] % WIDTH;
+
+  uint64_t masks[16];
+  uint64_t spriteRows = 0;
 
-  m_register[VF] = 0;
   for (int y = 0; y < n; y++)
   {
-    int pixels = m_memory[m_I + y];
-    for (int x = 0; x < BYTESIZE; x++)
-    {
+    uint64_t sprite = (uint64_t) m_memory[m_I + y] << (HEIGHT - BYTESIZE);
 
-      int *pixel = m_gfx + ind(startX + x, startY + y);
-      int bit = (pixels >> (7 - x)) & 0x1;
-      if (*pixel ^ bit != 0)
-        drawFlag = true;
-
-      if (bit)
-      {
-        if (*pixel)
-          m_register[VF] = 1;
-        *pixel ^= 1;
-      }
-    }
+    masks[y] = Q::clipSprites ? sprite >> startX : ROTR(sprite, startX);
+    if (masks[y] != 0)
+      spriteRows |= 1u << y;
   }
- 
+
+  /* rows past the bottom are dropped or continue from the top */
+  int first = n;
+  if (startY + n > WIDTH)
+    first = WIDTH - startY;
+
+  uint64_t hit = xorRows(m_gfx + startY, masks, first);
+  if (!Q::clipSprites)
+    hit |= xorRows(m_gfx, masks + first, n - first);
+
+  /* a non-empty mask always flips its row; the bits shifted past WIDTH
+     are the rows that wrapped to the top */
+  spriteRows <<= startY;
+  m_dirtyRows |= (uint32_t) spriteRows;
+  if (!Q::clipSprites)
+    m_dirtyRows |= (uint32_t) (spriteRows >> WIDTH);
+
+  m_register[VF] = hit != 0;
   return 0;
 }
 
@@ -470,13 +936,12 @@ int Chip8::Ld_Reg_Dt(int opcode)
 
 int Chip8::Ld_Key(int opcode)
 {
-  int x_reg = XMASK(opcode);
-
-  int key = keyboard.isAnyKeyPressed();
-  if (key != -1)
+  /* PC stays on the instruction, releaseKey completes it */
+  if (!m_keyWait)
   {
-    m_register[x_reg] = key;
-    return 0;
+    m_keyWait = true;
+    m_waitRegister = XMASK(opcode);
+    m_waitKey = -1;
   }
   return 1;
 }
@@ -526,6 +991,12 @@ int Chip8::Ld_Bcd(int opcode)
 {
   int x_reg = XMASK(opcode);
 
+  if (m_I + 3 > MEMORYSIZE)
+  {
+    m_error = ADDRESSERR;
+    return 0;
+  }
+
   /* BCD (123) -> 1 2 3 */
 
   m_memory[m_I] = m_register[x_reg] / 100;
@@ -536,30 +1007,54 @@ int Chip8::Ld_Bcd(int opcode)
 
 // Fx55 - LD [I], Vx
 
+template <class Q>
 int Chip8::Ld_Reg_Mem(int opcode)
 {
   int x_reg = XMASK(opcode);
 
+  if (m_I + x_reg + 1 > MEMORYSIZE)
+  {
+    m_error = ADDRESSERR;
+    return 0;
+  }
+
   for (int i = 0; i <= x_reg; i++)
     m_memory[m_I + i] = m_register[i];
 
-  m_I += x_reg + 1;
+  m_I += memoryStep(Q::memory, x_reg);
   return 0;
 }
 
 // FX65 - LD Vx, [I]
 
+template <class Q>
 int Chip8::Ld_Reg_Load(int opcode)
 {
   int x_reg = XMASK(opcode);
 
+  if (m_I + x_reg + 1 > MEMORYSIZE)
+  {
+    m_error = ADDRESSERR;
+    return 0;
+  }
+
   for (int i = 0; i <= x_reg; i++)
     m_register[i] = m_memory[m_I + i];
 
-  m_I += x_reg + 1;
+  m_I += memoryStep(Q::memory, x_reg);
   return 0;
 }
 
+// Any opcode without a handler
+
+int Chip8::Trap(int opcode)
+{
+  /* keeps the ADDRESSERR of a fetch past the end */
+  if (m_error == OK)
+    m_error = UNKNOWN;
+  return 1;
+}
+
 /* End Of ListFunctions */
 
 
@@ -574,6 +1069,13 @@ void Chip8::decreaseTimers()
 
 uint16_t Chip8::fetch()
 {
+  /* the opcode would straddle the end of memory; 0 traps */
+  if (m_PC > MEMORYSIZE - NEXT)
+  {
+    m_error = ADDRESSERR;
+    return 0;
+  }
+
   /* end of executing */
   if ((m_memory[m_PC] == 0) && (m_memory[m_PC + 1] == 0))
     return 0;
@@ -583,12 +1085,11 @@ uint16_t Chip8::fetch()
   return result;
 }
 
-// have to add operator switch
+/* Reduce an opcode to the key used in FSM (see enum command) */
 
-uint16_t Chip8::decode(uint16_t cmd)
+uint16_t Chip8::classify(uint16_t cmd)
 {
   uint8_t first  = NIBBLE((cmd >> 12));
-  uint8_t second = NIBBLE((cmd >> 8));
   uint8_t third  = NIBBLE((cmd >> 4));
   uint8_t fourth = NIBBLE((cmd));
 
@@ -606,21 +1107,166 @@ uint16_t Chip8::decode(uint16_t cmd)
   return result;
 }
 
+bool Chip8::buildDispatch()
+{
+  for (int cmd = 0; cmd < OPCODESPACE; cmd++)
+  {
+    uint16_t key = classify(cmd);
+
+    s_dispatch[cmd] = TRAPINDEX;
+    for (int i = 0; i < TRAPINDEX; i++)
+      if (key == FSM[i].code)
+      {
+        s_dispatch[cmd] = i;
+        break;
+      }
+  }
+  return true;
+}
+
+/* Returns the FSM index of the handler, a single table load */
+
+uint16_t Chip8::decode(uint16_t cmd)
+{
+  return s_dispatch[cmd];
+}
+
 void Chip8::execute(uint16_t decodedCmd, uint16_t cmd)
 {
-  transaction_callBack cw = NULL;
-  for (int i = 0; i < 34; i++)
-    if (decodedCmd == FSM[i].code)
-    {
-      /* call system function */
-      cw = FSM[i].worker;
-      int goNext = (this->*cw)(cmd);
-      if(goNext == 0)
-        m_PC += NEXT;
-      break;
-    }
-  if (cw == NULL)
-    error = UNKNOWN;
+  /* call system function */
+  int goNext = (this->*m_fsm[decodedCmd].worker)(cmd);
+  if (goNext == 0)
+    m_PC += NEXT;
+}
+
+/* Tells CpuCore whether the instruction just executed has to end a batch */
+
+stopReason Chip8::stopCause(uint16_t decodedCmd)
+{
+  switch (FSM[decodedCmd].code)
+  {
+    case LD_KEY:
+      return STOP_KEYWAIT;
+
+    case CLS:
+    case DRW:
+      return STOP_DRAW;
+
+    case LD_REG_DT:
+      return isIdleLoop(m_PC - NEXT) && idleSpins(m_PC - NEXT) ? STOP_IDLE : STOP_NONE;
+
+    default:
+      return STOP_NONE;
+  }
+}
+
+bool Chip8::isIdleLoop(uint16_t head) const
+{
+  if (head + 3 * NEXT > MEMORYSIZE)
+    return false;
+
+  uint16_t load = (m_memory[head] << BYTESIZE) | m_memory[head + 1];
+  uint16_t skip = (m_memory[head + 2] << BYTESIZE) | m_memory[head + 3];
+  uint16_t jump = (m_memory[head + 4] << BYTESIZE) | m_memory[head + 5];
+
+  if ((load & 0xF0FF) != 0xF007)
+    return false;
+
+  if ((skip & 0xF000) != 0x3000 && (skip & 0xF000) != 0x4000)
+    return false;
+
+  return XMASK(skip) == XMASK(load) && jump == (0x1000 | head);
 }
 
+/* true when, with Vx reloaded from the delay timer, the skip is not
+   taken and the loop goes round again */
+
+bool Chip8::idleSpins(uint16_t head) const
+{
+  uint16_t skip = (m_memory[head + 2] << BYTESIZE) | m_memory[head + 3];
+  bool equal = m_DelayTimer == CONSTMASK(skip);
+
+  return (skip & 0xF000) == 0x3000 ? !equal : equal;
+}
+
+long Chip8::skipIdle(uint16_t head, long left)
+{
+  int phase = (m_PC - head) / NEXT;
+
+  m_register[XMASK(m_memory[head] << BYTESIZE)] = m_DelayTimer;
+  m_PC = head + NEXT * ((phase + left) % 3);
+  m_idleCycles += left;
+
+  return left;
+}
+
+/* Fx0A takes the first key pressed after it started waiting, once that
+   key is released again */
+
+void Chip8::pressKey(uint8_t key)
+{
+  keyboard.pressKey(key);
+
+  if (m_keyWait && m_waitKey == -1)
+    m_waitKey = key;
+}
+
+void Chip8::releaseKey(uint8_t key)
+{
+  keyboard.releaseKey(key);
+
+  if (m_keyWait && m_waitKey == key)
+  {
+    m_register[m_waitRegister] = key;
+    m_PC += NEXT;
+    m_keyWait = false;
+  }
+}
+
+int Chip8::errorCode() const
+{
+  return m_error;
+}
+
+void Chip8::clearError()
+{
+  m_error = OK;
+}
+
+uint16_t Chip8::programCounter() const
+{
+  return m_PC;
+}
+
+bool Chip8::waitingForKey() const
+{
+  return m_keyWait;
+}
+
+bool Chip8::timersRunning() const
+{
+  return m_DelayTimer > 0 || m_SoundTimer > 0;
+}
+
+long Chip8::idleCycles() const
+{
+  return m_idleCycles;
+}
+
+template class CpuCore<Chip8>;
+
+/* The profile tables and the handlers they instantiate live here only */
+
+#define INSTANTIATE_PROFILE(Q)                          \
+  template struct Chip8::Profile<Q>;                    \
+  template int Chip8::Shr<Q>(int opcode);               \
+  template int Chip8::Shl<Q>(int opcode);               \
+  template int Chip8::Jp_Reg<Q>(int opcode);            \
+  template int Chip8::Drw<Q>(int opcode);               \
+  template int Chip8::Ld_Reg_Mem<Q>(int opcode);        \
+  template int Chip8::Ld_Reg_Load<Q>(int opcode);
 
+INSTANTIATE_PROFILE(QuirksClassic)
+INSTANTIATE_PROFILE(QuirksVip)
+INSTANTIATE_PROFILE(QuirksChip48)
+INSTANTIATE_PROFILE(QuirksSuperChip)
@@ -4,7 +4,10 @@
 
 #include "../systemData.h"
 #include "../cpu/cpuBase.h"
+#include "../cpu/cpuCore.h"
 #include "../keyboard/keyboard.h"
+#include "guestRandom.h"
+#include "quirks.h"
 #include <cstring>
 #include <fstream>
 #include <cstdio>
@@ -19,6 +22,8 @@
 #define SCREENSIZE 2048
 #define HEIGHT 64
 #define WIDTH 32
+#define ROWBYTES (WIDTH * sizeof(uint64_t))
+#define ALLROWS 0xFFFFFFFFu
 #define REGNUM 16
 #define TIMERSNUM 2
 #define FONTSIZE 80
@@ -28,6 +33,9 @@
 #define NIBBLE(arg) (arg & 0x000F)
 #define CONSTMASK(arg) (arg & 0x00FF)
 #define NUMBERLENGTH 0x5
+#define OPCODESPACE 0x10000
+#define FSMSIZE 35
+#define TRAPINDEX (FSMSIZE - 1)
 
 #define V0 0x0
 #define V1 0x1
@@ -46,7 +54,63 @@
 #define VE 0xE
 #define VF 0xF
 
-class Chip8 : public BaseCPU
+#define CACHELINE 64
+
+/* Everything that makes up a running guest, in one trivially copyable
+   block: a save state is this struct and restoring one is a single copy.
+   Chip8 inherits the members, so the handlers and engines address them
+   as before. The block is aligned and sized to whole cache lines, so
+   copies of it never share a line with anything else. */
+
+struct alignas(CACHELINE) Chip8State
+{
+    uint8_t m_memory[MEMORYSIZE];
+    uint64_t m_gfx[WIDTH];
+    uint16_t m_stack[STACKSIZE];
+    uint8_t m_register[REGNUM];
+
+    uint16_t m_PC;
+    uint16_t m_SP;
+    uint16_t m_I;
+
+    int m_DelayTimer;
+    int m_SoundTimer;
+
+    Chip8Keyboard keyboard;
+
+    profile m_profile;
+    int m_error;
+
+    /* pending Fx0A: its Vx and the key pressed since, -1 if none */
+    bool m_keyWait;
+    int m_waitRegister;
+    int m_waitKey;
+
+    /* up to the end of the last cache line; resize it when the fields
+       change, the static_asserts in chip8.cpp tell by how much */
+    uint8_t m_reserved[16];
+
+    /* Cxkk generator; last, so the struct ends on a line and leaves no
+       tail padding for Chip8 to put its own members in */
+    uint64_t m_random;
+};
+
+/* Header of a save state, followed by the Chip8State bytes in host byte
+   order; size and version reject states of another build */
+
+#define STATEMAGIC 0x54533843u      /* "C8ST" */
+#define STATEVERSION 3
+
+struct stateHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+
+class Chip8 : public BaseCPU, public CpuCore<Chip8>, private Chip8State
 {
 
     public :
@@ -61,49 +125,41 @@ class Chip8 : public BaseCPU
             transaction_callBack worker;
         };
 
-        struct transaction FSM[34] =
+        /* Opcode table of a quirk profile: FSM[decode(cmd)] handles cmd,
+           the last entry traps. The handlers that depend on a quirk are
+           instantiated for Q. */
+
+        template <class Q>
+        struct Profile
         {
-            [0]  = {CLS,         &Chip8::Cls},
-            [1]  = {RET,         &Chip8::Ret},
-            [2]  = {JP,          &Chip8::Jp},
-            [3]  = {CALL,        &Chip8::Call},
-            [4]  = {SE_CONST,    &Chip8::Se_Const},
-            [5]  = {SNE_CONST,   &Chip8::Sne_Const},
-            [6]  = {SE_REG,      &Chip8::Se_Reg},
-            [7]  = {LD_CONST,    &Chip8::Ld_Const},
-            [8]  = {ADD_CONST,   &Chip8::Add_Const},
-            [9]  = {LD_REG,      &Chip8::Ld_Reg},
-            [10] = {OR,          &Chip8::Or},
-            [11] = {AND,         &Chip8::And},
-            [12] = {XOR,         &Chip8::Xor},
-            [13] = {ADD_REG,     &Chip8::Add_Reg},
-            [14] = {SUB,         &Chip8::Sub},
-            [15] = {SHR,         &Chip8::Shr},
-            [16] = {SUBN,        &Chip8::SubN},
-            [17] = {SHL,         &Chip8::Shl},
-            [18] = {SNE_REG,     &Chip8::Sne_Reg},
-            [19] = {LD_I,        &Chip8::Ld_I},
-            [20] = {JP_REG,      &Chip8::Jp_Reg},
-            [21] = {RND,         &Chip8::Rnd},
-            [22] = {DRW,         &Chip8::Drw},
-            [23] = {SKP,         &Chip8::Skp},
-            [24] = {SKNP,        &Chip8::Sknp},
-            [25] = {LD_REG_DT,   &Chip8::Ld_Reg_Dt},
-            [26] = {LD_KEY,      &Chip8::Ld_Key},
-            [27] = {LD_DT,       &Chip8::Ld_Dt},
-            [28] = {LD_ST,       &Chip8::Ld_St},
-            [29] = {ADD_I,       &Chip8::Add_I},
-            [30] = {LD_SPR,      &Chip8::Ld_Spr},
-            [31] = {LD_BCD,      &Chip8::Ld_Bcd},
-            [32] = {LD_REG_MEM,  &Chip8::Ld_Reg_Mem},
-            [33] = {LD_REG_LOAD, &Chip8::Ld_Reg_Load}
+            static const struct transaction FSM[FSMSIZE];
         };
 
+        /* Table of the classic profile; the command codes are the same in
+           every profile */
+
+        static const struct transaction (&FSM)[FSMSIZE];
+
 
         virtual ~Chip8();
 
+        /* Reads the ROM file at path straight to ENTRYPOINT and picks its
+           profile; BADOPEN, BADREAD for anything but a regular file or a
+           read that ends early, which leaves the program area cleared
+           and the profile as it was, or the errors of loadProgram */
         virtual int loadBinary(const char* path);
 
+        /* Copies a ROM already in memory to ENTRYPOINT and picks its
+           profile, e.g. the same bytes into many machines; BADROM when
+           empty, BIGFILE when it does not fit */
+        int loadProgram(const uint8_t *rom, size_t size);
+
+        /* Back to the machine the constructor made, without allocating:
+           font in place, everything else cleared, classic profile and the
+           generator seeded with 0. Engines driving this Chip8 must be
+           flushed afterwards. */
+        void reset();
+
         /* List of function chip-8 */
 
         int        Cls(int opcode);
@@ -121,14 +177,10 @@ class Chip8 : public BaseCPU
         int        Xor(int opcode);
         int    Add_Reg(int opcode);
         int        Sub(int opcode);
-        int        Shr(int opcode);
         int       SubN(int opcode);
-        int        Shl(int opcode);
         int    Sne_Reg(int opcode);
         int       Ld_I(int opcode);
-        int     Jp_Reg(int opcode);
         int        Rnd(int opcode);
-        int        Drw(int opcode);
         int        Skp(int opcode);
         int       Sknp(int opcode);
         int     Ld_Key(int opcode);
@@ -137,9 +189,17 @@ class Chip8 : public BaseCPU
         int      Ld_St(int opcode);
         int     Ld_Spr(int opcode);
         int      Add_I(int opcode);
-        int Ld_Reg_Mem(int opcode);
         int     Ld_Bcd(int opcode);
-        int Ld_Reg_Load(int opcode);
+        int       Trap(int opcode);
+
+        /* Handlers that depend on the quirk profile */
+
+        template <class Q> int         Shr(int opcode);
+        template <class Q> int         Shl(int opcode);
+        template <class Q> int      Jp_Reg(int opcode);
+        template <class Q> int         Drw(int opcode);
+        template <class Q> int  Ld_Reg_Mem(int opcode);
+        template <class Q> int Ld_Reg_Load(int opcode);
 
         /* @-------------------@  */
 
@@ -149,32 +209,136 @@ class Chip8 : public BaseCPU
         virtual uint16_t decode(uint16_t cmd);
         virtual void execute(uint16_t decodedCmd, uint16_t cmd);
 
+        /* Picked by loadBinary from the ROM checksum, classic if unknown */
+        void setProfile(profile id);
+        profile quirkProfile() const;
+        const quirkSet& quirks() const;
+
+        static const char* profileName(profile id);
+
+        /* PROFILECOUNT for an unknown name */
+        static profile profileByName(const char *name);
+
+        /* True while changedRows() is not empty */
         bool drawStatus() const;
+
+        /* Bit y set for every row Drw or Cls changed since the last
+           clearChangedRows(), which a frame consumer calls once it has
+           copied them out */
+        uint32_t changedRows() const;
+        void clearChangedRows();
+
+        /* The display is WIDTH rows of HEIGHT pixels, one uint64_t per row
+           with the leftmost pixel in the top bit */
+        bool pixel(int x, int y) const;
+        const uint64_t* screen() const;
         void decreaseTimers();
 
+        /* Read-only view of the MEMORYSIZE bytes of guest memory */
+        const uint8_t* memory() const;
+
+        /* Takes over the whole guest state of other: memory, registers,
+           stack, display, timers, keys, profile, error and Fx0A wait.
+           Engines driving this Chip8 must be flushed afterwards. */
+        void copyState(const Chip8& other);
+
+        /* The same through a bare stateBlockSize() block, without the
+           header and checksum of a save state: forks kept in one process,
+           e.g. a search frontier. A block at a CACHELINE boundary is
+           copied a whole line at a time. */
+        static size_t stateBlockSize();
+        void copyStateTo(uint8_t *block) const;
+        void copyStateFrom(const uint8_t *block);
+
+        /* Save states. saveState writes stateSize() bytes; loadState
+           checks magic, version, size and checksum, and that the stack
+           pointer, the pending Fx0A and the profile are in range; returns
+           BADSTATE if any is wrong and restores the machine with a single
+           copy otherwise. Engines driving this Chip8 must be flushed after a
+           load. */
+        static size_t stateSize();
+        void saveState(uint8_t *out) const;
+        int loadState(const uint8_t *data, size_t size);
+
+        /* The same through a file, mapped rather than read on load */
+        int saveState(const char *path) const;
+        int loadState(const char *path);
+
+        /* Hash of the whole guest state, the checksum save states carry;
+           equal machines have equal checksums */
+        uint64_t checksum() const;
+
+        /* Restarts the Cxkk generator; the constructor seeds it from the
+           clock */
+        void seed(uint64_t value);
+
+        /* ERROR code that stopped the guest, OK while it runs */
+        int errorCode() const;
+        void clearError();
+
+        uint16_t programCounter() const;
+
+        /* Key events; a release can finish a pending Fx0A */
+        void pressKey(uint8_t key);
+        void releaseKey(uint8_t key);
+
+        /* Fx0A suspended the guest until a key is pressed and released;
+           the engines run no instruction meanwhile */
+        bool waitingForKey() const;
+        bool timersRunning() const;
+
+        /* Instructions skipped by the engines in timer wait loops */
+        long idleCycles() const;
+
         bool okConstruct;
 
-        Chip8Keyboard keyboard;
-        int *m_gfx;
+        /* Plain new only aligns to 16 bytes before C++17; NULL when out
+           of memory */
+        static void* operator new(size_t size) noexcept;
+        static void* operator new[](size_t size) noexcept;
+        static void operator delete(void *block);
+        static void operator delete[](void *block);
+
+        using Chip8State::keyboard;
+        using Chip8State::m_SoundTimer;
 
-        int m_SoundTimer;
     private :
 
-        uint8_t* m_register;
-        uint8_t* m_memory;
+        friend class CpuCore<Chip8>;
+        friend class InterpEngine;
+        friend class ThreadedEngine;
+        friend class JitEngine;
+        friend class AotEngine;
+        friend class ProfileEngine;
+        friend class LockstepEngine;
+
+        stopReason stopCause(uint16_t decodedCmd);
+
+        /* Idle loops: Fx07 at head, 3xkk or 4xkk on the same Vx, then a
+           jump back to head. Until the delay timer changes at the next
+           tick such a loop only reloads Vx, so the engines skip the rest
+           of their budget, leaving PC where running it would have. */
+        bool isIdleLoop(uint16_t head) const;
+        bool idleSpins(uint16_t head) const;
+        long skipIdle(uint16_t head, long left);
 
-        uint16_t* m_stack;
+        static profile romProfile(const uint8_t *rom, size_t size);
 
-        uint16_t m_PC;
-        uint16_t m_SP;
-        uint16_t m_I;
+        static uint16_t classify(uint16_t cmd);
+        static bool buildDispatch();
 
-       
-        bool drawFlag;
+        /* FSM index for every 16-bit opcode, filled once from FSM */
+        static uint8_t s_dispatch[OPCODESPACE];
 
-        int m_DelayTimer;
-        //int m_SoundTimer;
+        /* handler table of m_profile */
+        const struct transaction *m_fsm;
 
+        uint32_t m_dirtyRows;
+
+        long m_idleCycles;
 };
 
+/* instantiated once, in chip8.cpp, where fetch/decode/execute are inlined */
+extern template class CpuCore<Chip8>;
+
 #endif
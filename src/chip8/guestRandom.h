@@ -0,0 +1,41 @@
+#ifndef __GUESTRANDOM__H__
+#define __GUESTRANDOM__H__
+
+#include <stdint.h>
+
+/* Generator behind Cxkk: xorshift64* with 64 bits of state per machine,
+   so a seed reproduces the same bytes on every engine and every host.
+   The state is part of the save states. */
+
+/* Spreads any seed, 0 included, over a state xorshift accepts (splitmix64) */
+inline uint64_t randomState(uint64_t seed)
+{
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+
+  return z != 0 ? z : 1;
+}
+
+/* the JIT emits the same steps */
+#define RANDOMSHIFT1 12
+#define RANDOMSHIFT2 25
+#define RANDOMSHIFT3 27
+#define RANDOMSCRAMBLE 0x2545F4914F6CDD1DULL
+
+/* Next byte, the top one of the scrambled output: all 256 values are equally likely */
+inline uint8_t randomByte(uint64_t *state)
+{
+  uint64_t x = *state;
+
+  x ^= x >> RANDOMSHIFT1;
+  x ^= x << RANDOMSHIFT2;
+  x ^= x >> RANDOMSHIFT3;
+  *state = x;
+
+  return (x * RANDOMSCRAMBLE) >> 56;
+}
+
+#endif
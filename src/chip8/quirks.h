@@ -0,0 +1,77 @@
+#ifndef __QUIRKS__H__
+#define __QUIRKS__H__
+
+/* Behaviours the CHIP-8 interpreters disagree on. Each profile is a policy
+   type whose members are compile-time constants: the handlers and engines
+   are instantiated once per profile, so no quirk is tested at run time. */
+
+enum profile
+{
+    PROFILE_CLASSIC,
+    PROFILE_VIP,
+    PROFILE_CHIP48,
+    PROFILE_SCHIP,
+    PROFILECOUNT
+};
+
+/* What Fx55 / Fx65 leave in I */
+enum memoryQuirk
+{
+    MEMORY_ADD_X_PLUS_ONE,
+    MEMORY_ADD_X,
+    MEMORY_KEEP_I
+};
+
+/* Runtime copy of a policy, for the code generators */
+struct quirkSet
+{
+    bool shiftUsesVy;       /* 8xy6 / 8xyE shift Vy into Vx */
+    memoryQuirk memory;
+    bool clipSprites;       /* Dxyn clips at the edges instead of wrapping */
+    bool jumpUsesVx;        /* Bxnn jumps to xnn + Vx instead of nnn + V0 */
+};
+
+/* What this emulator has always done */
+struct QuirksClassic
+{
+    static const profile id = PROFILE_CLASSIC;
+    static const bool shiftUsesVy = false;
+    static const memoryQuirk memory = MEMORY_ADD_X_PLUS_ONE;
+    static const bool clipSprites = false;
+    static const bool jumpUsesVx = false;
+};
+
+struct QuirksVip
+{
+    static const profile id = PROFILE_VIP;
+    static const bool shiftUsesVy = true;
+    static const memoryQuirk memory = MEMORY_ADD_X_PLUS_ONE;
+    static const bool clipSprites = true;
+    static const bool jumpUsesVx = false;
+};
+
+struct QuirksChip48
+{
+    static const profile id = PROFILE_CHIP48;
+    static const bool shiftUsesVy = false;
+    static const memoryQuirk memory = MEMORY_ADD_X;
+    static const bool clipSprites = true;
+    static const bool jumpUsesVx = true;
+};
+
+struct QuirksSuperChip
+{
+    static const profile id = PROFILE_SCHIP;
+    static const bool shiftUsesVy = false;
+    static const memoryQuirk memory = MEMORY_KEEP_I;
+    static const bool clipSprites = true;
+    static const bool jumpUsesVx = true;
+};
+
+/* Amount Fx55 / Fx65 add to I */
+inline int memoryStep(memoryQuirk memory, int x)
+{
+  return memory == MEMORY_ADD_X_PLUS_ONE ? x + 1 : memory == MEMORY_ADD_X ? x : 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __CPUCORE__H__
+#define __CPUCORE__H__
+
+#include <stddef.h>
+#include "../systemData.h"
+
+/* Why a batched run returned */
+enum stopReason
+{
+    STOP_NONE,
+    STOP_BUDGET,
+    STOP_KEYWAIT,
+    STOP_ERROR,
+    STOP_DRAW,
+    STOP_IDLE
+};
+
+/* Static twin of BaseCPU::doCycle: Derived::fetch, decode and execute are
+   called qualified, so they bind at compile time and inline into the loop.
+   Derived also provides errorCode() and stopCause(decodedCmd), the latter
+   telling whether the instruction just run waits for a key, drew, or
+   entered a loop that only waits for a timer. */
+
+template <class Derived>
+class CpuCore
+{
+    public:
+
+        /* Runs up to budget instructions; stops early on error, key wait
+           or idle loop */
+        stopReason runFor(long budget, long *executed = NULL)
+        {
+          return loop(budget, false, executed);
+        }
+
+        /* Same, but also stops after the first instruction that draws */
+        stopReason runUntilFrame(long budget, long *executed = NULL)
+        {
+          return loop(budget, true, executed);
+        }
+
+    private:
+
+        stopReason loop(long budget, bool stopOnDraw, long *executed);
+};
+
+template <class Derived>
+stopReason CpuCore<Derived>::loop(long budget, bool stopOnDraw, long *executed)
+{
+  Derived *cpu = static_cast<Derived*>(this);
+  stopReason reason = STOP_BUDGET;
+  long count = 0;
+
+  while (count < budget)
+  {
+    if (cpu->Derived::errorCode() != OK)
+    {
+      reason = STOP_ERROR;
+      break;
+    }
+
+    uint16_t instruction = cpu->Derived::fetch();
+    uint16_t decodedInstruction = cpu->Derived::decode(instruction);
+    cpu->Derived::execute(decodedInstruction, instruction);
+    count++;
+
+    if (cpu->Derived::errorCode() != OK)
+    {
+      reason = STOP_ERROR;
+      break;
+    }
+
+    stopReason cause = cpu->Derived::stopCause(decodedInstruction);
+    if (cause == STOP_KEYWAIT || cause == STOP_IDLE || (cause == STOP_DRAW && stopOnDraw))
+    {
+      reason = cause;
+      break;
+    }
+  }
+
+  if (executed != NULL)
+    *executed = count;
+  return reason;
+}
+
+#endif
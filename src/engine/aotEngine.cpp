@@ -0,0 +1,79 @@
+#include "aotEngine.h"
+
+AotEngine::AotEngine(Chip8& cpu) : m_cpu(cpu),
+                                   m_tainted(false)
+{
+    flush();
+}
+
+const char *AotEngine::romName()
+{
+  return s_romName;
+}
+
+bool AotEngine::matches() const
+{
+  if (ENTRYPOINT + s_romSize > MEMORYSIZE || m_cpu.quirkProfile() != s_profile)
+    return false;
+
+  return memcmp(m_cpu.m_memory + ENTRYPOINT, s_rom, s_romSize) == 0;
+}
+
+void AotEngine::flush()
+{
+  m_tainted = !matches();
+}
+
+bool AotEngine::noteWrite(int from, int to)
+{
+  if (to > MEMORYSIZE)
+    to = MEMORYSIZE;
+
+  for (int addr = from; addr < to && !m_tainted; addr++)
+  {
+    if ((s_code[addr / BYTESIZE] & (1 << (addr % BYTESIZE))) == 0)
+      continue;
+
+    if (m_cpu.m_memory[addr] != s_rom[addr - ENTRYPOINT])
+      m_tainted = true;
+  }
+
+  return m_tainted;
+}
+
+void AotEngine::stepInterpreted()
+{
+  uint16_t cmd = m_cpu.fetch();
+  command code = Chip8::FSM[Chip8::s_dispatch[cmd]].code;
+  int from = m_cpu.m_I;
+  int to = from;
+
+  if (code == LD_BCD)
+    to = from + 3;
+  if (code == LD_REG_MEM)
+    to = from + XMASK(cmd) + 1;
+
+  m_cpu.doCycle();
+  noteWrite(from, to);
+}
+
+long AotEngine::run(long budget)
+{
+  long executed = 0;
+
+  if (m_cpu.waitingForKey())
+    return 0;
+
+  if (!m_tainted)
+    executed = runGenerated(budget);
+
+  /* the generated code gave up for good */
+  while (executed < budget && m_cpu.m_error == OK && !m_cpu.waitingForKey())
+  {
+    stepInterpreted();
+    executed++;
+  }
+
+  return executed;
+}
+
@@ -0,0 +1,48 @@
+#ifndef __AOTENGINE__H__
+#define __AOTENGINE__H__
+
+#include "engine.h"
+
+/* Engine for ROMs translated ahead of time by the recomp tool. The tool
+   emits runGenerated() and the s_rom / s_code tables for exactly one ROM;
+   everything else lives in aotEngine.cpp. Whenever the generated code
+   cannot continue (computed jumps, unknown opcodes, a code byte rewritten
+   by Fx33/Fx55, or a different ROM loaded) the interpreter takes over. */
+
+class AotEngine : public Engine
+{
+    public :
+
+        AotEngine(Chip8& cpu);
+
+        virtual long run(long budget);
+        virtual void flush();
+
+        /* true when the loaded ROM, with its quirk profile, is the one the
+           code was generated from */
+        bool matches() const;
+
+        static const char *romName();
+
+    private :
+
+        long runGenerated(long budget);
+        void stepInterpreted();
+
+        /* true once a write changed a translated code byte */
+        bool noteWrite(int from, int to);
+
+        Chip8& m_cpu;
+        bool m_tainted;
+
+        static const uint8_t s_rom[];
+        static const int s_romSize;
+        static const profile s_profile;
+        static const char s_romName[];
+
+        /* one bit per guest byte that belongs to a translated instruction */
+        static const uint8_t s_code[MEMORYSIZE / BYTESIZE];
+};
+
+#endif
+
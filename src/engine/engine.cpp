@@ -0,0 +1,62 @@
+#include <string.h>
+#include "engine.h"
+#include "threadedEngine.h"
+#include "jitEngine.h"
+#include "profileEngine.h"
+
+Engine::~Engine()
+{}
+
+InterpEngine::InterpEngine(Chip8& cpu) : m_cpu(cpu)
+{}
+
+long InterpEngine::run(long budget)
+{
+  long executed = 0;
+
+  if (m_cpu.waitingForKey())
+    return 0;
+
+  while (executed < budget && m_cpu.m_error == OK)
+  {
+    long batch = 0;
+    stopReason reason = m_cpu.runFor(budget - executed, &batch);
+    executed += batch;
+
+    /* Fx0A suspended the guest, only a key event resumes it */
+    if (reason == STOP_KEYWAIT)
+      break;
+
+    /* neither can the delay timer an idle loop polls */
+    if (reason == STOP_IDLE)
+      executed += m_cpu.skipIdle(m_cpu.m_PC - NEXT, budget - executed);
+  }
+  return executed;
+}
+
+void InterpEngine::flush()
+{}
+
+Engine* createEngine(const char *name, Chip8& cpu)
+{
+  if (strcmp(name, "interp") == 0)
+    return new InterpEngine(cpu);
+
+  if (strcmp(name, "threaded") == 0)
+    return new ThreadedEngine(cpu);
+
+  if (strcmp(name, "profile") == 0)
+    return new ProfileEngine(cpu);
+
+  if (strcmp(name, "jit") == 0)
+  {
+    JitEngine *jit = new JitEngine(cpu);
+    if (jit->available())
+      return jit;
+
+    delete jit;
+    return NULL;
+  }
+
+  return NULL;
+}
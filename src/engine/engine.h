@@ -0,0 +1,44 @@
+#ifndef __ENGINE__H__
+#define __ENGINE__H__
+
+#include "../chip8/chip8.h"
+
+/* Common face of the execution engines driving a Chip8. One virtual call
+   per run(), never per instruction. */
+
+class Engine
+{
+    public:
+
+        virtual ~Engine();
+
+        /* Executes up to budget instructions, returns how many ran,
+           counting the ones an idle loop skip elided. Stops early when
+           the guest waits on Fx0A, see Chip8::waitingForKey(). */
+        virtual long run(long budget) = 0;
+
+        /* Drops cached translations, needed after a new ROM is loaded */
+        virtual void flush() = 0;
+};
+
+/* Plain fetch/decode/execute, batched through CpuCore::runFor */
+
+class InterpEngine : public Engine
+{
+    public:
+
+        InterpEngine(Chip8& cpu);
+
+        virtual long run(long budget);
+        virtual void flush();
+
+    private:
+
+        Chip8& m_cpu;
+};
+
+/* "interp", "threaded", "jit" or "profile"; NULL for an unknown name */
+Engine* createEngine(const char *name, Chip8& cpu);
+
+#endif
+
@@ -0,0 +1,913 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "jitEngine.h"
+
+#define WATCHSHIFT 6
+
+/* Ex9E and ExA1 read the keys at the keyboard's own address */
+static_assert(sizeof(Chip8Keyboard) == KEYCOUNT * sizeof(bool), "the keys are all the keyboard holds");
+
+/* bytes of the longest translation of one instruction: Fx65 of ten
+   registers with its range check exit, or a terminator storing them */
+#define JITOPBYTES 160
+
+/* room a block may take, checked before it is emitted */
+#define JITBLOCKBYTES (JITBLOCKMAX * JITOPBYTES + 256)
+
+/* set in the PC a block exits with when the interpreter must run it */
+#define JITINTERPRET 0x10000
+
+/* host register numbers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+/* condition codes */
+#define CC_C  0x2
+#define CC_B  0x2
+#define CC_NC 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_AE 0x3
+#define CC_BE 0x6
+#define CC_L  0xC
+
+/* ALU opcodes, r/m8 <- r8 */
+#define OP_ADD 0x00
+#define OP_OR  0x08
+#define OP_AND 0x20
+#define OP_SUB 0x28
+#define OP_XOR 0x30
+#define OP_CMP 0x38
+#define OP_MOV 0x88
+
+/* 0x80 /ext and 0xD0 /ext group extensions */
+#define EXT_ADD 0
+#define EXT_AND 4
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+/* V registers are kept in these; rax and rdx are scratch, rdi holds the
+   Chip8 pointer, rsi the register file and rbp the remaining budget */
+static const int hostPool[] = { RBX, R12, R13, R14, R15, RCX, R8, R9, R10, R11 };
+#define POOLSIZE ((int)(sizeof(hostPool) / sizeof(hostPool[0])))
+
+/* Minimal x86-64 encoder for the handful of forms the translator needs */
+
+struct Assembler
+{
+    uint8_t *code;
+    size_t pos;
+
+    void byte(uint8_t b)    { code[pos++] = b; }
+    void word(uint16_t w)   { memcpy(code + pos, &w, 2); pos += 2; }
+    void dword(uint32_t d)  { memcpy(code + pos, &d, 4); pos += 4; }
+
+    /* a REX prefix is always emitted so 4-7 encode spl..dil, not ah..bh */
+    void rex(int w, int r, int b)       { byte(0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3)); }
+    void modrm(int mod, int reg, int rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+
+    /* [rdi + disp32] */
+    void field(int reg, int32_t disp)    { modrm(2, reg, RDI); dword(disp); }
+
+    void alu8(uint8_t op, int dst, int src) { rex(0, src, dst); byte(op); modrm(3, src, dst); }
+    void alu8i(int ext, int dst, uint8_t imm) { rex(0, 0, dst); byte(0x80); modrm(3, ext, dst); byte(imm); }
+    void mov8i(int dst, uint8_t imm)     { rex(0, 0, dst); byte(0xB0 + (dst & 7)); byte(imm); }
+    void shift1(int ext, int dst)        { rex(0, 0, dst); byte(0xD0); modrm(3, ext, dst); }
+    void shift8i(int ext, int dst, uint8_t n) { rex(0, 0, dst); byte(0xC0); modrm(3, ext, dst); byte(n); }
+    void setcc(int cc, int dst)          { rex(0, 0, dst); byte(0x0F); byte(0x90 | cc); modrm(3, 0, dst); }
+    void movzx8(int src)                 { rex(0, RAX, src); byte(0x0F); byte(0xB6); modrm(3, RAX, src); }
+
+    /* mov r8, [rsi + x] / mov [rsi + x], r8 */
+    void loadV(int dst, int x)           { rex(0, dst, RSI); byte(0x8A); modrm(1, dst, RSI); byte(x); }
+    void storeV(int x, int src)          { rex(0, src, RSI); byte(0x88); modrm(1, src, RSI); byte(x); }
+
+    /* mov r8, [rdx + rax + i] */
+    void loadIndexed(int dst, int i)     { rex(0, dst, RAX); byte(0x8A); modrm(1, dst, 4); byte(0x02); byte(i); }
+
+    /* lea r64, [rdi + disp32]: the arrays live inside Chip8 */
+    void leaPtr(int dst, int32_t disp)   { rex(1, dst, RDI); byte(0x8D); field(dst, disp); }
+    void movzx16(int32_t disp)           { byte(0x0F); byte(0xB7); field(RAX, disp); }
+    void store16(int32_t disp)           { byte(0x66); byte(0x89); field(RAX, disp); }
+    void store16i(int32_t disp, uint16_t imm) { byte(0x66); byte(0xC7); field(0, disp); word(imm); }
+    void add16(int32_t disp)             { byte(0x66); byte(0x01); field(RAX, disp); }
+    void add16i(int32_t disp, uint8_t imm) { byte(0x66); byte(0x83); field(0, disp); byte(imm); }
+    void inc16(int32_t disp)             { byte(0x66); byte(0xFF); field(0, disp); }
+    void store32(int32_t disp)           { byte(0x89); field(RAX, disp); }
+
+    void movEax(uint32_t imm)            { byte(0xB8); dword(imm); }
+    void times5()                        { byte(0x8D); byte(0x04); byte(0x80); }
+
+    /* stack slot [rdx + rax * 2] */
+    void pushSlot(uint16_t imm)          { byte(0x66); byte(0xC7); byte(0x04); byte(0x42); word(imm); }
+    void loadSlot()                      { byte(0x0F); byte(0xB7); byte(0x04); byte(0x42); }
+
+    void budgetCmp(int32_t n)            { byte(0x48); byte(0x81); byte(0xFD); dword(n); }
+    void budgetSub(int32_t n)            { byte(0x48); byte(0x81); byte(0xED); dword(n); }
+    void budgetAdd1()                    { budgetAdd(1); }
+    void budgetAdd(int8_t n)             { byte(0x48); byte(0x83); byte(0xC5); byte(n); }
+
+    void cmpEax(int32_t imm)             { byte(0x3D); dword(imm); }
+    void andEax(uint8_t imm)             { byte(0x83); byte(0xE0); byte(imm); }
+
+    /* mov r8, [rdi + disp32] */
+    void loadField8(int dst, int32_t disp) { rex(0, dst, RDI); byte(0x8A); field(dst, disp); }
+
+    /* cmp byte [rdi + rax + disp32], 0 */
+    void cmpKey(int32_t disp)            { byte(0x80); byte(0xBC); byte(0x07); dword(disp); byte(0); }
+
+    /* Cls: the rows that were lit are marked dirty and cleared, rcx is
+       borrowed as the row index */
+    void clearScreen(int32_t gfx, int32_t dirty)
+    {
+      byte(0x51);                                      // push rcx
+      byte(0x31); byte(0xC9);                          // xor ecx, ecx
+      byte(0x31); byte(0xD2);                          // xor edx, edx
+      byte(0x48); byte(0x8B); byte(0x84); byte(0xCF); dword(gfx);  // mov rax, [rdi + rcx * 8 + gfx]
+      byte(0x48); byte(0x85); byte(0xC0);              // test rax, rax
+      byte(0x74); byte(15);                            // jz next
+      byte(0x0F); byte(0xAB); byte(0xCA);              // bts edx, ecx
+      byte(0x48); byte(0xC7); byte(0x84); byte(0xCF); dword(gfx); dword(0);  // mov qword [rdi + rcx * 8 + gfx], 0
+      byte(0xFF); byte(0xC1);                          // next: inc ecx
+      byte(0x83); byte(0xF9); byte(WIDTH);             // cmp ecx, WIDTH
+      byte(0x72); byte(-35);                           // jb back to the load
+      byte(0x09); byte(0x97); dword(dirty);            // or [rdi + dirty], edx
+      byte(0x59);                                      // pop rcx
+    }
+
+    /* Cxkk: xorshift64* as randomByte, the byte left in al */
+    void randomByte(int32_t state)
+    {
+      static const uint8_t shifts[3][2] = { { 0xEA, RANDOMSHIFT1 }, { 0xE2, RANDOMSHIFT2 },
+                                            { 0xEA, RANDOMSHIFT3 } };
+
+      byte(0x48); byte(0x8B); field(RAX, state);       // mov rax, [rdi + state]
+      for (int i = 0; i < 3; i++)
+      {
+        byte(0x48); byte(0x89); byte(0xC2);            // mov rdx, rax
+        byte(0x48); byte(0xC1); byte(shifts[i][0]); byte(shifts[i][1]);  // shr / shl rdx, n
+        byte(0x48); byte(0x31); byte(0xD0);            // xor rax, rdx
+      }
+      byte(0x48); byte(0x89); field(RAX, state);       // mov [rdi + state], rax
+      byte(0x48); byte(0xBA);                          // mov rdx, RANDOMSCRAMBLE
+      dword((uint32_t) RANDOMSCRAMBLE); dword((uint32_t) (RANDOMSCRAMBLE >> 32));
+      byte(0x48); byte(0x0F); byte(0xAF); byte(0xC2);  // imul rax, rdx
+      byte(0x48); byte(0xC1); byte(0xE8); byte(56);    // shr rax, 56
+    }
+
+    /* both return the offset of the rel32 to patch */
+    size_t jcc(int cc)                   { byte(0x0F); byte(0x80 | cc); dword(0); return pos - 4; }
+    size_t jmp()                         { byte(0xE9); dword(0); return pos - 4; }
+
+    void patch(size_t site, size_t target)
+    {
+      int32_t rel = (int32_t)(target - (site + 4));
+      memcpy(code + site, &rel, 4);
+    }
+};
+
+JitEngine::JitEngine(Chip8& cpu) : m_cpu(cpu),
+                                   m_code(NULL),
+                                   m_used(0),
+                                   m_exitStub(0),
+                                   m_enter(NULL),
+                                   m_firstBlock(0),
+                                   m_pageSize(sysconf(_SC_PAGESIZE)),
+                                   m_writeFrom(0),
+                                   m_writeTo(0),
+                                   m_liveCount(0),
+                                   m_watched(0),
+                                   m_linkedCount(0),
+                                   m_profile(cpu.quirkProfile())
+{
+    for (int i = 0; i < MEMORYSIZE; i++)
+    {
+      m_blocks[i] = NULL;
+      m_hits[i] = 0;
+    }
+
+    const char *base = (const char*) &cpu;
+    m_offRegister = (const char*) cpu.m_register - base;
+    m_offMemory   = (const char*) cpu.m_memory - base;
+    m_offStack    = (const char*) cpu.m_stack - base;
+    m_offI        = (const char*) &cpu.m_I - base;
+    m_offSP       = (const char*) &cpu.m_SP - base;
+    m_offDelay    = (const char*) &cpu.m_DelayTimer - base;
+    m_offSound    = (const char*) &cpu.m_SoundTimer - base;
+    m_offGfx      = (const char*) cpu.m_gfx - base;
+    m_offDirty    = (const char*) &cpu.m_dirtyRows - base;
+    m_offRandom   = (const char*) &cpu.m_random - base;
+    m_offKeys     = (const char*) &cpu.keyboard - base;
+
+#if defined(__x86_64__)
+    void *area = mmap(NULL, JITCODESIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area != MAP_FAILED)
+    {
+      /* mapped writable, for the trampoline only */
+      m_code = (uint8_t*) area;
+      emitTrampoline();
+      mprotect(m_code, JITCODESIZE, PROT_READ | PROT_EXEC);
+    }
+#endif
+}
+
+JitEngine::~JitEngine()
+{
+    flush();
+
+    if (m_code)
+      munmap(m_code, JITCODESIZE);
+}
+
+bool JitEngine::available() const
+{
+  return m_code != NULL;
+}
+
+/* Opens the pages holding cache bytes [from, to) for writing, endWrite
+   closes them again; no generated code runs in between */
+
+void JitEngine::beginWrite(size_t from, size_t to)
+{
+  m_writeFrom = from & ~(m_pageSize - 1);
+  m_writeTo = (to + m_pageSize - 1) & ~(m_pageSize - 1);
+  if (m_writeTo > JITCODESIZE)
+    m_writeTo = JITCODESIZE;
+
+  mprotect(m_code + m_writeFrom, m_writeTo - m_writeFrom, PROT_READ | PROT_WRITE);
+}
+
+void JitEngine::endWrite()
+{
+  mprotect(m_code + m_writeFrom, m_writeTo - m_writeFrom, PROT_READ | PROT_EXEC);
+}
+
+/* enter(cpu, code, budget, &remaining): saves callee-saved registers and
+   jumps into a block; every exit lands on the stub with the next PC in eax */
+
+void JitEngine::emitTrampoline()
+{
+  Assembler a = { m_code, 0 };
+
+  a.byte(0x53);                  // push rbx
+  a.byte(0x55);                  // push rbp
+  a.byte(0x41); a.byte(0x54);    // push r12
+  a.byte(0x41); a.byte(0x55);    // push r13
+  a.byte(0x41); a.byte(0x56);    // push r14
+  a.byte(0x41); a.byte(0x57);    // push r15
+  a.byte(0x51);                  // push rcx
+  a.byte(0x48); a.byte(0x89); a.byte(0xD5);  // mov rbp, rdx
+  a.byte(0xFF); a.byte(0xE6);    // jmp rsi
+
+  m_exitStub = a.pos;
+  a.byte(0x59);                  // pop rcx
+  a.byte(0x48); a.byte(0x89); a.byte(0x29);  // mov [rcx], rbp
+  a.byte(0x41); a.byte(0x5F);    // pop r15
+  a.byte(0x41); a.byte(0x5E);    // pop r14
+  a.byte(0x41); a.byte(0x5D);    // pop r13
+  a.byte(0x41); a.byte(0x5C);    // pop r12
+  a.byte(0x5D);                  // pop rbp
+  a.byte(0x5B);                  // pop rbx
+  a.byte(0xC3);                  // ret
+
+  m_firstBlock = a.pos;
+  m_used = a.pos;
+  m_enter = (Trampoline) m_code;
+}
+
+void JitEngine::flush()
+{
+  for (int i = 0; i < m_liveCount; i++)
+  {
+    free(m_blocks[m_live[i]]);
+    m_blocks[m_live[i]] = NULL;
+  }
+
+  for (int i = 0; i < m_linkedCount; i++)
+    m_incoming[m_linked[i]].clear();
+
+  memset(m_hits, 0, sizeof(m_hits));
+  m_linkedCount = 0;
+  m_liveCount = 0;
+  m_watched = 0;
+  m_used = m_firstBlock;
+}
+
+void JitEngine::watch(const Block *block)
+{
+  for (int page = block->start >> WATCHSHIFT; page <= (block->end - 1) >> WATCHSHIFT; page++)
+    m_watched |= 1ULL << page;
+}
+
+/* Drops the translations overlapping guest bytes [from, to) */
+
+void JitEngine::invalidate(int from, int to)
+{
+  if (to > MEMORYSIZE)
+    to = MEMORYSIZE;
+  if (from >= to)
+    return;
+
+  uint64_t written = 0;
+  for (int page = from >> WATCHSHIFT; page <= (to - 1) >> WATCHSHIFT; page++)
+    written |= 1ULL << page;
+
+  if ((m_watched & written) == 0)
+    return;
+
+  Assembler a = { m_code, 0 };
+  int kept = 0;
+  size_t first = JITCODESIZE;
+  size_t last = 0;
+
+  /* one window over every exit to patch */
+  for (int i = 0; i < m_liveCount; i++)
+  {
+    Block *block = m_blocks[m_live[i]];
+
+    if (block->start < to && from < block->end)
+      for (size_t k = 0; k < m_incoming[block->start].size(); k++)
+      {
+        uint32_t site = m_incoming[block->start][k];
+        first = site < first ? site : first;
+        last = site + 4 > last ? site + 4 : last;
+      }
+  }
+
+  if (first < last)
+    beginWrite(first, last);
+
+  m_watched = 0;
+
+  for (int i = 0; i < m_liveCount; i++)
+  {
+    uint16_t start = m_live[i];
+    Block *block = m_blocks[start];
+
+    if (block->start < to && from < block->end)
+    {
+      /* chained jumps into the block go back through the dispatcher */
+      for (size_t k = 0; k < m_incoming[start].size(); k++)
+        a.patch(m_incoming[start][k], m_exitStub);
+
+      m_blocks[start] = NULL;
+      m_hits[start] = 0;
+      free(block);
+      continue;
+    }
+
+    m_live[kept++] = start;
+    watch(block);
+  }
+
+  if (first < last)
+    endWrite();
+  m_liveCount = kept;
+}
+
+/* Records a rel32 exit towards target and points it at the best place */
+
+void JitEngine::link(uint32_t site, uint16_t target)
+{
+  Assembler a = { m_code, 0 };
+  Block *block = target < MEMORYSIZE ? m_blocks[target] : NULL;
+
+  if (target < MEMORYSIZE)
+  {
+    if (m_incoming[target].empty())
+      m_linked[m_linkedCount++] = target;
+    m_incoming[target].push_back(site);
+  }
+
+  if (block && block->code)
+    a.patch(site, block->code - m_code);
+  else
+    a.patch(site, m_exitStub);
+}
+
+JitEngine::Block* JitEngine::compile(uint16_t start)
+{
+  uint16_t cmds[JITBLOCKMAX];
+  command codes[JITBLOCKMAX];
+  int host[REGNUM];
+  int allocated = 0;
+  int count = 0;
+  bool terminated = false;
+  uint16_t pc = start;
+  const quirkSet& quirks = m_cpu.quirks();
+
+  for (int i = 0; i < REGNUM; i++)
+    host[i] = -1;
+
+  /* pass 1: block extent and register allocation */
+
+  while (!terminated && count < JITBLOCKMAX && pc + 1 < MEMORYSIZE)
+  {
+    uint16_t cmd = (m_cpu.m_memory[pc] << BYTESIZE) | m_cpu.m_memory[pc + 1];
+    command code = Chip8::FSM[Chip8::s_dispatch[cmd]].code;
+    int x = XMASK(cmd);
+    int y = YMASK(cmd);
+    int used = 0;
+
+    switch (code)
+    {
+      case LD_CONST: case ADD_CONST: case SE_CONST: case SNE_CONST:
+      case ADD_I: case LD_SPR: case LD_DT: case LD_ST:
+        used = 1 << x;
+        break;
+      case LD_REG: case OR: case AND: case XOR: case SE_REG: case SNE_REG:
+        used = (1 << x) | (1 << y);
+        break;
+      case ADD_REG: case SUB: case SUBN:
+        used = (1 << x) | (1 << y) | (1 << VF);
+        break;
+      case SHR: case SHL:
+        used = (1 << x) | (1 << VF);
+        /* a shifted Vy aliasing VF is left to the interpreter */
+        if (quirks.shiftUsesVy)
+          used = (x == VF || y == VF) ? -1 : used | (1 << y);
+        break;
+      case LD_REG_LOAD:
+        used = (2 << x) - 1;
+        break;
+      case RND: case LD_REG_DT: case SKP: case SKNP:
+        used = 1 << x;
+        break;
+      case LD_I: case JP: case CALL: case RET: case CLS:
+        break;
+      default:
+        /* left to the interpreter */
+        used = -1;
+        break;
+    }
+
+    if (used == -1)
+      break;
+
+    int fresh = 0;
+    for (int r = 0; r < REGNUM; r++)
+      if ((used & (1 << r)) && host[r] == -1)
+        fresh++;
+
+    if (allocated + fresh > POOLSIZE)
+      break;
+
+    for (int r = 0; r < REGNUM; r++)
+      if ((used & (1 << r)) && host[r] == -1)
+        host[r] = hostPool[allocated++];
+
+    cmds[count] = cmd;
+    codes[count] = code;
+    count++;
+    pc += NEXT;
+
+    if (code == JP || code == CALL || code == RET || code == SE_CONST ||
+        code == SNE_CONST || code == SE_REG || code == SNE_REG ||
+        code == SKP || code == SKNP)
+      terminated = true;
+  }
+
+  Block *block = (Block*) calloc(1, sizeof(Block));
+  if (block == NULL)
+    return NULL;
+
+  block->start = start;
+  block->end   = count ? pc : start + NEXT;
+  block->count = count;
+  block->code  = NULL;
+  block->idle  = m_cpu.isIdleLoop(start);
+
+  /* pass 2: code, unless the first instruction needs the interpreter */
+
+  if (count > 0)
+  {
+    if (m_used + JITBLOCKBYTES > JITCODESIZE)
+    {
+      free(block);
+      flush();
+      return compile(start);
+    }
+
+    Assembler a = { m_code, m_used };
+    int dirty = 0;
+    uint16_t at = start;
+
+    /* the block and the exits already waiting for it, in one window */
+    size_t first = m_used;
+    for (size_t k = 0; k < m_incoming[start].size(); k++)
+      if (m_incoming[start][k] < first)
+        first = m_incoming[start][k];
+
+    beginWrite(first, m_used + JITBLOCKBYTES);
+
+    a.budgetCmp(count);
+    size_t noBudget = a.jcc(CC_L);
+    a.budgetSub(count);
+    a.leaPtr(RSI, m_offRegister);
+    for (int r = 0; r < REGNUM; r++)
+      if (host[r] != -1)
+        a.loadV(host[r], r);
+
+    for (int i = 0; i < count; i++, at += NEXT)
+    {
+      uint16_t cmd = cmds[i];
+      int x = XMASK(cmd);
+      int y = YMASK(cmd);
+      int hx = host[x];
+      int hy = host[y];
+      int hf = host[VF];
+      uint8_t kk = CONSTMASK(cmd);
+      uint16_t nnn = ADDRESSMASK(cmd);
+      bool plain = (x != VF && y != VF);
+
+      switch (codes[i])
+      {
+        case LD_CONST:  a.mov8i(hx, kk);             dirty |= 1 << x; break;
+        case ADD_CONST: a.alu8i(EXT_ADD, hx, kk);    dirty |= 1 << x; break;
+        case LD_REG:    a.alu8(OP_MOV, hx, hy);      dirty |= 1 << x; break;
+        case OR:        a.alu8(OP_OR, hx, hy);       dirty |= 1 << x; break;
+        case AND:       a.alu8(OP_AND, hx, hy);      dirty |= 1 << x; break;
+        case XOR:       a.alu8(OP_XOR, hx, hy);      dirty |= 1 << x; break;
+
+        /* VF straight from the host carry; when x or y is VF itself the
+           same order of writes as chip8.cpp is kept */
+        case ADD_REG:
+          if (plain)
+          {
+            a.alu8(OP_ADD, hx, hy);
+            a.setcc(CC_C, hf);
+          }
+          else
+          {
+            a.alu8(OP_MOV, RAX, hx);
+            a.alu8(OP_ADD, RAX, hy);
+            a.setcc(CC_C, hf);
+            a.alu8(OP_ADD, hx, hy);
+          }
+          dirty |= (1 << x) | (1 << VF);
+          break;
+
+        case SUB:
+          if (plain)
+          {
+            a.alu8(OP_SUB, hx, hy);
+            a.setcc(CC_NC, hf);
+          }
+          else
+          {
+            a.alu8(OP_CMP, hx, hy);
+            a.setcc(CC_NC, hf);
+            a.alu8(OP_SUB, hx, hy);
+          }
+          dirty |= (1 << x) | (1 << VF);
+          break;
+
+        case SUBN:
+          if (plain)
+          {
+            a.alu8(OP_MOV, RAX, hy);
+            a.alu8(OP_SUB, RAX, hx);
+            a.setcc(CC_NC, hf);
+            a.alu8(OP_MOV, hx, RAX);
+          }
+          else
+          {
+            a.alu8(OP_CMP, hy, hx);
+            a.setcc(CC_NC, hf);
+            a.alu8(OP_MOV, RAX, hy);
+            a.alu8(OP_SUB, RAX, hx);
+            a.alu8(OP_MOV, hx, RAX);
+          }
+          dirty |= (1 << x) | (1 << VF);
+          break;
+
+        case SHR:
+          if (quirks.shiftUsesVy && x != y)
+            a.alu8(OP_MOV, hx, hy);
+          if (x != VF)
+          {
+            a.shift1(EXT_SHR, hx);
+            a.setcc(CC_C, hf);
+          }
+          else
+          {
+            a.alu8(OP_MOV, RAX, hx);
+            a.alu8i(EXT_AND, RAX, 1);
+            a.alu8(OP_MOV, hf, RAX);
+            a.shift1(EXT_SHR, hx);
+          }
+          dirty |= (1 << x) | (1 << VF);
+          break;
+
+        case SHL:
+          if (quirks.shiftUsesVy && x != y)
+            a.alu8(OP_MOV, hx, hy);
+          if (x != VF)
+          {
+            a.shift1(EXT_SHL, hx);
+            a.setcc(CC_C, hf);
+          }
+          else
+          {
+            a.alu8(OP_MOV, RAX, hx);
+            a.shift8i(EXT_SHR, RAX, 7);
+            a.alu8(OP_MOV, hf, RAX);
+            a.shift1(EXT_SHL, hx);
+          }
+          dirty |= (1 << x) | (1 << VF);
+          break;
+
+        case LD_I:
+          a.store16i(m_offI, nnn);
+          break;
+
+        case ADD_I:
+          a.movzx8(hx);
+          a.add16(m_offI);
+          break;
+
+        case LD_SPR:
+          a.movzx8(hx);
+          a.times5();
+          a.store16(m_offI);
+          break;
+
+        case LD_DT:
+          a.movzx8(hx);
+          a.store32(m_offDelay);
+          break;
+
+        case LD_ST:
+          a.movzx8(hx);
+          a.store32(m_offSound);
+          break;
+
+        /* the timers and the keys change between runs only */
+        case LD_REG_DT:
+          a.loadField8(hx, m_offDelay);
+          dirty |= 1 << x;
+          break;
+
+        case RND:
+          a.randomByte(m_offRandom);
+          a.alu8(OP_MOV, hx, RAX);
+          a.alu8i(EXT_AND, hx, kk);
+          dirty |= 1 << x;
+          break;
+
+        case CLS:
+          a.clearScreen(m_offGfx, m_offDirty);
+          break;
+
+        case LD_REG_LOAD:
+          {
+            /* reads past the end: the interpreter raises the error, from
+               this instruction on nothing of the block has run */
+            a.movzx16(m_offI);
+            a.cmpEax(MEMORYSIZE - 1 - x);
+            size_t inside = a.jcc(CC_BE);
+            for (int r = 0; r < REGNUM; r++)
+              if (dirty & (1 << r))
+                a.storeV(r, host[r]);
+            a.budgetAdd(count - i);
+            a.movEax(at | JITINTERPRET);
+            a.patch(a.jmp(), m_exitStub);
+            a.patch(inside, a.pos);
+          }
+          a.leaPtr(RDX, m_offMemory);
+          for (int r = 0; r <= x; r++)
+            a.loadIndexed(host[r], r);
+          if (memoryStep(quirks.memory, x) != 0)
+            a.add16i(m_offI, memoryStep(quirks.memory, x));
+          dirty |= (2 << x) - 1;
+          break;
+
+        default:
+          break;
+      }
+
+      if (i < count - 1 || !terminated)
+        continue;
+
+      /* terminator: compare first, the register stores keep the flags */
+
+      switch (codes[i])
+      {
+        case SE_CONST:
+        case SNE_CONST:
+          a.alu8i(EXT_CMP, hx, kk);
+          break;
+        case SE_REG:
+        case SNE_REG:
+          a.alu8(OP_CMP, hx, hy);
+          break;
+        case SKP:
+        case SKNP:
+          a.movzx8(hx);
+          a.andEax(KEYCOUNT - 1);
+          a.cmpKey(m_offKeys);
+          break;
+        default:
+          break;
+      }
+
+      for (int r = 0; r < REGNUM; r++)
+        if (dirty & (1 << r))
+          a.storeV(r, host[r]);
+
+      switch (codes[i])
+      {
+        case SE_CONST:
+        case SNE_CONST:
+        case SE_REG:
+        case SNE_REG:
+        case SKP:
+        case SKNP:
+          {
+            /* a key compares equal to 0 when it is up */
+            bool skipOnEqual = (codes[i] == SE_CONST || codes[i] == SE_REG ||
+                                codes[i] == SKNP);
+            size_t other = a.jcc(skipOnEqual ? CC_NE : CC_E);
+
+            a.movEax(at + 2 * NEXT);
+            link(a.jmp(), at + 2 * NEXT);
+            a.patch(other, a.pos);
+            a.movEax(at + NEXT);
+            link(a.jmp(), at + NEXT);
+          }
+          break;
+
+        case CALL:
+          if (nnn >= ENTRYPOINT)
+          {
+            /* a full stack is left to the interpreter as well */
+            a.movzx16(m_offSP);
+            a.byte(0x83); a.byte(0xF8); a.byte(STACKSIZE);  // cmp eax, 16
+            size_t room = a.jcc(CC_B);
+            a.budgetAdd1();
+            a.movEax(at | JITINTERPRET);
+            a.patch(a.jmp(), m_exitStub);
+
+            a.patch(room, a.pos);
+            a.leaPtr(RDX, m_offStack);
+            a.pushSlot(at);
+            a.inc16(m_offSP);
+          }
+          /* fall through */
+        case JP:
+          if (nnn < ENTRYPOINT)
+          {
+            /* let the interpreter raise the error */
+            a.budgetAdd1();
+            a.movEax(at | JITINTERPRET);
+            a.patch(a.jmp(), m_exitStub);
+            break;
+          }
+          a.movEax(nnn);
+          link(a.jmp(), nnn);
+          break;
+
+        case RET:
+          {
+            a.movzx16(m_offSP);
+            a.byte(0xFF); a.byte(0xC8);              // dec eax
+            a.byte(0x83); a.byte(0xF8); a.byte(STACKSIZE);  // cmp eax, 16
+            size_t bad = a.jcc(CC_AE);
+            a.store16(m_offSP);
+            a.leaPtr(RDX, m_offStack);
+            a.loadSlot();
+            a.byte(0x83); a.byte(0xC0); a.byte(NEXT);  // add eax, 2
+            a.patch(a.jmp(), m_exitStub);
+
+            a.patch(bad, a.pos);
+            a.budgetAdd1();
+            a.movEax(at | JITINTERPRET);
+            a.patch(a.jmp(), m_exitStub);
+          }
+          break;
+
+        default:
+          break;
+      }
+    }
+
+    if (!terminated)
+    {
+      for (int r = 0; r < REGNUM; r++)
+        if (dirty & (1 << r))
+          a.storeV(r, host[r]);
+
+      a.movEax(pc);
+      link(a.jmp(), pc);
+    }
+
+    a.patch(noBudget, a.pos);
+    a.movEax(start);
+    a.patch(a.jmp(), m_exitStub);
+
+    block->code = m_code + m_used;
+    m_used = a.pos;
+
+    /* earlier exits towards this address can now jump straight in */
+    for (size_t k = 0; k < m_incoming[start].size(); k++)
+      a.patch(m_incoming[start][k], block->code - m_code);
+
+    endWrite();
+  }
+
+  m_blocks[start] = block;
+  m_live[m_liveCount++] = start;
+  watch(block);
+
+  return block;
+}
+
+/* Single step through the interpreter, keeping translations coherent */
+
+void JitEngine::stepInterpreted()
+{
+  uint16_t cmd = m_cpu.fetch();
+  command code = Chip8::FSM[Chip8::s_dispatch[cmd]].code;
+  int from = m_cpu.m_I;
+  int to = from;
+
+  if (code == LD_BCD)
+    to = from + 3;
+  if (code == LD_REG_MEM)
+    to = from + XMASK(cmd) + 1;
+
+  m_cpu.doCycle();
+  invalidate(from, to);
+}
+
+long JitEngine::run(long budget)
+{
+  long executed = 0;
+
+  /* translations bake in the quirks of the profile they were made for */
+  if (m_cpu.quirkProfile() != m_profile)
+  {
+    flush();
+    m_profile = m_cpu.quirkProfile();
+  }
+
+  while (executed < budget && m_cpu.m_error == OK)
+  {
+    /* Fx0A suspended the guest */
+    if (m_cpu.m_keyWait)
+      break;
+
+    uint16_t pc = m_cpu.m_PC;
+    Block *block = NULL;
+
+    if (pc + 1 < MEMORYSIZE)
+    {
+      block = m_blocks[pc];
+      if (block == NULL && m_code && ++m_hits[pc] >= HOTTHRESHOLD)
+        block = compile(pc);
+    }
+
+    /* the loop may be longer than the block, so the pattern is checked again */
+    if (block != NULL && block->idle && m_cpu.isIdleLoop(pc) && m_cpu.idleSpins(pc))
+    {
+      executed += m_cpu.skipIdle(pc, budget - executed);
+      continue;
+    }
+
+    if (block == NULL || block->code == NULL || block->count > budget - executed)
+    {
+      stepInterpreted();
+      executed++;
+      continue;
+    }
+
+    long remaining = budget - executed;
+    uint32_t next = m_enter(&m_cpu, block->code, remaining, &remaining);
+    executed = budget - remaining;
+
+    m_cpu.m_PC = next & ~JITINTERPRET;
+    if (next & JITINTERPRET)
+    {
+      stepInterpreted();
+      executed++;
+    }
+  }
+
+  return executed;
+}
+
@@ -0,0 +1,107 @@
+#ifndef __JITENGINE__H__
+#define __JITENGINE__H__
+
+#include <vector>
+#include "engine.h"
+
+#define JITCODESIZE (4 << 20)
+#define JITBLOCKMAX 64
+#define HOTTHRESHOLD 8
+
+/* Third execution engine: guest blocks that are entered often enough are
+   translated into x86-64 code. V registers used by a block live in host
+   registers for its whole length, VF updates come straight from the host
+   carry flag, and static exits are chained to the next translated block.
+   Only Drw, Ld_Key, Bnnn and the ops writing guest memory leave the
+   native code and are run by the interpreter; their writes drop the
+   translations they overlap. Reaching the head of a spinning timer wait
+   loop skips the rest of the budget. On hosts other than x86-64 every
+   instruction is interpreted.
+   The code cache is never writable and executable at once: it stays
+   read and execute, and only the pages a block is emitted to or an exit
+   is patched in are opened for writing, for as long as that takes. A
+   flush only rewinds the allocator, the trampoline at the start of the
+   cache is kept. */
+
+class JitEngine : public Engine
+{
+    public :
+
+        JitEngine(Chip8& cpu);
+        virtual ~JitEngine();
+
+        virtual long run(long budget);
+        virtual void flush();
+
+        bool available() const;
+
+    private :
+
+        struct Block
+        {
+            uint16_t start;
+            uint16_t end;
+            int count;
+            const uint8_t *code;
+
+            /* starts a timer wait loop, see Chip8::isIdleLoop */
+            bool idle;
+        };
+
+        typedef uint32_t (*Trampoline)(Chip8*, const uint8_t*, long, long*);
+
+        Block* compile(uint16_t pc);
+        void invalidate(int from, int to);
+        void watch(const Block *block);
+        void link(uint32_t site, uint16_t target);
+        void stepInterpreted();
+        void emitTrampoline();
+        void beginWrite(size_t from, size_t to);
+        void endWrite();
+
+        Chip8& m_cpu;
+
+        uint8_t *m_code;
+        size_t m_used;
+        size_t m_exitStub;
+        Trampoline m_enter;
+
+        /* blocks start past the trampoline */
+        size_t m_firstBlock;
+
+        /* pages open for writing, [m_writeFrom, m_writeTo) */
+        size_t m_pageSize;
+        size_t m_writeFrom;
+        size_t m_writeTo;
+
+        Block* m_blocks[MEMORYSIZE];
+        uint16_t m_hits[MEMORYSIZE];
+        uint16_t m_live[MEMORYSIZE];
+        int m_liveCount;
+        uint64_t m_watched;
+
+        /* code offsets of the rel32 exits that jump to a guest address,
+           and the addresses with any, for flush to clear */
+        std::vector<uint32_t> m_incoming[MEMORYSIZE];
+        uint16_t m_linked[MEMORYSIZE];
+        int m_linkedCount;
+
+        /* offsets of Chip8 fields, baked into the generated code */
+        int32_t m_offRegister;
+        int32_t m_offMemory;
+        int32_t m_offStack;
+        int32_t m_offI;
+        int32_t m_offSP;
+        int32_t m_offDelay;
+        int32_t m_offSound;
+        int32_t m_offGfx;
+        int32_t m_offDirty;
+        int32_t m_offRandom;
+        int32_t m_offKeys;
+
+        /* profile the live translations were made for */
+        profile m_profile;
+};
+
+#endif
+
@@ -0,0 +1,1002 @@
+#include <stdlib.h>
+#include "lockstepEngine.h"
+#include "engine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_PATH
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+#define ADDRESS(arg) ((arg) & (MEMORYSIZE - 1))
+#define ROTR(row, n) (((row) >> (n)) | ((row) << ((HEIGHT - (n)) % HEIGHT)))
+#define LANEBIT(lane) (1u << (lane))
+
+LockstepEngine::LockstepEngine() : m_profile(PROFILE_CLASSIC),
+                                   m_vector(false),
+                                   m_loaded(0),
+                                   m_live(0),
+                                   m_waiting(0),
+                                   m_steps(0),
+                                   m_groups(0),
+                                   m_laneSteps(0),
+                                   m_windowStart(0),
+                                   m_scalar(0)
+{
+    m_state = (laneState*) calloc(1, sizeof(laneState));
+    okConstruct = m_state != NULL;
+
+    m_quirks.shiftUsesVy = QuirksClassic::shiftUsesVy;
+    m_quirks.memory = QuirksClassic::memory;
+    m_quirks.clipSprites = QuirksClassic::clipSprites;
+    m_quirks.jumpUsesVx = QuirksClassic::jumpUsesVx;
+
+    for (int lane = 0; lane < LANES; lane++)
+    {
+      m_error[lane] = OK;
+      m_random[lane] = randomState(0);
+      m_waitRegister[lane] = 0;
+      m_waitKey[lane] = -1;
+      m_loadedAt[lane] = 0;
+      m_stoppedAt[lane] = 0;
+      m_waitedAt[lane] = 0;
+      m_waited[lane] = 0;
+      m_alone[lane] = 0;
+      m_cpus[lane] = NULL;
+      m_engines[lane] = NULL;
+      m_scalarExecuted[lane] = 0;
+      m_rejoinAt[lane] = 0;
+      m_backoff[lane] = LOCKSTEPWINDOW;
+      m_meetings[lane] = 0;
+    }
+
+#ifdef HAVE_AVX2_PATH
+    m_vector = __builtin_cpu_supports("avx2");
+#endif
+}
+
+LockstepEngine::~LockstepEngine()
+{
+    for (int lane = 0; lane < LANES; lane++)
+    {
+      delete m_engines[lane];
+      delete m_cpus[lane];
+    }
+
+    free(m_state);
+    m_state = NULL;
+}
+
+void LockstepEngine::load(int lane, const Chip8& cpu)
+{
+  laneState& s = *m_state;
+
+  for (int r = 0; r < REGNUM; r++)
+    s.V[r][lane] = cpu.m_register[r];
+
+  for (int i = 0; i < STACKSIZE; i++)
+    s.stack[i][lane] = cpu.m_stack[i];
+
+  for (int y = 0; y < WIDTH; y++)
+    s.gfx[y][lane] = cpu.m_gfx[y];
+
+  for (int a = 0; a < MEMORYSIZE; a++)
+    s.memory[a][lane] = cpu.m_memory[a];
+
+  s.pc[lane] = cpu.m_PC;
+  s.I[lane] = cpu.m_I;
+  s.sp[lane] = cpu.m_SP;
+  s.delay[lane] = cpu.m_DelayTimer;
+  s.sound[lane] = cpu.m_SoundTimer;
+
+  /* isKeyPressed is not const */
+  Chip8Keyboard keyboard = cpu.keyboard;
+  s.keys[lane] = 0;
+  for (int k = 0; k < KEYCOUNT; k++)
+    if (keyboard.isKeyPressed(k))
+      s.keys[lane] |= 1 << k;
+
+  m_quirks = cpu.quirks();
+  m_profile = cpu.quirkProfile();
+
+  m_error[lane] = cpu.m_error;
+  m_random[lane] = cpu.m_random;
+  m_waitRegister[lane] = cpu.m_waitRegister;
+  m_waitKey[lane] = cpu.m_waitKey;
+
+  m_loaded |= LANEBIT(lane);
+  m_loadedAt[lane] = m_steps;
+  m_stoppedAt[lane] = m_steps;
+  m_waitedAt[lane] = m_steps;
+  m_waited[lane] = 0;
+  m_alone[lane] = 0;
+  m_scalar &= ~LANEBIT(lane);
+  m_backoff[lane] = LOCKSTEPWINDOW;
+
+  if (cpu.m_keyWait)
+    m_waiting |= LANEBIT(lane);
+  else
+    m_waiting &= ~LANEBIT(lane);
+
+  if (cpu.m_error == OK)
+    m_live |= LANEBIT(lane);
+  else
+    m_live &= ~LANEBIT(lane);
+}
+
+void LockstepEngine::loadAll(const Chip8& cpu)
+{
+  for (int lane = 0; lane < LANES; lane++)
+    load(lane, cpu);
+}
+
+void LockstepEngine::store(int lane, Chip8& cpu) const
+{
+  const laneState& s = *m_state;
+
+  if (m_scalar & LANEBIT(lane))
+  {
+    cpu.copyState(*m_cpus[lane]);
+    return;
+  }
+
+  for (int r = 0; r < REGNUM; r++)
+    cpu.m_register[r] = s.V[r][lane];
+
+  for (int i = 0; i < STACKSIZE; i++)
+    cpu.m_stack[i] = s.stack[i][lane];
+
+  for (int y = 0; y < WIDTH; y++)
+    cpu.m_gfx[y] = s.gfx[y][lane];
+
+  for (int a = 0; a < MEMORYSIZE; a++)
+    cpu.m_memory[a] = s.memory[a][lane];
+
+  cpu.m_PC = s.pc[lane];
+  cpu.m_I = s.I[lane];
+  cpu.m_SP = s.sp[lane];
+  cpu.m_DelayTimer = s.delay[lane];
+  cpu.m_SoundTimer = s.sound[lane];
+
+  for (int k = 0; k < KEYCOUNT; k++)
+    if (s.keys[lane] & (1 << k))
+      cpu.keyboard.pressKey(k);
+    else
+      cpu.keyboard.releaseKey(k);
+
+  cpu.m_error = m_error[lane];
+  cpu.m_random = m_random[lane];
+  cpu.m_keyWait = (m_waiting & LANEBIT(lane)) != 0;
+  cpu.m_waitRegister = m_waitRegister[lane];
+  cpu.m_waitKey = m_waitKey[lane];
+  cpu.m_dirtyRows = ALLROWS;
+}
+
+void LockstepEngine::fail(int lane, int error)
+{
+  m_error[lane] = error;
+  m_live &= ~LANEBIT(lane);
+
+  /* the failing instruction counts, as in CpuCore */
+  m_stoppedAt[lane] = m_steps + 1;
+}
+
+/* Moves lane out of the arrays into a Chip8 of its own; it stays in
+   them when there is no memory for one */
+
+void LockstepEngine::detach(int lane)
+{
+  if (m_cpus[lane] == NULL)
+  {
+    m_cpus[lane] = new Chip8();
+    if (m_cpus[lane] == NULL || !m_cpus[lane]->okConstruct)
+    {
+      delete m_cpus[lane];
+      m_cpus[lane] = NULL;
+      return;
+    }
+  }
+
+  Chip8& cpu = *m_cpus[lane];
+  store(lane, cpu);
+  cpu.setProfile(m_profile);
+
+  if (m_engines[lane] == NULL)
+  {
+    m_engines[lane] = createEngine("threaded", cpu);
+    if (m_engines[lane] == NULL)
+      return;
+  }
+  else
+    m_engines[lane]->flush();
+
+  m_scalarExecuted[lane] = executed(lane);
+  m_scalar |= LANEBIT(lane);
+  m_waiting &= ~LANEBIT(lane);
+  m_meetings[lane] = 0;
+
+  m_rejoinAt[lane] = m_steps + m_backoff[lane];
+  if (m_backoff[lane] < LOCKSTEPWINDOW * LOCKSTEPBACKOFF)
+    m_backoff[lane] *= 2;
+}
+
+/* Brings lane back from its Chip8, keeping its count and backoff */
+
+void LockstepEngine::attach(int lane)
+{
+  long executed = m_scalarExecuted[lane];
+  long backoff = m_backoff[lane];
+
+  load(lane, *m_cpus[lane]);
+
+  m_loadedAt[lane] = m_steps - executed;
+  m_backoff[lane] = backoff;
+}
+
+/* At the end of a window: lanes mostly in small groups go on alone, and
+   lanes alone that meet enough others at one PC come back */
+
+void LockstepEngine::regroup()
+{
+  laneState& s = *m_state;
+
+  for (uint32_t lanes = m_live & ~m_scalar; lanes != 0; lanes &= lanes - 1)
+  {
+    int lane = __builtin_ctz(lanes);
+    if (m_alone[lane] * 2 > m_steps - m_windowStart)
+      detach(lane);
+  }
+
+  uint32_t alone = m_scalar & m_live;
+  uint32_t joining = 0;
+
+  for (uint32_t lanes = alone; lanes != 0; lanes &= lanes - 1)
+  {
+    int lane = __builtin_ctz(lanes);
+    uint16_t pc = m_cpus[lane]->programCounter();
+    uint32_t met = 0;
+
+    for (uint32_t others = m_live & ~m_scalar & ~m_waiting; others != 0; others &= others - 1)
+      if (s.pc[__builtin_ctz(others)] == pc)
+        met |= LANEBIT(__builtin_ctz(others));
+
+    for (uint32_t others = alone; others != 0; others &= others - 1)
+      if (m_cpus[__builtin_ctz(others)]->programCounter() == pc)
+        met |= LANEBIT(__builtin_ctz(others));
+
+    if (__builtin_popcount(met) < LOCKSTEPMINGROUP || m_cpus[lane]->waitingForKey())
+      m_meetings[lane] = 0;
+    else if (++m_meetings[lane] >= LOCKSTEPMEETINGS && m_steps >= m_rejoinAt[lane])
+      joining |= LANEBIT(lane);
+  }
+
+  for (uint32_t lanes = joining; lanes != 0; lanes &= lanes - 1)
+    attach(__builtin_ctz(lanes));
+
+  for (int lane = 0; lane < LANES; lane++)
+    m_alone[lane] = 0;
+  m_windowStart = m_steps;
+}
+
+void LockstepEngine::runScalar(long budget)
+{
+  for (uint32_t lanes = m_scalar & m_live; lanes != 0; lanes &= lanes - 1)
+  {
+    int lane = __builtin_ctz(lanes);
+
+    m_scalarExecuted[lane] += m_engines[lane]->run(budget);
+    if (m_cpus[lane]->errorCode() != OK)
+      m_live &= ~LANEBIT(lane);
+  }
+}
+
+#ifdef HAVE_AVX2_PATH
+
+/* One 0x00 / 0xFF byte per lane of a 32-bit lane mask */
+
+static inline AVX2 __m256i laneBytes(uint32_t mask)
+{
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                          2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+
+  __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(mask), spread);
+  return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, select), select);
+}
+
+/* The same for 16 lanes of 16-bit words */
+
+static inline AVX2 __m256i laneWords(uint32_t mask)
+{
+  const __m256i select = _mm256_setr_epi16(0x0001, 0x0002, 0x0004, 0x0008,
+                                           0x0010, 0x0020, 0x0040, 0x0080,
+                                           0x0100, 0x0200, 0x0400, 0x0800,
+                                           0x1000, 0x2000, 0x4000, (short) 0x8000);
+
+  __m256i words = _mm256_set1_epi16((short) mask);
+  return _mm256_cmpeq_epi16(_mm256_and_si256(words, select), select);
+}
+
+static inline AVX2 __m256i loadRow(const void *row)
+{
+  return _mm256_loadu_si256((const __m256i*) row);
+}
+
+static inline AVX2 void storeRow(void *row, __m256i value)
+{
+  _mm256_storeu_si256((__m256i*) row, value);
+}
+
+static inline AVX2 void blendRow(uint8_t *row, __m256i value, __m256i mask)
+{
+  storeRow(row, _mm256_blendv_epi8(loadRow(row), value, mask));
+}
+
+/* words[lane] = value for the lanes in mask */
+
+static inline AVX2 void blendWords(uint16_t *words, __m256i value, uint32_t mask)
+{
+  storeRow(words, _mm256_blendv_epi8(loadRow(words), value, laneWords(mask)));
+  storeRow(words + 16, _mm256_blendv_epi8(loadRow(words + 16), value, laneWords(mask >> 16)));
+}
+
+/* words[lane] += addend[lane] for the lanes in mask */
+
+static inline AVX2 void addWords(uint16_t *words, __m256i low, __m256i high, uint32_t mask)
+{
+  low = _mm256_and_si256(low, laneWords(mask));
+  high = _mm256_and_si256(high, laneWords(mask >> 16));
+  storeRow(words, _mm256_add_epi16(loadRow(words), low));
+  storeRow(words + 16, _mm256_add_epi16(loadRow(words + 16), high));
+}
+
+/* Moves PC of the group past the instruction, and past the next one for
+   the lanes in skip */
+
+static inline AVX2 void advance(uint16_t *pc, uint32_t group, uint32_t skip)
+{
+  const __m256i next = _mm256_set1_epi16(NEXT);
+
+  __m256i low = _mm256_add_epi16(_mm256_and_si256(next, laneWords(group)),
+                                 _mm256_and_si256(next, laneWords(skip)));
+  __m256i high = _mm256_add_epi16(_mm256_and_si256(next, laneWords(group >> 16)),
+                                  _mm256_and_si256(next, laneWords(skip >> 16)));
+
+  storeRow(pc, _mm256_add_epi16(loadRow(pc), low));
+  storeRow(pc + 16, _mm256_add_epi16(loadRow(pc + 16), high));
+}
+
+static AVX2 uint32_t sameLanesAvx2(const uint16_t *pc, const uint8_t *high, const uint8_t *low,
+                                   uint32_t pending, uint16_t address, uint16_t opcode)
+{
+  __m256i target = _mm256_set1_epi16(address);
+  __m256i first = _mm256_cmpeq_epi16(loadRow(pc), target);
+  __m256i second = _mm256_cmpeq_epi16(loadRow(pc + 16), target);
+
+  /* packs interleaves the 128-bit halves, the permute restores lane order */
+  __m256i samePC = _mm256_permute4x64_epi64(_mm256_packs_epi16(first, second), 0xD8);
+
+  __m256i sameOp = _mm256_and_si256(
+      _mm256_cmpeq_epi8(loadRow(high), _mm256_set1_epi8(opcode >> BYTESIZE)),
+      _mm256_cmpeq_epi8(loadRow(low), _mm256_set1_epi8(opcode & 0xFF)));
+
+  return pending & (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(samePC, sameOp));
+}
+
+/* Runs opcode on every lane of group at once, false for the opcodes left
+   to executeLane */
+
+static AVX2 bool executeAvx2(uint8_t (*V)[LANES], uint8_t *delay, uint8_t *sound, uint16_t *pc,
+                             uint16_t *I, uint32_t group, uint16_t opcode, command code,
+                             bool shiftUsesVy)
+{
+  const __m256i one = _mm256_set1_epi8(1);
+
+  uint8_t *vx = V[XMASK(opcode)];
+  uint8_t *vy = V[YMASK(opcode)];
+  uint8_t *vf = V[VF];
+  __m256i kk = _mm256_set1_epi8(CONSTMASK(opcode));
+  __m256i lanes = laneBytes(group);
+  uint32_t skip = 0;
+
+  switch (code)
+  {
+    case JP:
+      if (ADDRESSMASK(opcode) < ENTRYPOINT)
+        return false;
+      blendWords(pc, _mm256_set1_epi16(ADDRESSMASK(opcode)), group);
+      return true;
+
+    case SE_CONST:
+      skip = group & _mm256_movemask_epi8(_mm256_cmpeq_epi8(loadRow(vx), kk));
+      break;
+
+    case SNE_CONST:
+      skip = group & ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(loadRow(vx), kk));
+      break;
+
+    case SE_REG:
+      skip = group & _mm256_movemask_epi8(_mm256_cmpeq_epi8(loadRow(vx), loadRow(vy)));
+      break;
+
+    case SNE_REG:
+      skip = group & ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(loadRow(vx), loadRow(vy)));
+      break;
+
+    case LD_CONST:
+      blendRow(vx, kk, lanes);
+      break;
+
+    case ADD_CONST:
+      blendRow(vx, _mm256_add_epi8(loadRow(vx), kk), lanes);
+      break;
+
+    case LD_REG:
+      blendRow(vx, loadRow(vy), lanes);
+      break;
+
+    case OR:
+      blendRow(vx, _mm256_or_si256(loadRow(vx), loadRow(vy)), lanes);
+      break;
+
+    case AND:
+      blendRow(vx, _mm256_and_si256(loadRow(vx), loadRow(vy)), lanes);
+      break;
+
+    case XOR:
+      blendRow(vx, _mm256_xor_si256(loadRow(vx), loadRow(vy)), lanes);
+      break;
+
+    /* VF is written first and the operands read again, as the handlers
+       do when x or y is F */
+
+    case ADD_REG:
+    {
+      __m256i a = loadRow(vx), b = loadRow(vy);
+      __m256i noCarry = _mm256_cmpeq_epi8(_mm256_adds_epu8(a, b), _mm256_add_epi8(a, b));
+      blendRow(vf, _mm256_andnot_si256(noCarry, one), lanes);
+      blendRow(vx, _mm256_add_epi8(loadRow(vx), loadRow(vy)), lanes);
+      break;
+    }
+
+    case SUB:
+    {
+      __m256i a = loadRow(vx), b = loadRow(vy);
+      __m256i noBorrow = _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a);
+      blendRow(vf, _mm256_and_si256(noBorrow, one), lanes);
+      blendRow(vx, _mm256_sub_epi8(loadRow(vx), loadRow(vy)), lanes);
+      break;
+    }
+
+    case SUBN:
+    {
+      __m256i a = loadRow(vx), b = loadRow(vy);
+      __m256i noBorrow = _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), b);
+      blendRow(vf, _mm256_and_si256(noBorrow, one), lanes);
+      blendRow(vx, _mm256_sub_epi8(loadRow(vy), loadRow(vx)), lanes);
+      break;
+    }
+
+    case SHR:
+    {
+      uint8_t *src = shiftUsesVy ? vy : vx;
+      blendRow(vf, _mm256_and_si256(loadRow(src), one), lanes);
+      __m256i shifted = _mm256_srli_epi16(loadRow(src), 1);
+      blendRow(vx, _mm256_and_si256(shifted, _mm256_set1_epi8(0x7F)), lanes);
+      break;
+    }
+
+    case SHL:
+    {
+      uint8_t *src = shiftUsesVy ? vy : vx;
+      __m256i top = _mm256_srli_epi16(loadRow(src), BYTESIZE - 1);
+      blendRow(vf, _mm256_and_si256(top, one), lanes);
+      blendRow(vx, _mm256_add_epi8(loadRow(src), loadRow(src)), lanes);
+      break;
+    }
+
+    case LD_I:
+      blendWords(I, _mm256_set1_epi16(ADDRESSMASK(opcode)), group);
+      break;
+
+    case ADD_I:
+    {
+      __m256i row = loadRow(vx);
+      addWords(I, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(row)),
+               _mm256_cvtepu8_epi16(_mm256_extracti128_si256(row, 1)), group);
+      break;
+    }
+
+    case LD_REG_DT:
+      blendRow(vx, loadRow(delay), lanes);
+      break;
+
+    case LD_DT:
+      blendRow(delay, loadRow(vx), lanes);
+      break;
+
+    case LD_ST:
+      blendRow(sound, loadRow(vx), lanes);
+      break;
+
+    default:
+      return false;
+  }
+
+  advance(pc, group, skip);
+  return true;
+}
+
+#endif
+
+/* The lanes of pending at pc whose next instruction is opcode */
+
+uint32_t LockstepEngine::sameLanes(uint32_t pending, uint16_t pc, uint16_t opcode) const
+{
+  const laneState& s = *m_state;
+
+#ifdef HAVE_AVX2_PATH
+  if (m_vector)
+    return sameLanesAvx2(s.pc, s.memory[ADDRESS(pc)], s.memory[ADDRESS(pc + 1)], pending, pc,
+                         opcode);
+#endif
+
+  uint32_t same = 0;
+  const uint8_t *high = s.memory[ADDRESS(pc)];
+  const uint8_t *low = s.memory[ADDRESS(pc + 1)];
+
+  for (uint32_t lanes = pending; lanes != 0; lanes &= lanes - 1)
+  {
+    int lane = __builtin_ctz(lanes);
+    if (s.pc[lane] == pc && ((high[lane] << BYTESIZE) | low[lane]) == opcode)
+      same |= LANEBIT(lane);
+  }
+
+  return same;
+}
+
+/* One instruction for every lane in running, one group at a time */
+
+void LockstepEngine::step(uint32_t running)
+{
+  laneState& s = *m_state;
+  uint32_t pending = running;
+
+  while (pending != 0)
+  {
+    int leader = __builtin_ctz(pending);
+    uint16_t pc = s.pc[leader];
+    uint16_t opcode = (s.memory[ADDRESS(pc)][leader] << BYTESIZE) | s.memory[ADDRESS(pc + 1)][leader];
+    command code = Chip8::FSM[Chip8::s_dispatch[opcode]].code;
+
+    uint32_t group = sameLanes(pending, pc, opcode);
+    int size = __builtin_popcount(group);
+    pending &= ~group;
+
+    m_groups++;
+    m_laneSteps += size;
+
+    if (size < LOCKSTEPMINGROUP)
+      for (uint32_t lanes = group; lanes != 0; lanes &= lanes - 1)
+        m_alone[__builtin_ctz(lanes)]++;
+
+    /* as Chip8::fetch, an opcode straddling the end of memory */
+    if (pc > MEMORYSIZE - NEXT)
+    {
+      for (; group != 0; group &= group - 1)
+        fail(__builtin_ctz(group), ADDRESSERR);
+      continue;
+    }
+
+#ifdef HAVE_AVX2_PATH
+    if (m_vector && executeAvx2(s.V, s.delay, s.sound, s.pc, s.I, group, opcode, code,
+                                m_quirks.shiftUsesVy))
+      continue;
+#endif
+
+    for (; group != 0; group &= group - 1)
+      executeLane(__builtin_ctz(group), opcode, code);
+  }
+}
+
+/* The handlers of chip8.cpp on one lane, with the quirks read at run time */
+
+void LockstepEngine::executeLane(int lane, uint16_t opcode, command code)
+{
+  laneState& s = *m_state;
+
+  uint8_t &vx = s.V[XMASK(opcode)][lane];
+  uint8_t &vy = s.V[YMASK(opcode)][lane];
+  uint8_t &vf = s.V[VF][lane];
+  uint16_t &pc = s.pc[lane];
+  uint16_t &I = s.I[lane];
+  uint16_t &sp = s.sp[lane];
+  uint16_t address = ADDRESSMASK(opcode);
+  uint8_t kk = CONSTMASK(opcode);
+  int x_reg = XMASK(opcode);
+
+  switch (code)
+  {
+    case CLS:
+      for (int y = 0; y < WIDTH; y++)
+        s.gfx[y][lane] = 0;
+      break;
+
+    case RET:
+      if (sp <= 0 || sp > STACKSIZE)
+      {
+        fail(lane, STACKERROR);
+        break;
+      }
+      pc = s.stack[--sp][lane];
+      break;
+
+    case JP:
+      if (address < ENTRYPOINT)
+      {
+        fail(lane, ADDRESSERR);
+        break;
+      }
+      pc = address;
+      return;
+
+    case CALL:
+      if (address < ENTRYPOINT || sp >= STACKSIZE)
+      {
+        fail(lane, address < ENTRYPOINT ? ADDRESSERR : STACKERROR);
+        break;
+      }
+      s.stack[sp++][lane] = pc;
+      pc = address;
+      return;
+
+    case SE_CONST:
+      if (vx == kk)
+        pc += NEXT;
+      break;
+
+    case SNE_CONST:
+      if (vx != kk)
+        pc += NEXT;
+      break;
+
+    case SE_REG:
+      if (vx == vy)
+        pc += NEXT;
+      break;
+
+    case SNE_REG:
+      if (vx != vy)
+        pc += NEXT;
+      break;
+
+    case LD_CONST:
+      vx = kk;
+      break;
+
+    case ADD_CONST:
+      vx += kk;
+      break;
+
+    case LD_REG:
+      vx = vy;
+      break;
+
+    case OR:
+      vx |= vy;
+      break;
+
+    case AND:
+      vx &= vy;
+      break;
+
+    case XOR:
+      vx ^= vy;
+      break;
+
+    case ADD_REG:
+      vf = int(vx) + int(vy) >= BYTE;
+      vx += vy;
+      break;
+
+    case SUB:
+      vf = vx >= vy;
+      vx -= vy;
+      break;
+
+    case SUBN:
+      vf = vy >= vx;
+      vx = vy - vx;
+      break;
+
+    case SHR:
+    {
+      uint8_t &src = m_quirks.shiftUsesVy ? vy : vx;
+      vf = src & 1;
+      vx = src >> 1;
+      break;
+    }
+
+    case SHL:
+    {
+      uint8_t &src = m_quirks.shiftUsesVy ? vy : vx;
+      vf = src >> 7;
+      vx = src << 1;
+      break;
+    }
+
+    case LD_I:
+      I = address;
+      break;
+
+    case JP_REG:
+      if (address < ENTRYPOINT)
+      {
+        fail(lane, ADDRESSERR);
+        break;
+      }
+      pc = s.V[m_quirks.jumpUsesVx ? x_reg : V0][lane] + address;
+      return;
+
+    case RND:
+      vx = randomByte(&m_random[lane]) & kk;
+      break;
+
+    case DRW:
+    {
+      if (I + NIBBLE(opcode) > MEMORYSIZE)
+      {
+        fail(lane, ADDRESSERR);
+        break;
+      }
+
+      int startX = vx % HEIGHT;
+      int startY = vy % WIDTH;
+      uint64_t hit = 0;
+
+      for (int r = 0; r < NIBBLE(opcode); r++)
+      {
+        uint64_t sprite = (uint64_t) s.memory[I + r][lane] << (HEIGHT - BYTESIZE);
+        uint64_t mask = m_quirks.clipSprites ? sprite >> startX : ROTR(sprite, startX);
+        int row = startY + r;
+
+        if (row >= WIDTH)
+        {
+          if (m_quirks.clipSprites)
+            break;
+          row -= WIDTH;
+        }
+
+        hit |= s.gfx[row][lane] & mask;
+        s.gfx[row][lane] ^= mask;
+      }
+
+      vf = hit != 0;
+      break;
+    }
+
+    case SKP:
+      if (s.keys[lane] & (1 << NIBBLE(vx)))
+        pc += NEXT;
+      break;
+
+    case SKNP:
+      if (!(s.keys[lane] & (1 << NIBBLE(vx))))
+        pc += NEXT;
+      break;
+
+    case LD_REG_DT:
+      vx = s.delay[lane];
+      break;
+
+    case LD_KEY:
+      /* PC stays on the instruction, releaseKey completes it */
+      if (!(m_waiting & LANEBIT(lane)))
+      {
+        m_waiting |= LANEBIT(lane);
+        m_waitRegister[lane] = x_reg;
+        m_waitKey[lane] = -1;
+        /* the Fx0A itself ran in this step */
+        m_waitedAt[lane] = m_steps + 1;
+      }
+      return;
+
+    case LD_DT:
+      s.delay[lane] = vx;
+      break;
+
+    case LD_ST:
+      s.sound[lane] = vx;
+      break;
+
+    case ADD_I:
+      I += vx;
+      break;
+
+    case LD_SPR:
+      I = vx * NUMBERLENGTH;
+      break;
+
+    case LD_BCD:
+      if (I + 3 > MEMORYSIZE)
+      {
+        fail(lane, ADDRESSERR);
+        break;
+      }
+      s.memory[I][lane] = vx / 100;
+      s.memory[I + 1][lane] = (vx / 10) % 10;
+      s.memory[I + 2][lane] = vx % 10;
+      break;
+
+    case LD_REG_MEM:
+      if (I + x_reg + 1 > MEMORYSIZE)
+      {
+        fail(lane, ADDRESSERR);
+        break;
+      }
+      for (int i = 0; i <= x_reg; i++)
+        s.memory[I + i][lane] = s.V[i][lane];
+      I += memoryStep(m_quirks.memory, x_reg);
+      break;
+
+    case LD_REG_LOAD:
+      if (I + x_reg + 1 > MEMORYSIZE)
+      {
+        fail(lane, ADDRESSERR);
+        break;
+      }
+      for (int i = 0; i <= x_reg; i++)
+        s.V[i][lane] = s.memory[I + i][lane];
+      I += memoryStep(m_quirks.memory, x_reg);
+      break;
+
+    default:
+      fail(lane, UNKNOWN);
+      return;
+  }
+
+  pc += NEXT;
+}
+
+void LockstepEngine::run(long budget)
+{
+  if (m_scalar != 0)
+    runScalar(budget);
+
+  long i = 0;
+  for (; i < budget; i++)
+  {
+    uint32_t running = m_live & ~m_waiting & ~m_scalar;
+
+    /* only a key event resumes lanes blocked on Fx0A */
+    if (running == 0)
+      break;
+
+    step(running);
+    m_steps++;
+  }
+
+  /* the clock of the windows runs on when every lane waits or left; the
+     counts of the lanes are differences of it and do not change */
+  m_steps += budget - i;
+
+  if (m_steps - m_windowStart >= LOCKSTEPWINDOW)
+    regroup();
+}
+
+void LockstepEngine::decreaseTimers()
+{
+  laneState& s = *m_state;
+
+  for (int lane = 0; lane < LANES; lane++)
+  {
+    if (s.delay[lane] > 0)
+      --s.delay[lane];
+
+    if (s.sound[lane] > 0)
+      --s.sound[lane];
+  }
+
+  for (uint32_t lanes = m_scalar; lanes != 0; lanes &= lanes - 1)
+    m_cpus[__builtin_ctz(lanes)]->decreaseTimers();
+}
+
+/* Fx0A takes the first key pressed after it started waiting, once that
+   key is released again */
+
+void LockstepEngine::pressKey(int lane, uint8_t key)
+{
+  if (m_scalar & LANEBIT(lane))
+  {
+    m_cpus[lane]->pressKey(key);
+    return;
+  }
+
+  m_state->keys[lane] |= 1 << key;
+
+  if ((m_waiting & LANEBIT(lane)) && m_waitKey[lane] == -1)
+    m_waitKey[lane] = key;
+}
+
+void LockstepEngine::releaseKey(int lane, uint8_t key)
+{
+  laneState& s = *m_state;
+
+  if (m_scalar & LANEBIT(lane))
+  {
+    m_cpus[lane]->releaseKey(key);
+    return;
+  }
+
+  s.keys[lane] &= ~(1 << key);
+
+  if ((m_waiting & LANEBIT(lane)) && m_waitKey[lane] == key)
+  {
+    s.V[m_waitRegister[lane]][lane] = key;
+    s.pc[lane] += NEXT;
+    m_waiting &= ~LANEBIT(lane);
+    m_waited[lane] += m_steps - m_waitedAt[lane];
+  }
+}
+
+int LockstepEngine::errorCode(int lane) const
+{
+  if (m_scalar & LANEBIT(lane))
+    return m_cpus[lane]->errorCode();
+
+  return m_error[lane];
+}
+
+uint16_t LockstepEngine::programCounter(int lane) const
+{
+  if (m_scalar & LANEBIT(lane))
+    return m_cpus[lane]->programCounter();
+
+  return m_state->pc[lane];
+}
+
+long LockstepEngine::executed(int lane) const
+{
+  if (!(m_loaded & LANEBIT(lane)))
+    return 0;
+
+  if (m_scalar & LANEBIT(lane))
+    return m_scalarExecuted[lane];
+
+  long end = (m_live & LANEBIT(lane)) ? m_steps : m_stoppedAt[lane];
+  long waiting = (m_waiting & LANEBIT(lane)) ? end - m_waitedAt[lane] : 0;
+
+  return end - m_loadedAt[lane] - m_waited[lane] - waiting;
+}
+
+uint32_t LockstepEngine::liveLanes() const
+{
+  return m_live;
+}
+
+void LockstepEngine::copyScreen(int lane, uint64_t *rows) const
+{
+  if (m_scalar & LANEBIT(lane))
+  {
+    memcpy(rows, m_cpus[lane]->screen(), ROWBYTES);
+    return;
+  }
+
+  for (int y = 0; y < WIDTH; y++)
+    rows[y] = m_state->gfx[y][lane];
+}
+
+double LockstepEngine::occupancy() const
+{
+  return m_groups > 0 ? (double) m_laneSteps / m_groups : 0.0;
+}
+
+bool LockstepEngine::vectorised() const
+{
+  return m_vector;
+}
+
+uint32_t LockstepEngine::scalarLanes() const
+{
+  return m_scalar;
+}
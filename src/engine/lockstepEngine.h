@@ -0,0 +1,166 @@
+#ifndef __LOCKSTEPENGINE__H__
+#define __LOCKSTEPENGINE__H__
+
+#include "../chip8/chip8.h"
+
+#define LANES 32
+#define ALLLANES 0xFFFFFFFFu
+
+/* A group smaller than this costs more per lane than a scalar engine */
+#define LOCKSTEPMINGROUP 4
+
+/* Steps over which the groups of a lane are counted before it may leave
+   or come back */
+#define LOCKSTEPWINDOW 256
+
+/* Longest a lane that left waits before it may come back, in windows */
+#define LOCKSTEPBACKOFF 64
+
+/* Window ends in a row a lane must meet others at its PC to come back */
+#define LOCKSTEPMEETINGS 4
+
+class Engine;
+
+/* Runs up to LANES guests together, usually copies of one ROM fed with
+   different inputs. Their state is kept as structure of arrays, byte
+   register Vx of every lane in one 32-byte row, so each step executes an
+   instruction once for all the lanes whose PC and opcode agree: the ALU
+   ops, the skips, Annn, Fx1E, the timer moves and 1nnn with a masked AVX2
+   blend, the rest lane by lane with the semantics of chip8.cpp. Lanes that
+   diverge form groups of their own and join again when their PCs meet.
+   Without AVX2 on the host every group runs lane by lane.
+   A lane that spent most of the last LOCKSTEPWINDOW steps in groups
+   smaller than LOCKSTEPMINGROUP, e.g. because every lane draws Cxkk from
+   its own seed, leaves the arrays for a Chip8 of its own run by the
+   threaded engine. It comes back once it was at the PC of at least
+   LOCKSTEPMINGROUP lanes at the end of LOCKSTEPMEETINGS windows in a
+   row, as games are on their title or game over screen; every time it
+   leaves again it waits twice as many windows before it may. Only the lanes that stay together, such
+   as copies of a ROM fed different keys that rarely use Cxkk, run faster
+   than one engine per instance; the ones that keep diverging run at
+   about the speed of the threaded engine.
+   All the lanes share one quirk profile. As in chip8.cpp, an access or
+   a fetch past MEMORYSIZE stops the lane with ADDRESSERR and a Call on a
+   full stack with STACKERROR. */
+
+class LockstepEngine
+{
+    public:
+
+        LockstepEngine();
+        ~LockstepEngine();
+
+        bool okConstruct;
+
+        /* Copies the whole state of cpu into lane, its profile becomes
+           the profile of every lane */
+        void load(int lane, const Chip8& cpu);
+        void loadAll(const Chip8& cpu);
+
+        /* Copies lane back into cpu, e.g. to go on with another engine */
+        void store(int lane, Chip8& cpu) const;
+
+        /* Executes budget instructions on every loaded lane that has not
+           stopped on an error; a lane waiting on Fx0A sits them out, and
+           run() returns early once all of them wait */
+        void run(long budget);
+
+        void decreaseTimers();
+
+        /* Key events of one lane; a release can finish its pending Fx0A */
+        void pressKey(int lane, uint8_t key);
+        void releaseKey(int lane, uint8_t key);
+
+        int errorCode(int lane) const;
+        uint16_t programCounter(int lane) const;
+
+        /* Instructions lane executed since it was loaded */
+        long executed(int lane) const;
+
+        /* Loaded lanes that have not stopped on an error */
+        uint32_t liveLanes() const;
+
+        /* WIDTH rows of lane's display, as Chip8::screen() lays them out */
+        void copyScreen(int lane, uint64_t *rows) const;
+
+        /* Lanes executed per group, LANES when nothing ever diverged */
+        double occupancy() const;
+
+        /* Groups go through the AVX2 path */
+        bool vectorised() const;
+
+        /* Lanes that left the arrays for a scalar engine */
+        uint32_t scalarLanes() const;
+
+    private:
+
+        struct laneState
+        {
+            uint8_t V[REGNUM][LANES];
+            uint8_t delay[LANES];
+            uint8_t sound[LANES];
+            uint16_t pc[LANES];
+            uint16_t I[LANES];
+            uint16_t sp[LANES];
+            uint16_t keys[LANES];
+            uint16_t stack[STACKSIZE][LANES];
+            uint64_t gfx[WIDTH][LANES];
+            uint8_t memory[MEMORYSIZE][LANES];
+        };
+
+        void step(uint32_t running);
+        uint32_t sameLanes(uint32_t pending, uint16_t pc, uint16_t opcode) const;
+        void executeLane(int lane, uint16_t opcode, command code);
+        void fail(int lane, int error);
+        void detach(int lane);
+        void attach(int lane);
+        void regroup();
+        void runScalar(long budget);
+
+        laneState *m_state;
+
+        quirkSet m_quirks;
+        profile m_profile;
+        bool m_vector;
+
+        uint32_t m_loaded;
+        uint32_t m_live;
+        uint32_t m_waiting;
+
+        int m_error[LANES];
+        uint64_t m_random[LANES];
+
+        /* pending Fx0A of every lane, as in Chip8 */
+        int m_waitRegister[LANES];
+        int m_waitKey[LANES];
+
+        /* steps since construction; a lane's count is the span it was
+           live for, less the steps it spent waiting on Fx0A */
+        long m_steps;
+        long m_loadedAt[LANES];
+        long m_stoppedAt[LANES];
+        long m_waitedAt[LANES];
+        long m_waited[LANES];
+
+        long m_groups;
+        long m_laneSteps;
+
+        /* steps of each lane in a group below LOCKSTEPMINGROUP since the
+           window started */
+        long m_alone[LANES];
+        long m_windowStart;
+
+        /* lanes in m_scalar live in m_cpus[lane], run by m_engines[lane];
+           both are kept for the next time the lane leaves. A lane may
+           come back from step m_rejoinAt on, m_backoff later each time
+           it left, after m_meetings window ends in a row with others. */
+        uint32_t m_scalar;
+        Chip8 *m_cpus[LANES];
+        Engine *m_engines[LANES];
+        long m_scalarExecuted[LANES];
+        long m_rejoinAt[LANES];
+        long m_backoff[LANES];
+        int m_meetings[LANES];
+};
+
+#endif
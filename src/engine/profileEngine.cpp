@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <vector>
+#include "profileEngine.h"
+
+long ProfileEngine::s_executed;
+long ProfileEngine::s_pairs[FSMSIZE][FSMSIZE];
+long ProfileEngine::s_triples[FSMSIZE][FSMSIZE][FSMSIZE];
+
+ProfileEngine::ProfileEngine(Chip8& cpu) : m_cpu(cpu),
+                                           m_last(-1),
+                                           m_beforeLast(-1),
+                                           m_lastPC(0)
+{}
+
+void ProfileEngine::flush()
+{
+  m_last = -1;
+  m_beforeLast = -1;
+}
+
+long ProfileEngine::run(long budget)
+{
+  long executed = 0;
+
+  while (executed < budget && m_cpu.m_error == OK)
+  {
+    /* Fx0A suspended the guest */
+    if (m_cpu.m_keyWait)
+      break;
+
+    uint16_t pc = m_cpu.m_PC;
+    int index = Chip8::s_dispatch[m_cpu.fetch()];
+
+    m_cpu.doCycle();
+    executed++;
+
+    /* only straight-line neighbours can be fused */
+    if (m_last < 0 || pc != m_lastPC + NEXT)
+    {
+      m_beforeLast = -1;
+    }
+    else
+    {
+      s_pairs[m_last][index]++;
+      if (m_beforeLast >= 0)
+        s_triples[m_beforeLast][m_last][index]++;
+      m_beforeLast = m_last;
+    }
+
+    m_last = index;
+    m_lastPC = pc;
+  }
+
+  s_executed += executed;
+  return executed;
+}
+
+const char* ProfileEngine::name(int index)
+{
+  switch (Chip8::FSM[index].code)
+  {
+    case CLS:         return "CLS";
+    case RET:         return "RET";
+    case JP:          return "JP";
+    case CALL:        return "CALL";
+    case SE_CONST:    return "SE_CONST";
+    case SNE_CONST:   return "SNE_CONST";
+    case SE_REG:      return "SE_REG";
+    case LD_CONST:    return "LD_CONST";
+    case ADD_CONST:   return "ADD_CONST";
+    case LD_REG:      return "LD_REG";
+    case OR:          return "OR";
+    case AND:         return "AND";
+    case XOR:         return "XOR";
+    case ADD_REG:     return "ADD_REG";
+    case SUB:         return "SUB";
+    case SHR:         return "SHR";
+    case SUBN:        return "SUBN";
+    case SHL:         return "SHL";
+    case SNE_REG:     return "SNE_REG";
+    case LD_I:        return "LD_I";
+    case JP_REG:      return "JP_REG";
+    case RND:         return "RND";
+    case DRW:         return "DRW";
+    case SKP:         return "SKP";
+    case SKNP:        return "SKNP";
+    case LD_REG_DT:   return "LD_REG_DT";
+    case LD_KEY:      return "LD_KEY";
+    case LD_DT:       return "LD_DT";
+    case LD_ST:       return "LD_ST";
+    case ADD_I:       return "ADD_I";
+    case LD_SPR:      return "LD_SPR";
+    case LD_BCD:      return "LD_BCD";
+    case LD_REG_MEM:  return "LD_REG_MEM";
+    case LD_REG_LOAD: return "LD_REG_LOAD";
+    default:          return "TRAP";
+  }
+}
+
+struct Entry
+{
+    long count;
+    int first;
+    int second;
+    int third;
+
+    bool operator<(const Entry& other) const { return count > other.count; }
+};
+
+void ProfileEngine::report(FILE *out, int top)
+{
+  std::vector<Entry> pairs;
+  std::vector<Entry> triples;
+
+  for (int a = 0; a < FSMSIZE; a++)
+    for (int b = 0; b < FSMSIZE; b++)
+    {
+      if (s_pairs[a][b] > 0)
+      {
+        Entry entry = {s_pairs[a][b], a, b, -1};
+        pairs.push_back(entry);
+      }
+
+      for (int c = 0; c < FSMSIZE; c++)
+        if (s_triples[a][b][c] > 0)
+        {
+          Entry entry = {s_triples[a][b][c], a, b, c};
+          triples.push_back(entry);
+        }
+    }
+
+  std::sort(pairs.begin(), pairs.end());
+  std::sort(triples.begin(), triples.end());
+
+  double total = s_executed > 0 ? s_executed : 1;
+
+  fprintf(out, "/* adjacent pairs, %ld instructions profiled */\n", s_executed);
+  for (int i = 0; i < top && i < (int) pairs.size(); i++)
+    fprintf(out, "FUSE(%s, %s) /* %ld, %.2f%% */\n", name(pairs[i].first), name(pairs[i].second),
+            pairs[i].count, 100.0 * pairs[i].count / total);
+
+  fprintf(out, "\n/* adjacent triples */\n");
+  for (int i = 0; i < top && i < (int) triples.size(); i++)
+    fprintf(out, "/* %s, %s, %s: %ld, %.2f%% */\n", name(triples[i].first), name(triples[i].second),
+            name(triples[i].third), triples[i].count, 100.0 * triples[i].count / total);
+}
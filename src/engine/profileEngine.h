@@ -0,0 +1,42 @@
+#ifndef __PROFILEENGINE__H__
+#define __PROFILEENGINE__H__
+
+#include <cstdio>
+#include "engine.h"
+
+/* Interpreter that counts how often two or three instructions run back
+   to back from adjacent addresses. The counts are shared by every
+   ProfileEngine in the process, so one bench run over the whole corpus
+   gives a single report; its FUSE() lines are the input for
+   src/engine/fusion.def. */
+
+class ProfileEngine : public Engine
+{
+    public :
+
+        ProfileEngine(Chip8& cpu);
+
+        virtual long run(long budget);
+        virtual void flush();
+
+        /* Prints the top most frequent pairs and triples */
+        static void report(FILE *out, int top);
+
+        /* Mnemonic of FSM entry index, as spelled in enum command */
+        static const char* name(int index);
+
+    private :
+
+        Chip8& m_cpu;
+
+        /* FSM indexes of the last two instructions, or -1 */
+        int m_last;
+        int m_beforeLast;
+        uint16_t m_lastPC;
+
+        static long s_executed;
+        static long s_pairs[FSMSIZE][FSMSIZE];
+        static long s_triples[FSMSIZE][FSMSIZE][FSMSIZE];
+};
+
+#endif
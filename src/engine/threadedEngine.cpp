@@ -0,0 +1,575 @@
+#include <stdlib.h>
+#include "threadedEngine.h"
+
+#define NEXTOP { ++op; goto *op->handler; }
+
+uint8_t ThreadedEngine::s_fusion[FSMSIZE][FSMSIZE];
+
+ThreadedEngine::ThreadedEngine(Chip8& cpu) : m_cpu(cpu),
+                                             m_liveCount(0),
+                                             m_watched(0),
+                                             m_profile(cpu.quirkProfile())
+{
+    static bool fusionReady = buildFusion();
+    (void)fusionReady;
+
+    for (int i = 0; i < MEMORYSIZE; i++)
+      m_blocks[i] = NULL;
+}
+
+bool ThreadedEngine::endsBlock(command code)
+{
+  switch (code)
+  {
+    case RET: case JP: case CALL: case JP_REG: case LD_KEY:
+    case LD_BCD: case LD_REG_MEM: case TRAP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Fills s_fusion from fusion.def, earlier lines get the better rank */
+
+bool ThreadedEngine::buildFusion()
+{
+  static const command pairs[][2] =
+  {
+#define FUSE(first, second) { first, second },
+#include "fusion.def"
+#undef FUSE
+  };
+
+  int count = sizeof(pairs) / sizeof(pairs[0]);
+
+  for (int rank = 0; rank < count; rank++)
+  {
+    int first = TRAPINDEX;
+    int second = TRAPINDEX;
+
+    for (int i = 0; i < FSMSIZE; i++)
+    {
+      if (Chip8::FSM[i].code == pairs[rank][0])
+        first = i;
+      if (Chip8::FSM[i].code == pairs[rank][1])
+        second = i;
+    }
+
+    if (endsBlock(pairs[rank][0]) || s_fusion[first][second] != 0)
+      continue;
+
+    s_fusion[first][second] = rank + 1;
+  }
+
+  return true;
+}
+
+/* A skip only keeps its block going when it can fuse with the next op */
+
+bool ThreadedEngine::continues(uint16_t pc, uint8_t index, int count) const
+{
+  if (count >= MAXBLOCKOPS || pc + NEXT + 1 >= MEMORYSIZE)
+    return false;
+
+  uint16_t next = (m_cpu.m_memory[pc + NEXT] << BYTESIZE) | m_cpu.m_memory[pc + NEXT + 1];
+  return s_fusion[index][Chip8::s_dispatch[next]] != 0;
+}
+
+ThreadedEngine::~ThreadedEngine()
+{
+    flush();
+}
+
+void ThreadedEngine::flush()
+{
+  for (int i = 0; i < m_liveCount; i++)
+  {
+    Block *block = m_blocks[m_live[i]];
+
+    free(block->ops);
+    free(block);
+    m_blocks[m_live[i]] = NULL;
+  }
+
+  m_liveCount = 0;
+  m_watched = 0;
+}
+
+void ThreadedEngine::watch(const Block *block)
+{
+  for (int page = block->start >> WATCHSHIFT; page <= (block->end - 1) >> WATCHSHIFT; page++)
+    m_watched |= 1ULL << page;
+}
+
+/* Drops the blocks overlapping guest bytes [from, to) */
+
+void ThreadedEngine::invalidate(int from, int to)
+{
+  if (to > MEMORYSIZE)
+    to = MEMORYSIZE;
+  if (from >= to)
+    return;
+
+  uint64_t written = 0;
+  for (int page = from >> WATCHSHIFT; page <= (to - 1) >> WATCHSHIFT; page++)
+    written |= 1ULL << page;
+
+  if ((m_watched & written) == 0)
+    return;
+
+  int kept = 0;
+  m_watched = 0;
+
+  for (int i = 0; i < m_liveCount; i++)
+  {
+    Block *block = m_blocks[m_live[i]];
+
+    if (block->start < to && from < block->end)
+    {
+      m_blocks[m_live[i]] = NULL;
+      free(block->ops);
+      free(block);
+      continue;
+    }
+
+    m_live[kept++] = m_live[i];
+    watch(block);
+  }
+
+  m_liveCount = kept;
+}
+
+ThreadedEngine::Block* ThreadedEngine::translate(uint16_t start, const void* const* labels,
+                                                 const void* const* fused)
+{
+  MicroOp ops[MAXBLOCKOPS + 1];
+  int count = 0;
+  uint16_t pc = start;
+  bool terminated = false;
+
+  while (!terminated && count < MAXBLOCKOPS && pc + 1 < MEMORYSIZE)
+  {
+    uint16_t cmd = (m_cpu.m_memory[pc] << BYTESIZE) | m_cpu.m_memory[pc + 1];
+    MicroOp& op = ops[count++];
+
+    op.opcode = cmd;
+    op.pc     = pc;
+    op.nnn    = ADDRESSMASK(cmd);
+    op.x      = XMASK(cmd);
+    op.y      = YMASK(cmd);
+    op.n      = NIBBLE(cmd);
+    op.kk     = CONSTMASK(cmd);
+    op.index  = Chip8::s_dispatch[cmd];
+
+    kind k;
+    switch (Chip8::FSM[op.index].code)
+    {
+      case RET:         k = K_RET;         terminated = true; break;
+      case JP:          k = K_JP;          terminated = true; break;
+      case CALL:        k = K_CALL;        terminated = true; break;
+      case SE_CONST:    k = K_SE_CONST;    terminated = !continues(pc, op.index, count); break;
+      case SNE_CONST:   k = K_SNE_CONST;   terminated = !continues(pc, op.index, count); break;
+      case SE_REG:      k = K_SE_REG;      terminated = !continues(pc, op.index, count); break;
+      case SNE_REG:     k = K_SNE_REG;     terminated = !continues(pc, op.index, count); break;
+      case SKP:         k = K_SKP;         terminated = !continues(pc, op.index, count); break;
+      case SKNP:        k = K_SKNP;        terminated = !continues(pc, op.index, count); break;
+      case LD_BCD:      k = K_LD_BCD;      terminated = true; break;
+      case LD_REG_MEM:  k = K_LD_REG_MEM;  terminated = true; break;
+      case LD_KEY:      k = K_LD_KEY;      terminated = true; break;
+      case LD_CONST:    k = K_LD_CONST;    break;
+      case ADD_CONST:   k = K_ADD_CONST;   break;
+      case LD_REG:      k = K_LD_REG;      break;
+      case OR:          k = K_OR;          break;
+      case AND:         k = K_AND;         break;
+      case XOR:         k = K_XOR;         break;
+      case ADD_REG:     k = K_ADD_REG;     break;
+      case SUB:         k = K_SUB;         break;
+      case SHR:         k = K_SHR;         break;
+      case SUBN:        k = K_SUBN;        break;
+      case SHL:         k = K_SHL;         break;
+      case LD_I:        k = K_LD_I;        break;
+      case LD_REG_DT:   k = K_LD_REG_DT;   break;
+      case LD_DT:       k = K_LD_DT;       break;
+      case LD_ST:       k = K_LD_ST;       break;
+      case ADD_I:       k = K_ADD_I;       break;
+      case LD_SPR:      k = K_LD_SPR;      break;
+      case LD_REG_LOAD: k = K_LD_REG_LOAD; break;
+
+      /* heavy or rare ops run the Chip8 handler */
+      case CLS:
+      case RND:
+      case DRW:         k = K_DELEGATE;    break;
+
+      /* Jp_Reg, Trap */
+      default:          k = K_DELEGATE_EXIT; terminated = true; break;
+    }
+
+    op.handler = labels[k];
+    pc += NEXT;
+  }
+
+  if (count == 0)
+    return NULL;
+
+  /* pair up neighbours, an overlapping better ranked pair wins */
+  for (int i = 0; i + 1 < count; i++)
+  {
+    int rank = s_fusion[ops[i].index][ops[i + 1].index];
+    if (rank == 0)
+      continue;
+
+    if (i + 2 < count)
+    {
+      int overlap = s_fusion[ops[i + 1].index][ops[i + 2].index];
+      if (overlap != 0 && overlap < rank)
+        continue;
+    }
+
+    ops[i].handler = fused[rank - 1];
+    i++;
+  }
+
+  if (!terminated)
+  {
+    ops[count].handler = labels[K_EXIT];
+    ops[count].pc = pc;
+  }
+
+  Block *block = (Block*) calloc(1, sizeof(Block));
+  MicroOp *stored = (MicroOp*) calloc(count + 1, sizeof(MicroOp));
+
+  if (block == NULL || stored == NULL)
+  {
+    free(block);
+    free(stored);
+    return NULL;
+  }
+
+  memcpy(stored, ops, (count + (terminated ? 0 : 1)) * sizeof(MicroOp));
+
+  block->start = start;
+  block->end   = pc;
+  block->count = count;
+  block->ops   = stored;
+  block->idle  = m_cpu.isIdleLoop(start);
+
+  m_blocks[start] = block;
+  m_live[m_liveCount++] = start;
+  watch(block);
+
+  return block;
+}
+
+/* Single step through the interpreter, keeping the blocks coherent */
+
+void ThreadedEngine::stepInterpreted()
+{
+  uint16_t cmd = m_cpu.fetch();
+  command code = Chip8::FSM[Chip8::s_dispatch[cmd]].code;
+  int from = m_cpu.m_I;
+  int to = from;
+
+  if (code == LD_BCD)
+    to = from + 3;
+  if (code == LD_REG_MEM)
+    to = from + XMASK(cmd) + 1;
+
+  m_cpu.doCycle();
+  invalidate(from, to);
+}
+
+/* Micro-op bodies, shared by the single and the fused handlers. Bodies of
+   ops that end a block leave through dispatch, the others fall through.
+   Q is the quirk profile runProfile is instantiated for. */
+
+/* 00EE - RET */
+#define BODY_RET                                                        \
+  if (m_cpu.m_SP <= 0 || m_cpu.m_SP > STACKSIZE)                        \
+  {                                                                     \
+    m_cpu.m_error = STACKERROR;                                         \
+    m_cpu.m_PC = op->pc + NEXT;                                         \
+    goto dispatch;                                                      \
+  }                                                                     \
+  m_cpu.m_PC = m_cpu.m_stack[--m_cpu.m_SP] + NEXT;                      \
+  goto dispatch;
+
+/* 1nnn - JP addr */
+#define BODY_JP                                                         \
+  if (op->nnn < ENTRYPOINT || op->nnn >= MEMORYSIZE)                    \
+  {                                                                     \
+    m_cpu.m_error = ADDRESSERR;                                         \
+    m_cpu.m_PC = op->pc + NEXT;                                         \
+    goto dispatch;                                                      \
+  }                                                                     \
+  m_cpu.m_PC = op->nnn;                                                 \
+  goto dispatch;
+
+/* 2nnn - CALL addr */
+#define BODY_CALL                                                       \
+  if (op->nnn < ENTRYPOINT || op->nnn >= MEMORYSIZE)                    \
+  {                                                                     \
+    m_cpu.m_error = ADDRESSERR;                                         \
+    m_cpu.m_PC = op->pc + NEXT;                                         \
+    goto dispatch;                                                      \
+  }                                                                     \
+  if (m_cpu.m_SP >= STACKSIZE)                                          \
+  {                                                                     \
+    m_cpu.m_error = STACKERROR;                                         \
+    m_cpu.m_PC = op->pc + NEXT;                                         \
+    goto dispatch;                                                      \
+  }                                                                     \
+  m_cpu.m_stack[m_cpu.m_SP++] = op->pc;                                 \
+  m_cpu.m_PC = op->nnn;                                                 \
+  goto dispatch;
+
+/* 3xkk, 4xkk, 5xy0, 9xy0, Ex9E, ExA1 - a taken skip leaves the block, an
+   untaken one too unless it was kept going for its fused partner */
+#define SKIPIF(cond)                                                    \
+  if (cond)                                                             \
+  {                                                                     \
+    m_cpu.m_PC = op->pc + 2 * NEXT;                                     \
+    executed -= block->count - (op - block->ops + 1);                   \
+    goto dispatch;                                                      \
+  }                                                                     \
+  if (op + 1 == block->ops + block->count)                              \
+  {                                                                     \
+    m_cpu.m_PC = op->pc + NEXT;                                         \
+    goto dispatch;                                                      \
+  }
+
+#define BODY_SE_CONST  SKIPIF(V[op->x] == op->kk)
+#define BODY_SNE_CONST SKIPIF(V[op->x] != op->kk)
+#define BODY_SE_REG    SKIPIF(V[op->x] == V[op->y])
+#define BODY_SNE_REG   SKIPIF(V[op->x] != V[op->y])
+#define BODY_SKP       SKIPIF(m_cpu.keyboard.isKeyPressed(V[op->x]))
+#define BODY_SKNP      SKIPIF(!m_cpu.keyboard.isKeyPressed(V[op->x]))
+
+/* 6xkk, 7xkk, 8xy0 - 8xyE: same order of VF updates as chip8.cpp */
+#define BODY_LD_CONST  V[op->x] = op->kk;
+#define BODY_ADD_CONST V[op->x] += op->kk;
+#define BODY_LD_REG    V[op->x] = V[op->y];
+#define BODY_OR        V[op->x] |= V[op->y];
+#define BODY_AND       V[op->x] &= V[op->y];
+#define BODY_XOR       V[op->x] ^= V[op->y];
+
+#define BODY_ADD_REG                                                    \
+  V[VF] = (int(V[op->x]) + int(V[op->y]) < BYTE) ? 0 : 1;               \
+  V[op->x] += V[op->y];
+
+#define BODY_SUB                                                        \
+  V[VF] = (V[op->x] >= V[op->y]) ? 1 : 0;                               \
+  V[op->x] -= V[op->y];
+
+#define BODY_SHR                                                        \
+  V[VF] = V[Q::shiftUsesVy ? op->y : op->x] & 1;                        \
+  V[op->x] = V[Q::shiftUsesVy ? op->y : op->x] >> 1;
+
+#define BODY_SUBN                                                       \
+  V[VF] = (V[op->y] >= V[op->x]) ? 1 : 0;                               \
+  V[op->x] = V[op->y] - V[op->x];
+
+#define BODY_SHL                                                        \
+  V[VF] = V[Q::shiftUsesVy ? op->y : op->x] >> 7;                       \
+  V[op->x] = V[Q::shiftUsesVy ? op->y : op->x] << 1;
+
+/* Annn, Fx07, Fx15, Fx18, Fx1E, Fx29, Fx65 */
+#define BODY_LD_I      m_cpu.m_I = op->nnn;
+#define BODY_LD_REG_DT V[op->x] = m_cpu.m_DelayTimer;
+#define BODY_LD_DT     m_cpu.m_DelayTimer = V[op->x];
+#define BODY_LD_ST     m_cpu.m_SoundTimer = V[op->x];
+#define BODY_ADD_I     m_cpu.m_I += V[op->x];
+#define BODY_LD_SPR    m_cpu.m_I = V[op->x] * NUMBERLENGTH;
+
+#define BODY_LD_REG_LOAD                                                \
+  if (m_cpu.m_I + op->x + 1 > MEMORYSIZE)                               \
+  {                                                                     \
+    m_cpu.m_error = ADDRESSERR;                                         \
+    m_cpu.m_PC = op->pc + NEXT;                                         \
+    executed -= block->count - (op - block->ops + 1);                   \
+    goto dispatch;                                                      \
+  }                                                                     \
+  for (int i = 0; i <= op->x; i++)                                      \
+    V[i] = m_cpu.m_memory[m_cpu.m_I + i];                               \
+  m_cpu.m_I += memoryStep(Q::memory, op->x);
+
+/* Fx33, Fx55 - writes may hit translated code, so they end the block */
+#define BODY_LD_BCD                                                     \
+  {                                                                     \
+    uint16_t next = op->pc + NEXT;                                      \
+    int from = m_cpu.m_I;                                               \
+                                                                        \
+    m_cpu.Ld_Bcd(op->opcode);                                           \
+    invalidate(from, from + 3);                                         \
+    m_cpu.m_PC = next;                                                  \
+  }                                                                     \
+  goto dispatch;
+
+#define BODY_LD_REG_MEM                                                 \
+  {                                                                     \
+    uint16_t next = op->pc + NEXT;                                      \
+    int from = m_cpu.m_I;                                               \
+                                                                        \
+    m_cpu.Ld_Reg_Mem<Q>(op->opcode);                                    \
+    invalidate(from, from + op->x + 1);                                 \
+    m_cpu.m_PC = next;                                                  \
+  }                                                                     \
+  goto dispatch;
+
+/* 00E0, Cxkk, Dxyn - run the interpreter handler inside the block */
+#define BODY_DELEGATE                                                   \
+  m_cpu.m_PC = op->pc;                                                  \
+  goNext = (m_cpu.*fsm[op->index].worker)(op->opcode);                  \
+  if (m_cpu.m_error != OK)                                              \
+  {                                                                     \
+    if (goNext == 0)                                                    \
+      m_cpu.m_PC += NEXT;                                               \
+    executed -= block->count - (op - block->ops + 1);                   \
+    goto dispatch;                                                      \
+  }
+
+#define BODY_CLS BODY_DELEGATE
+#define BODY_RND BODY_DELEGATE
+#define BODY_DRW BODY_DELEGATE
+
+/* Bnnn, unknown opcodes */
+#define BODY_DELEGATE_EXIT                                              \
+  m_cpu.m_PC = op->pc;                                                  \
+  goNext = (m_cpu.*fsm[op->index].worker)(op->opcode);                  \
+  if (goNext == 0)                                                      \
+    m_cpu.m_PC += NEXT;                                                 \
+  goto dispatch;
+
+#define BODY_JP_REG BODY_DELEGATE_EXIT
+#define BODY_TRAP   BODY_DELEGATE_EXIT
+
+/* Fx0A - suspends the guest until Chip8::releaseKey completes it */
+#define BODY_LD_KEY                                                     \
+  m_cpu.m_PC = op->pc;                                                  \
+  m_cpu.Ld_Key(op->opcode);                                             \
+  return executed;
+
+/* Blocks hold handler addresses of one runProfile instantiation, so they
+   are dropped when the CPU switches profile */
+
+long ThreadedEngine::run(long budget)
+{
+  if (m_cpu.waitingForKey())
+    return 0;
+
+  if (m_cpu.quirkProfile() != m_profile)
+  {
+    flush();
+    m_profile = m_cpu.quirkProfile();
+  }
+
+  switch (m_profile)
+  {
+    case PROFILE_VIP:    return runProfile<QuirksVip>(budget);
+    case PROFILE_CHIP48: return runProfile<QuirksChip48>(budget);
+    case PROFILE_SCHIP:  return runProfile<QuirksSuperChip>(budget);
+    default:             return runProfile<QuirksClassic>(budget);
+  }
+}
+
+template <class Q>
+long ThreadedEngine::runProfile(long budget)
+{
+  static const void* const labels[KINDCOUNT] =
+  {
+    &&op_ret, &&op_jp, &&op_call, &&op_se_const, &&op_sne_const, &&op_se_reg,
+    &&op_ld_const, &&op_add_const, &&op_ld_reg, &&op_or, &&op_and, &&op_xor, &&op_add_reg,
+    &&op_sub, &&op_shr, &&op_subn, &&op_shl, &&op_sne_reg, &&op_ld_i, &&op_skp, &&op_sknp,
+    &&op_ld_reg_dt, &&op_ld_dt, &&op_ld_st, &&op_add_i, &&op_ld_spr, &&op_ld_bcd,
+    &&op_ld_reg_mem, &&op_ld_reg_load, &&op_ld_key, &&op_delegate, &&op_delegate_exit,
+    &&op_exit
+  };
+
+  /* in fusion.def order */
+  static const void* const fused[] =
+  {
+#define FUSE(first, second) &&fuse_##first##_##second,
+#include "fusion.def"
+#undef FUSE
+  };
+
+  const struct Chip8::transaction *fsm = Chip8::Profile<Q>::FSM;
+  uint8_t *V = m_cpu.m_register;
+  long executed = 0;
+  const Block *block;
+  const MicroOp *op;
+  int goNext;
+
+dispatch:
+  /* Fx0A run by the interpreter fallback suspends the guest too */
+  if (executed >= budget || m_cpu.m_error != OK || m_cpu.m_keyWait)
+    return executed;
+
+  block = NULL;
+  if (m_cpu.m_PC + 1 < MEMORYSIZE)
+  {
+    block = m_blocks[m_cpu.m_PC];
+    if (block == NULL)
+      block = translate(m_cpu.m_PC, labels, fused);
+  }
+
+  /* the loop may be longer than the block, so the pattern is checked again */
+  if (block != NULL && block->idle && m_cpu.isIdleLoop(block->start) && m_cpu.idleSpins(block->start))
+  {
+    executed += m_cpu.skipIdle(block->start, budget - executed);
+    goto dispatch;
+  }
+
+  if (block == NULL || block->count > budget - executed)
+  {
+    stepInterpreted();
+    executed++;
+    goto dispatch;
+  }
+
+  executed += block->count;
+  op = block->ops;
+  goto *op->handler;
+
+op_ret:           BODY_RET
+op_jp:            BODY_JP
+op_call:          BODY_CALL
+op_se_const:      BODY_SE_CONST    NEXTOP
+op_sne_const:     BODY_SNE_CONST   NEXTOP
+op_se_reg:        BODY_SE_REG      NEXTOP
+op_sne_reg:       BODY_SNE_REG     NEXTOP
+op_skp:           BODY_SKP         NEXTOP
+op_sknp:          BODY_SKNP        NEXTOP
+op_ld_const:      BODY_LD_CONST    NEXTOP
+op_add_const:     BODY_ADD_CONST   NEXTOP
+op_ld_reg:        BODY_LD_REG      NEXTOP
+op_or:            BODY_OR          NEXTOP
+op_and:           BODY_AND         NEXTOP
+op_xor:           BODY_XOR         NEXTOP
+op_add_reg:       BODY_ADD_REG     NEXTOP
+op_sub:           BODY_SUB         NEXTOP
+op_shr:           BODY_SHR         NEXTOP
+op_subn:          BODY_SUBN        NEXTOP
+op_shl:           BODY_SHL         NEXTOP
+op_ld_i:          BODY_LD_I        NEXTOP
+op_ld_reg_dt:     BODY_LD_REG_DT   NEXTOP
+op_ld_dt:         BODY_LD_DT       NEXTOP
+op_ld_st:         BODY_LD_ST       NEXTOP
+op_add_i:         BODY_ADD_I       NEXTOP
+op_ld_spr:        BODY_LD_SPR      NEXTOP
+op_ld_reg_load:   BODY_LD_REG_LOAD NEXTOP
+op_ld_bcd:        BODY_LD_BCD
+op_ld_reg_mem:    BODY_LD_REG_MEM
+op_ld_key:        BODY_LD_KEY
+op_delegate:      BODY_DELEGATE    NEXTOP
+op_delegate_exit: BODY_DELEGATE_EXIT
+
+/* block ran off its length limit */
+op_exit:
+  m_cpu.m_PC = op->pc;
+  goto dispatch;
+
+/* fused pairs: both bodies back to back, one indirect jump saved */
+#define FUSE(first, second) fuse_##first##_##second: BODY_##first ++op; BODY_##second NEXTOP
+#include "fusion.def"
+#undef FUSE
+}
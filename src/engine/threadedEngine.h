@@ -0,0 +1,95 @@
+#ifndef __THREADEDENGINE__H__
+#define __THREADEDENGINE__H__
+
+#include "engine.h"
+
+#define MAXBLOCKOPS 64
+#define WATCHSHIFT 6
+#define WATCHPAGES (MEMORYSIZE >> WATCHSHIFT)
+
+/* Second execution engine: ROM bytes are predecoded into basic blocks of
+   micro-ops with the operand fields already extracted, and the blocks are
+   run with direct threading (computed goto). Writes to guest memory by
+   Fx33 and Fx55 drop the blocks they overlap, so self-modifying ROMs
+   stay correct. The frequent neighbour pairs listed in fusion.def run as
+   a single micro-op; a skip followed by such a partner does not end its
+   block. A jump into the middle of a pair starts a block of its own.
+   Entering a block that heads a spinning timer wait loop skips the rest
+   of the budget instead. */
+
+class ThreadedEngine : public Engine
+{
+    public :
+
+        ThreadedEngine(Chip8& cpu);
+        virtual ~ThreadedEngine();
+
+        virtual long run(long budget);
+        virtual void flush();
+
+    private :
+
+        struct MicroOp
+        {
+            const void *handler;
+            uint16_t opcode;
+            uint16_t pc;
+            uint16_t nnn;
+            uint8_t x;
+            uint8_t y;
+            uint8_t n;
+            uint8_t kk;
+            uint8_t index;
+        };
+
+        struct Block
+        {
+            uint16_t start;
+            uint16_t end;
+            int count;
+            MicroOp *ops;
+
+            /* starts a timer wait loop, see Chip8::isIdleLoop */
+            bool idle;
+        };
+
+        enum kind
+        {
+            K_RET, K_JP, K_CALL, K_SE_CONST, K_SNE_CONST, K_SE_REG,
+            K_LD_CONST, K_ADD_CONST, K_LD_REG, K_OR, K_AND, K_XOR, K_ADD_REG,
+            K_SUB, K_SHR, K_SUBN, K_SHL, K_SNE_REG, K_LD_I, K_SKP, K_SKNP,
+            K_LD_REG_DT, K_LD_DT, K_LD_ST, K_ADD_I, K_LD_SPR, K_LD_BCD,
+            K_LD_REG_MEM, K_LD_REG_LOAD, K_LD_KEY, K_DELEGATE, K_DELEGATE_EXIT, K_EXIT,
+            KINDCOUNT
+        };
+
+        template <class Q>
+        long runProfile(long budget);
+
+        Block* translate(uint16_t pc, const void* const* labels, const void* const* fused);
+        bool continues(uint16_t pc, uint8_t index, int count) const;
+        void invalidate(int from, int to);
+        void watch(const Block *block);
+        void stepInterpreted();
+
+        static bool endsBlock(command code);
+        static bool buildFusion();
+
+        /* 1 + rank in fusion.def of every fusable pair of FSM indexes */
+        static uint8_t s_fusion[FSMSIZE][FSMSIZE];
+
+        Chip8& m_cpu;
+
+        Block* m_blocks[MEMORYSIZE];
+        uint16_t m_live[MEMORYSIZE];
+        int m_liveCount;
+
+        /* bit p set when a block covers bytes of page p */
+        uint64_t m_watched;
+
+        /* profile the live blocks were translated for */
+        profile m_profile;
+};
+
+#endif
+
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include "batchEnv.h"
+
+BatchEnv::BatchEnv(const char *rom, int count, const char *engineName, int frameSkip,
+                   long instrPerFrame, int threads,
+                   uint64_t seed) : m_status(OK),
+                                    m_count(count),
+                                    m_frameSkip(frameSkip),
+                                    m_instrPerFrame(instrPerFrame),
+                                    m_seed(seed),
+                                    m_pool(threads),
+                                    m_reward(byteDelta),
+                                    m_rewardContext(this),
+                                    m_rewardAddress(0),
+                                    m_actions(NULL),
+                                    m_resetMask(NULL)
+{
+    if (m_count < 0)
+      m_count = 0;
+    if (m_frameSkip <= 0)
+      m_frameSkip = DEFAULTFRAMESKIP;
+
+    m_cpus     = (Chip8**) calloc(m_count, sizeof(Chip8*));
+    m_engines  = (Engine**) calloc(m_count, sizeof(Engine*));
+    m_screens  = (const uint64_t**) calloc(m_count, sizeof(uint64_t*));
+    m_keys     = (uint16_t*) calloc(m_count, sizeof(uint16_t));
+    m_lastByte = (uint8_t*) calloc(m_count, sizeof(uint8_t));
+    m_rewards  = (float*) calloc(m_count, sizeof(float));
+    m_done     = (uint8_t*) calloc(m_count, sizeof(uint8_t));
+    m_episodes = (uint64_t*) calloc(m_count, sizeof(uint64_t));
+
+    if (m_cpus == NULL || m_engines == NULL || m_screens == NULL || m_keys == NULL ||
+        m_lastByte == NULL || m_rewards == NULL || m_done == NULL || m_episodes == NULL ||
+        !m_initial.okConstruct)
+    {
+      m_status = BADALLOC;
+      m_count = 0;
+      return;
+    }
+
+    /* the profile engine counts into process-wide tables, which the
+       pool's workers would race on */
+    if (strcmp(engineName, "profile") == 0)
+    {
+      m_status = BADARGUMENT;
+      m_count = 0;
+      return;
+    }
+
+    m_status = m_initial.loadBinary(rom);
+    if (m_status != OK)
+    {
+      m_count = 0;
+      return;
+    }
+
+    for (int i = 0; i < m_count; i++)
+    {
+      m_cpus[i] = new Chip8();
+      if (!m_cpus[i]->okConstruct)
+      {
+        m_status = BADALLOC;
+        break;
+      }
+
+      m_cpus[i]->copyState(m_initial);
+      seedInstance(i);
+      m_screens[i] = m_cpus[i]->screen();
+      m_lastByte[i] = m_cpus[i]->memory()[m_rewardAddress];
+
+      m_engines[i] = createEngine(engineName, *m_cpus[i]);
+      if (m_engines[i] == NULL)
+      {
+        m_status = BADARGUMENT;
+        break;
+      }
+    }
+}
+
+BatchEnv::~BatchEnv()
+{
+    /* the arrays are calloc'ed, a failed construction leaves NULLs */
+    for (int i = 0; i < m_count; i++)
+    {
+      delete m_engines[i];
+      delete m_cpus[i];
+    }
+
+    free(m_cpus);
+    free(m_engines);
+    free(m_screens);
+    free(m_keys);
+    free(m_lastByte);
+    free(m_rewards);
+    free(m_done);
+    free(m_episodes);
+}
+
+int BatchEnv::status() const
+{
+  return m_status;
+}
+
+int BatchEnv::size() const
+{
+  return m_status == OK ? m_count : 0;
+}
+
+void BatchEnv::setRewardByte(uint16_t address)
+{
+  m_rewardAddress = ADDRESSMASK(address);
+  m_reward = byteDelta;
+  m_rewardContext = this;
+
+  for (int i = 0; i < size(); i++)
+    m_lastByte[i] = m_cpus[i]->memory()[m_rewardAddress];
+}
+
+void BatchEnv::setReward(rewardFunction reward, void *context)
+{
+  m_reward = reward;
+  m_rewardContext = context;
+}
+
+float BatchEnv::byteDelta(int instance, const uint8_t *memory, void *context)
+{
+  BatchEnv *env = (BatchEnv*) context;
+  uint8_t now = memory[env->m_rewardAddress];
+  int8_t change = (int8_t) (now - env->m_lastByte[instance]);
+
+  env->m_lastByte[instance] = now;
+  return change;
+}
+
+/* Runs work for every instance, on the pool's sleeping workers when there
+   is more than one thread */
+
+void BatchEnv::forEach(WorkPool::job work)
+{
+  if (m_pool.threads() > 1)
+    m_pool.run(size(), work, this);
+  else
+    for (int i = 0; i < size(); i++)
+      work(i, this);
+}
+
+/* The copies of m_initial would all draw the same stream */
+
+void BatchEnv::seedInstance(int i)
+{
+  m_cpus[i]->seed(m_seed + i + m_episodes[i] * m_count);
+}
+
+void BatchEnv::resetInstance(int i)
+{
+  m_cpus[i]->copyState(m_initial);
+  m_episodes[i]++;
+  seedInstance(i);
+  m_engines[i]->flush();
+
+  m_keys[i] = 0;
+  m_lastByte[i] = m_cpus[i]->memory()[m_rewardAddress];
+  m_rewards[i] = 0;
+  m_done[i] = 0;
+}
+
+void BatchEnv::resetJob(long index, void *context)
+{
+  BatchEnv *env = (BatchEnv*) context;
+
+  if (env->m_resetMask == NULL || env->m_resetMask[index] != 0)
+    env->resetInstance(index);
+}
+
+void BatchEnv::reset()
+{
+  m_resetMask = NULL;
+  forEach(resetJob);
+}
+
+void BatchEnv::reset(const uint8_t *which)
+{
+  m_resetMask = which;
+  forEach(resetJob);
+}
+
+void BatchEnv::stepInstance(int i)
+{
+  Chip8& cpu = *m_cpus[i];
+
+  m_rewards[i] = 0;
+  if (m_done[i])
+    return;
+
+  /* only the keys whose state changed; holding a key over one step and
+     letting it go at the next answers a pending Fx0A */
+  uint16_t changed = m_actions[i] ^ m_keys[i];
+
+  for (int k = 0; k < KEYCOUNT; k++)
+    if ((changed & m_actions[i]) & (1 << k))
+      cpu.pressKey(k);
+
+  for (int k = 0; k < KEYCOUNT; k++)
+    if ((changed & m_keys[i]) & (1 << k))
+      cpu.releaseKey(k);
+
+  m_keys[i] = m_actions[i];
+
+  for (int f = 0; f < m_frameSkip && cpu.errorCode() == OK; f++)
+  {
+    m_engines[i]->run(m_instrPerFrame);
+    cpu.decreaseTimers();
+  }
+
+  cpu.clearChangedRows();
+
+  m_rewards[i] = m_reward(i, cpu.memory(), m_rewardContext);
+  m_done[i] = cpu.errorCode() != OK;
+}
+
+void BatchEnv::stepJob(long index, void *context)
+{
+  ((BatchEnv*) context)->stepInstance(index);
+}
+
+void BatchEnv::step(const uint16_t *actions)
+{
+  m_actions = actions;
+  forEach(stepJob);
+}
+
+const uint64_t* const* BatchEnv::observations() const
+{
+  return m_screens;
+}
+
+const float* BatchEnv::rewards() const
+{
+  return m_rewards;
+}
+
+const uint8_t* BatchEnv::done() const
+{
+  return m_done;
+}
@@ -0,0 +1,98 @@
+#ifndef __BATCHENV__H__
+#define __BATCHENV__H__
+
+#include "../chip8/chip8.h"
+#include "../engine/engine.h"
+#include "../thread/workPool.h"
+
+#define DEFAULTFRAMESKIP 1
+#define INSTRPERFRAME 10
+
+/* Reward of one instance after a step, from its guest memory */
+typedef float (*rewardFunction)(int instance, const uint8_t *memory, void *context);
+
+/* Reinforcement learning face of count copies of one ROM. step() takes
+   the keys every instance holds, runs frameSkip guest frames on each and
+   leaves a reward and a done flag per instance in arrays owned by the
+   env. Observations are the instances' own framebuffers: the pointers
+   returned by observations() stay valid for the life of the env and the
+   rows behind them change in place, nothing is copied per step.
+   An instance is done once its guest stopped on an error; it steps no
+   more until it is reset.
+   Cxkk of instance i in its episode e, counting the resets, draws from
+   seed + i + e * count: every instance and episode gets a stream of its
+   own, and the same seed replays the same batch. */
+
+class BatchEnv
+{
+    public:
+
+        /* threads as for WorkPool, 1 steps every instance on the caller;
+           the profile engine is refused with BADARGUMENT */
+        BatchEnv(const char *rom, int count, const char *engineName, int frameSkip,
+                 long instrPerFrame, int threads, uint64_t seed);
+        ~BatchEnv();
+
+        /* OK, or the error that stopped the construction */
+        int status() const;
+
+        int size() const;
+
+        /* Reward is the signed change of the byte at address over the
+           step, e.g. a score counter; the default with address 0 */
+        void setRewardByte(uint16_t address);
+        void setReward(rewardFunction reward, void *context);
+
+        /* Puts every instance back to its state right after loading, or
+           only those with a non-zero entry in which, e.g. done(), and
+           starts their next episode */
+        void reset();
+        void reset(const uint8_t *which);
+
+        /* actions[i] bit k set while instance i holds key k */
+        void step(const uint16_t *actions);
+
+        /* WIDTH rows per instance, laid out as Chip8::screen() */
+        const uint64_t* const* observations() const;
+        const float* rewards() const;
+        const uint8_t* done() const;
+
+    private:
+
+        static void stepJob(long index, void *context);
+        static void resetJob(long index, void *context);
+        static float byteDelta(int instance, const uint8_t *memory, void *context);
+
+        void forEach(WorkPool::job work);
+        void stepInstance(int i);
+        void resetInstance(int i);
+        void seedInstance(int i);
+
+        int m_status;
+        int m_count;
+        int m_frameSkip;
+        long m_instrPerFrame;
+        uint64_t m_seed;
+
+        Chip8 m_initial;
+        Chip8 **m_cpus;
+        Engine **m_engines;
+        const uint64_t **m_screens;
+
+        WorkPool m_pool;
+
+        rewardFunction m_reward;
+        void *m_rewardContext;
+        uint16_t m_rewardAddress;
+
+        const uint16_t *m_actions;
+        const uint8_t *m_resetMask;
+
+        uint16_t *m_keys;
+        uint8_t *m_lastByte;
+        float *m_rewards;
+        uint8_t *m_done;
+        uint64_t *m_episodes;
+};
+
+#endif
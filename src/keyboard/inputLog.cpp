@@ -0,0 +1,171 @@
+#include <cstdio>
+#include <stdlib.h>
+#include <string.h>
+#include "inputLog.h"
+
+#define FIRSTCAPACITY 256
+
+InputLog::InputLog() : m_events(NULL),
+                       m_count(0),
+                       m_capacity(0),
+                       m_next(0)
+{
+    memset(&m_header, 0, sizeof(m_header));
+    m_header.magic = INPUTLOGMAGIC;
+    m_header.version = INPUTLOGVERSION;
+}
+
+InputLog::~InputLog()
+{
+    free(m_events);
+}
+
+void InputLog::begin(const Chip8& cpu, uint64_t seed, long ips)
+{
+  m_header.seed = seed;
+  m_header.ips = ips;
+  m_header.profile = cpu.quirkProfile();
+  m_header.start = cpu.checksum();
+  m_header.frames = 0;
+  m_header.final = m_header.start;
+
+  m_count = 0;
+  m_next = 0;
+}
+
+/* false when the event could not be stored; the log is then incomplete */
+
+bool InputLog::record(long frame, uint8_t key, bool pressed)
+{
+  if (m_count == m_capacity)
+  {
+    long capacity = m_capacity > 0 ? 2 * m_capacity : FIRSTCAPACITY;
+    loggedEvent *grown = (loggedEvent*) realloc(m_events, capacity * sizeof(loggedEvent));
+    if (grown == NULL)
+      return false;
+
+    m_events = grown;
+    m_capacity = capacity;
+  }
+
+  loggedEvent& event = m_events[m_count++];
+  event.frame = frame;
+  event.key = key;
+  event.pressed = pressed;
+  event.reserved = 0;
+  return true;
+}
+
+void InputLog::truncate(long frame)
+{
+  while (m_count > 0 && m_events[m_count - 1].frame >= (uint32_t) frame)
+    m_count--;
+}
+
+void InputLog::finish(long frames, const Chip8& cpu)
+{
+  m_header.frames = frames;
+  m_header.final = cpu.checksum();
+}
+
+int InputLog::save(const char *path) const
+{
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return BADOPEN;
+
+  inputLogHeader header = m_header;
+  header.events = m_count;
+
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 (m_count == 0 || fwrite(m_events, sizeof(loggedEvent), m_count, file) == (size_t) m_count);
+  int closed = fclose(file);
+
+  return written && closed == 0 ? OK : BADREAD;
+}
+
+int InputLog::load(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return BADOPEN;
+
+  inputLogHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != INPUTLOGMAGIC ||
+      header.version != INPUTLOGVERSION || header.profile >= PROFILECOUNT)
+  {
+    fclose(file);
+    return BADLOG;
+  }
+
+  loggedEvent *events = (loggedEvent*) malloc((header.events > 0 ? header.events : 1) * sizeof(loggedEvent));
+  if (events == NULL)
+  {
+    fclose(file);
+    return BADALLOC;
+  }
+
+  size_t read = fread(events, sizeof(loggedEvent), header.events, file);
+  fclose(file);
+
+  if (read != header.events)
+  {
+    free(events);
+    return BADLOG;
+  }
+
+  free(m_events);
+  m_events = events;
+  m_count = m_capacity = header.events;
+  m_next = 0;
+  m_header = header;
+  return OK;
+}
+
+int InputLog::prepare(Chip8& cpu)
+{
+  cpu.seed(m_header.seed);
+  cpu.setProfile((profile) m_header.profile);
+  m_next = 0;
+
+  return cpu.checksum() == m_header.start ? OK : BADLOG;
+}
+
+void InputLog::replay(long frame, Chip8& cpu)
+{
+  for (; m_next < m_count && m_events[m_next].frame <= (uint32_t) frame; m_next++)
+  {
+    if (m_events[m_next].key >= KEYCOUNT)
+      continue;
+
+    if (m_events[m_next].pressed)
+      cpu.pressKey(m_events[m_next].key);
+    else
+      cpu.releaseKey(m_events[m_next].key);
+  }
+}
+
+uint64_t InputLog::seed() const
+{
+  return m_header.seed;
+}
+
+long InputLog::ips() const
+{
+  return m_header.ips;
+}
+
+long InputLog::frames() const
+{
+  return m_header.frames;
+}
+
+long InputLog::events() const
+{
+  return m_count;
+}
+
+uint64_t InputLog::finalChecksum() const
+{
+  return m_header.final;
+}
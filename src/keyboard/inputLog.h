@@ -0,0 +1,91 @@
+#ifndef __INPUTLOG__H__
+#define __INPUTLOG__H__
+
+#include <stdint.h>
+#include "../chip8/chip8.h"
+
+#define INPUTLOGMAGIC 0x4C493843u   /* "C8IL" */
+#define INPUTLOGVERSION 1
+
+/* An input log file is this header followed by the events in order, in
+   host byte order. A machine seeded with seed, running ips instructions
+   per second with the profile, whose checksum is start, reaches final
+   after frames guest frames when it gets the events. */
+
+struct inputLogHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seed;
+    uint32_t ips;
+    uint32_t profile;
+    uint32_t events;
+    uint32_t frames;
+    uint64_t start;
+    uint64_t final;
+};
+
+/* A key event applied before guest frame number frame runs */
+struct loggedEvent
+{
+    uint32_t frame;
+    uint8_t key;
+    uint8_t pressed;
+    uint16_t reserved;
+};
+
+/* Key presses and releases of a session by guest frame number. Since the
+   machine is deterministic once its Cxkk generator is seeded, and guest
+   frame n always gets the same instruction budget, the events alone
+   replay the session bit-exactly, at any speed and with any engine. */
+
+class InputLog
+{
+    public:
+
+        InputLog();
+        ~InputLog();
+
+        /* Starts a recording of cpu, which must be seeded with seed and
+           have its ROM loaded */
+        void begin(const Chip8& cpu, uint64_t seed, long ips);
+
+        /* Events applied before frame runs */
+        bool record(long frame, uint8_t key, bool pressed);
+
+        /* Forgets the events of frame and later ones, after the machine
+           was rewound to the start of frame */
+        void truncate(long frame);
+
+        /* Ends the recording with the state cpu reached after frames */
+        void finish(long frames, const Chip8& cpu);
+
+        int save(const char *path) const;
+        int load(const char *path);
+
+        /* Puts cpu where the recording started: seed and profile; BADLOG
+           when its checksum is not the recorded one, e.g. another ROM */
+        int prepare(Chip8& cpu);
+
+        /* Applies to cpu the events up to frame not replayed yet */
+        void replay(long frame, Chip8& cpu);
+
+        uint64_t seed() const;
+        long ips() const;
+        long frames() const;
+        long events() const;
+
+        /* Checksum the machine must have once frames ran */
+        uint64_t finalChecksum() const;
+
+    private:
+
+        inputLogHeader m_header;
+
+        loggedEvent *m_events;
+        long m_count;
+        long m_capacity;
+        long m_next;
+};
+
+#endif
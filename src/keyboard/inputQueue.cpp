@@ -0,0 +1,57 @@
+#include "inputQueue.h"
+
+InputQueue::InputQueue() : m_head(0), m_tail(0), m_interrupted(false)
+{
+}
+
+bool InputQueue::push(uint8_t key, bool pressed)
+{
+  unsigned tail = m_tail.load(std::memory_order_relaxed);
+
+  if (tail - m_head.load(std::memory_order_acquire) == INPUTQUEUESIZE)
+    return false;
+
+  m_events[tail % INPUTQUEUESIZE].key = key;
+  m_events[tail % INPUTQUEUESIZE].pressed = pressed;
+
+  m_tail.store(tail + 1, std::memory_order_release);
+
+  /* taking the lock orders the store before a sleeping consumer's check */
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+  }
+  m_signal.notify_one();
+
+  return true;
+}
+
+bool InputQueue::pop(keyEvent *event)
+{
+  unsigned head = m_head.load(std::memory_order_relaxed);
+
+  if (head == m_tail.load(std::memory_order_acquire))
+    return false;
+
+  *event = m_events[head % INPUTQUEUESIZE];
+
+  m_head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+void InputQueue::waitEvent()
+{
+  std::unique_lock<std::mutex> guard(m_lock);
+
+  while (!m_interrupted &&
+         m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_acquire))
+    m_signal.wait(guard);
+}
+
+void InputQueue::interrupt()
+{
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_interrupted = true;
+  }
+  m_signal.notify_all();
+}
@@ -0,0 +1,54 @@
+#ifndef __INPUTQUEUE__H__
+#define __INPUTQUEUE__H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include "keyboard.h"
+
+#define INPUTQUEUESIZE 64
+
+/* Keys past the keypad are emulator controls, not guest input */
+#define REWINDKEY KEYCOUNT
+
+struct keyEvent
+{
+    uint8_t key;
+    bool pressed;
+};
+
+/* Single producer, single consumer ring of key events: the UI thread
+   pushes what the window reports, the emulation thread pops them between
+   two slices of guest instructions. Events are kept in order, so a press
+   and release inside one slice both reach the guest. The consumer can
+   also sleep until an event arrives, which is how a guest blocked on
+   Fx0A stops costing host time. */
+
+class InputQueue
+{
+    public:
+
+        InputQueue();
+
+        /* false when the queue is full and the event was dropped */
+        bool push(uint8_t key, bool pressed);
+        bool pop(keyEvent *event);
+
+        /* Blocks until the queue is not empty or interrupt() is called */
+        void waitEvent();
+        void interrupt();
+
+    private:
+
+        keyEvent m_events[INPUTQUEUESIZE];
+
+        std::atomic<unsigned> m_head;
+        std::atomic<unsigned> m_tail;
+
+        std::mutex m_lock;
+        std::condition_variable m_signal;
+        bool m_interrupted;
+};
+
+#endif
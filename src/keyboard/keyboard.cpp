@@ -2,25 +2,27 @@
 
 #include "keyboard.h"
 
-Chip8Keyboard::Chip8Keyboard()
-{
-    for(int i = 0; i < 16; i++)
-        m_key[i] = false;
-}
-
 void Chip8Keyboard::pressKey(uint8_t keyNumber)
 {
-    m_key[keyNumber] = true;
+    m_key[keyNumber & (KEYCOUNT - 1)] = true;
 }
 
 bool Chip8Keyboard::isKeyPressed(uint8_t keyNumber)
 {
-    return m_key[keyNumber];
+    return m_key[keyNumber & (KEYCOUNT - 1)];
 }
 
 void Chip8Keyboard::releaseKey(uint8_t keyNumber)
 {
-    m_key[keyNumber] = false;
+    m_key[keyNumber & (KEYCOUNT - 1)] = false;
+}
+
+void Chip8Keyboard::normalise()
+{
+    uint8_t *bytes = (uint8_t*) m_key;
+
+    for (int i = 0; i < KEYCOUNT; i++)
+      bytes[i] = bytes[i] != 0;
 }
 
 
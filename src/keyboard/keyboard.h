@@ -7,15 +7,23 @@
 #include <stdint.h>
 
 #define KEYCOUNT 16
+
+/* Key numbers are taken modulo KEYCOUNT: Ex9E and ExA1 pass any Vx.
+   No constructor: the keys live in Chip8State, which Chip8::reset()
+   clears as a whole. */
+
 class Chip8Keyboard
 {
     public:
-        Chip8Keyboard();
         void pressKey(uint8_t keyNumber);
         void releaseKey(uint8_t keyNumber);
         bool isKeyPressed(uint8_t keyNumber);
         int isAnyKeyPressed();
 
+        /* Makes every key exactly pressed or released again after its
+           bytes were copied in from outside, e.g. a save state */
+        void normalise();
+
     private:
         bool m_key[KEYCOUNT];
 };
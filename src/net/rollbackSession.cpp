@@ -0,0 +1,339 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <climits>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "rollbackSession.h"
+
+#define NOFRAME LONG_MAX
+
+RollbackSession::RollbackSession(Chip8& cpu, Engine& engine, long ips) : m_cpu(cpu),
+                                                                         m_engine(engine),
+                                                                         m_pacing(ips),
+                                                                         m_socket(-1),
+                                                                         m_session(cpu.checksum()),
+                                                                         m_frame(0),
+                                                                         m_mispredicted(NOFRAME),
+                                                                         m_remoteFrame(-1),
+                                                                         m_acked(-1),
+                                                                         m_confirmed(-1),
+                                                                         m_peerChecked(-1),
+                                                                         m_rollbacks(0),
+                                                                         m_resimulated(0),
+                                                                         m_stalls(0),
+                                                                         m_desyncs(0),
+                                                                         m_foreign(0),
+                                                                         m_snapshotCount(0),
+                                                                         m_snapshotTime(0),
+                                                                         m_restoreCount(0),
+                                                                         m_restoreTime(0)
+{
+    memset(&m_peer, 0, sizeof(m_peer));
+    memset(m_local, 0, sizeof(m_local));
+    memset(m_remote, 0, sizeof(m_remote));
+    memset(m_guessed, 0, sizeof(m_guessed));
+    memset(m_checksums, 0, sizeof(m_checksums));
+
+    m_snapshots = new Chip8[NETRING];
+}
+
+RollbackSession::~RollbackSession()
+{
+    if (m_socket >= 0)
+      close(m_socket);
+
+    delete[] m_snapshots;
+}
+
+int RollbackSession::connect(int localPort, const char *peer)
+{
+  const char *colon = strrchr(peer, ':');
+  if (colon == NULL || colon == peer)
+    return BADARGUMENT;
+
+  char host[256];
+  size_t length = colon - peer;
+  if (length >= sizeof(host))
+    return BADARGUMENT;
+
+  memcpy(host, peer, length);
+  host[length] = '\0';
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  addrinfo *found = NULL;
+  if (getaddrinfo(host, colon + 1, &hints, &found) != 0 || found == NULL)
+    return BADARGUMENT;
+
+  memcpy(&m_peer, found->ai_addr, sizeof(m_peer));
+  freeaddrinfo(found);
+
+  m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (m_socket < 0)
+    return BADOPEN;
+
+  sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(localPort);
+
+  if (bind(m_socket, (const sockaddr*) &local, sizeof(local)) != 0 ||
+      fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL) | O_NONBLOCK) != 0)
+  {
+    close(m_socket);
+    m_socket = -1;
+    return BADOPEN;
+  }
+
+  return OK;
+}
+
+/* The peer's keys for frame, or the guess: the last keys it sent */
+
+uint16_t RollbackSession::remoteKeys(long frame) const
+{
+  if (frame <= m_remoteFrame)
+    return m_remote[frame % NETRING];
+
+  return m_remoteFrame >= 0 ? m_remote[m_remoteFrame % NETRING] : 0;
+}
+
+/* Snapshots the machine, then runs frame with both sides' keys: presses
+   first, then releases, as the batch environment does */
+
+bool RollbackSession::runFrame(long frame)
+{
+  int slot = frame % NETRING;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  m_snapshots[slot].copyState(m_cpu);
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  m_snapshotTime += elapsed.count();
+  m_snapshotCount++;
+
+  m_guessed[slot] = remoteKeys(frame);
+  uint16_t keys = m_local[slot] | m_guessed[slot];
+
+  for (int k = 0; k < KEYCOUNT; k++)
+    if ((keys & (1 << k)) && !m_cpu.keyboard.isKeyPressed(k))
+      m_cpu.pressKey(k);
+
+  for (int k = 0; k < KEYCOUNT; k++)
+    if (!(keys & (1 << k)) && m_cpu.keyboard.isKeyPressed(k))
+      m_cpu.releaseKey(k);
+
+  long budget = m_pacing.frameBudget(frame);
+  long executed = 0;
+
+  while (executed < budget)
+  {
+    long ran = m_engine.run(budget - executed);
+    if (m_cpu.errorCode() != OK)
+      return false;
+    if (ran <= 0)
+      break;
+    executed += ran;
+  }
+
+  m_cpu.decreaseTimers();
+
+  if (frame <= m_remoteFrame)
+  {
+    m_checksums[slot] = m_cpu.checksum();
+    m_confirmed = frame;
+  }
+
+  return true;
+}
+
+/* Back to the machine before frame from, then forward again to the
+   present with the keys known now */
+
+void RollbackSession::rollback(long from)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  m_cpu.copyState(m_snapshots[from % NETRING]);
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  m_restoreTime += elapsed.count();
+  m_restoreCount++;
+
+  /* translations may be of the memory that was just replaced */
+  m_engine.flush();
+
+  m_rollbacks++;
+  m_resimulated += m_frame - from;
+}
+
+void RollbackSession::receive()
+{
+  netPacket packet;
+  ssize_t size;
+
+  while ((size = recv(m_socket, &packet, sizeof(packet), 0)) >= 0)
+  {
+    if ((size_t) size < offsetof(netPacket, keys) || packet.magic != NETMAGIC ||
+        packet.count > NETRING || (size_t) size < offsetof(netPacket, keys) + packet.count * sizeof(uint16_t))
+      continue;
+
+    if (packet.session != m_session)
+    {
+      m_foreign++;
+      continue;
+    }
+
+    if (packet.ack > m_acked)
+      m_acked = packet.ack;
+
+    /* keys in order only, and not so far ahead that they would overwrite
+       the ones a rollback still reads */
+    for (int i = 0; i < packet.count; i++)
+    {
+      long frame = (long) packet.first + i;
+
+      if (frame != m_remoteFrame + 1 || frame >= m_frame + NETRING - MAXROLLBACK - 1)
+        continue;
+
+      m_remote[frame % NETRING] = packet.keys[i];
+      m_remoteFrame = frame;
+
+      if (frame < m_frame && m_guessed[frame % NETRING] != packet.keys[i] && frame < m_mispredicted)
+        m_mispredicted = frame;
+    }
+
+    if (packet.checked > m_peerChecked && packet.checked <= m_confirmed &&
+        packet.checked > m_confirmed - NETRING)
+    {
+      if (m_checksums[packet.checked % NETRING] != packet.checksum)
+        m_desyncs++;
+      m_peerChecked = packet.checked;
+    }
+  }
+}
+
+void RollbackSession::send()
+{
+  netPacket packet;
+
+  packet.magic = NETMAGIC;
+  packet.first = m_acked + 1;
+  packet.ack = m_remoteFrame;
+  packet.checked = m_confirmed;
+  packet.checksum = m_confirmed >= 0 ? m_checksums[m_confirmed % NETRING] : 0;
+  packet.session = m_session;
+
+  long count = m_frame - packet.first;
+  packet.count = count < 0 ? 0 : count > NETRING ? NETRING : count;
+
+  for (int i = 0; i < packet.count; i++)
+    packet.keys[i] = m_local[(packet.first + i) % NETRING];
+
+  sendto(m_socket, &packet, offsetof(netPacket, keys) + packet.count * sizeof(uint16_t), 0,
+         (const sockaddr*) &m_peer, sizeof(m_peer));
+}
+
+bool RollbackSession::poll()
+{
+  receive();
+
+  if (m_mispredicted < m_frame)
+  {
+    long from = m_mispredicted;
+
+    rollback(from);
+    m_mispredicted = NOFRAME;
+
+    for (long frame = from; frame < m_frame; frame++)
+      if (!runFrame(frame))
+        return false;
+  }
+
+  /* frames whose guess was right are confirmed without running again:
+     the state after one is the snapshot of the next */
+  for (long frame = m_confirmed + 1; frame <= m_remoteFrame && frame < m_frame; frame++)
+  {
+    const Chip8& after = frame + 1 < m_frame ? m_snapshots[(frame + 1) % NETRING] : m_cpu;
+
+    m_checksums[frame % NETRING] = after.checksum();
+    m_confirmed = frame;
+  }
+
+  send();
+  return true;
+}
+
+bool RollbackSession::advance(uint16_t keys)
+{
+  if (!poll())
+    return false;
+
+  /* the peer's keys must come before a rollback could not reach back to
+     them, and ours must be acknowledged before the ring forgets them */
+  if (m_frame - m_remoteFrame > MAXROLLBACK || m_frame - m_acked >= NETRING)
+  {
+    m_stalls++;
+    return true;
+  }
+
+  m_local[m_frame % NETRING] = keys;
+
+  if (!runFrame(m_frame))
+    return false;
+  m_frame++;
+
+  send();
+  return true;
+}
+
+long RollbackSession::frame() const
+{
+  return m_frame;
+}
+
+long RollbackSession::confirmedFrame() const
+{
+  return m_confirmed;
+}
+
+long RollbackSession::rollbacks() const
+{
+  return m_rollbacks;
+}
+
+long RollbackSession::resimulatedFrames() const
+{
+  return m_resimulated;
+}
+
+long RollbackSession::stalls() const
+{
+  return m_stalls;
+}
+
+long RollbackSession::desyncs() const
+{
+  return m_desyncs;
+}
+
+long RollbackSession::foreignPackets() const
+{
+  return m_foreign;
+}
+
+double RollbackSession::averageSnapshotTime() const
+{
+  return m_snapshotCount > 0 ? m_snapshotTime / m_snapshotCount : 0.0;
+}
+
+double RollbackSession::averageRestoreTime() const
+{
+  return m_restoreCount > 0 ? m_restoreTime / m_restoreCount : 0.0;
+}
@@ -0,0 +1,127 @@
+#ifndef __ROLLBACKSESSION__H__
+#define __ROLLBACKSESSION__H__
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include "../engine/engine.h"
+#include "../thread/scheduler.h"
+
+#define NETMAGIC 0x504E3843u        /* "C8NP" */
+#define NETRING 32
+#define MAXROLLBACK 8
+
+/* One datagram: the sender's keys for frames first to first + count - 1,
+   every one the peer has not acknowledged yet, so a lost packet is made
+   up by the next one. ack is the newest frame of the receiver's keys the
+   sender holds with all the frames before it. checked is a frame the
+   sender simulated with both sides' real keys and checksum the state it
+   left, for the peer to detect a desync. session is the checksum of the
+   machine both sides start from. Fields are in host byte order, like the
+   save states. */
+
+struct netPacket
+{
+    uint32_t magic;
+    int32_t first;
+    int32_t ack;
+    int32_t checked;
+    uint64_t checksum;
+    uint64_t session;
+    uint16_t count;
+    uint16_t keys[NETRING];
+};
+
+/* Two-player session over UDP with rollback: both peers run the same
+   machine, seeded alike, and the guest sees the keys of both sides ORed
+   together. Every frame runs at once with the local keys and a guess for
+   the remote ones, the last keys the peer sent; the state before each
+   frame is kept in a ring of snapshots. When the peer's keys for a frame
+   turn out to differ from the guess, the machine goes back to the
+   snapshot of that frame and runs again up to the present with the real
+   keys, within the same tick. A peer more than MAXROLLBACK frames behind
+   makes the other wait for it.
+   Snapshots are Chip8::copyState, a copy of the state block. */
+
+class RollbackSession
+{
+    public:
+
+        /* cpu must be loaded and seeded the same way on both peers */
+        RollbackSession(Chip8& cpu, Engine& engine, long ips);
+        ~RollbackSession();
+
+        /* Binds localPort and sends to peer, "host:port"; OK, BADOPEN or
+           BADARGUMENT */
+        int connect(int localPort, const char *peer);
+
+        /* Reads what the peer sent, rolls back if a guess was wrong and
+           sends the local keys; false when the guest stopped on an error */
+        bool poll();
+
+        /* poll(), then runs the next frame with keys held locally unless
+           the peer is too far behind. Returns false when the guest
+           stopped on an error. */
+        bool advance(uint16_t keys);
+
+        /* Frames run, and the newest one run with both sides' real keys */
+        long frame() const;
+        long confirmedFrame() const;
+
+        /* Statistics */
+        long rollbacks() const;
+        long resimulatedFrames() const;
+        long stalls() const;
+        long desyncs() const;
+        long foreignPackets() const;
+        double averageSnapshotTime() const;
+        double averageRestoreTime() const;
+
+    private:
+
+        bool runFrame(long frame);
+        void rollback(long from);
+        void receive();
+        void send();
+        uint16_t remoteKeys(long frame) const;
+
+        Chip8& m_cpu;
+        Engine& m_engine;
+        Scheduler m_pacing;
+
+        int m_socket;
+        sockaddr_in m_peer;
+        uint64_t m_session;
+
+        /* frames run, and the first one run with a wrong guess */
+        long m_frame;
+        long m_mispredicted;
+
+        /* newest frame with the remote keys of it and all earlier frames,
+           and the newest of ours the peer acknowledged */
+        long m_remoteFrame;
+        long m_acked;
+        long m_confirmed;
+
+        /* newest frame of the peer whose checksum was compared */
+        long m_peerChecked;
+
+        uint16_t m_local[NETRING];
+        uint16_t m_remote[NETRING];
+        uint16_t m_guessed[NETRING];
+        uint64_t m_checksums[NETRING];
+
+        /* machine before each of the last NETRING frames */
+        Chip8 *m_snapshots;
+
+        long m_rollbacks;
+        long m_resimulated;
+        long m_stalls;
+        long m_desyncs;
+        long m_foreign;
+        long m_snapshotCount;
+        double m_snapshotTime;
+        long m_restoreCount;
+        double m_restoreTime;
+};
+
+#endif
@@ -0,0 +1,49 @@
+#include "frameDelta.h"
+
+size_t encodeDelta(const uint64_t *screen, uint32_t rows, uint8_t *out)
+{
+  for (int i = 0; i < DELTAHEADER; i++)
+    out[i] = (rows >> (BYTESIZE * i)) & 0xFF;
+
+  uint8_t *cursor = out + DELTAHEADER;
+
+  while (rows != 0)
+  {
+    int y = __builtin_ctz(rows);
+    rows &= rows - 1;
+
+    uint64_t row = screen[y];
+    for (int i = 0; i < (int) sizeof(uint64_t); i++)
+      *cursor++ = (row >> (HEIGHT - BYTESIZE * (i + 1))) & 0xFF;
+  }
+
+  return cursor - out;
+}
+
+bool applyDelta(uint64_t *screen, const uint8_t *delta, size_t size)
+{
+  if (size < DELTAHEADER)
+    return false;
+
+  uint32_t rows = 0;
+  for (int i = 0; i < DELTAHEADER; i++)
+    rows |= (uint32_t) delta[i] << (BYTESIZE * i);
+
+  if (size != DELTAHEADER + (size_t) __builtin_popcount(rows) * sizeof(uint64_t))
+    return false;
+
+  const uint8_t *cursor = delta + DELTAHEADER;
+
+  while (rows != 0)
+  {
+    int y = __builtin_ctz(rows);
+    rows &= rows - 1;
+
+    uint64_t row = 0;
+    for (int i = 0; i < (int) sizeof(uint64_t); i++)
+      row = (row << BYTESIZE) | *cursor++;
+    screen[y] = row;
+  }
+
+  return true;
+}
@@ -0,0 +1,28 @@
+#ifndef __FRAMEDELTA__H__
+#define __FRAMEDELTA__H__
+
+#include <cstddef>
+#include <stdint.h>
+#include "../chip8/chip8.h"
+
+/* Compact encoding of the rows that changed between two frames, for
+   recorders and remote viewers:
+
+     4 bytes     row mask, little endian, bit y for row y
+     8 bytes     per set bit in ascending row order, the row big endian
+                 so the leftmost pixel is the top bit of the first byte
+
+   An empty delta is the 4-byte zero mask. */
+
+#define DELTAHEADER 4
+#define DELTAMAXSIZE (DELTAHEADER + ROWBYTES)
+
+/* Writes the rows of screen selected by rows into out, which must hold
+   DELTAMAXSIZE bytes; returns the encoded size */
+size_t encodeDelta(const uint64_t *screen, uint32_t rows, uint8_t *out);
+
+/* Copies the rows of a delta into screen; false if size does not match
+   the mask */
+bool applyDelta(uint64_t *screen, const uint8_t *delta, size_t size);
+
+#endif
@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstring>
+#include "renderer.h"
+
+Renderer::Renderer(int scale, const palette& colors) : m_scale(scale),
+                                                       m_frames(0),
+                                                       m_totalTime(0),
+                                                       m_worstTime(0)
+{
+    memcpy(&m_colors[0], colors.off, sizeof(m_colors[0]));
+    memcpy(&m_colors[1], colors.on, sizeof(m_colors[1]));
+
+    /* a blank display until the first frame differs from it */
+    for (int i = 0; i < SCREENSIZE; i++)
+      m_pixels[i] = m_colors[0];
+    memset(m_shown, 0, sizeof(m_shown));
+
+    okConstruct = m_texture.create(HEIGHT, WIDTH);
+
+    m_sprite.setTexture(m_texture);
+    m_sprite.setScale(scale, scale);
+}
+
+void Renderer::present(sf::RenderWindow& window, const uint64_t *screen)
+{
+  m_clock.restart();
+
+  /* only the rows that differ from the frame shown last are expanded */
+  for (int y = 0; y < WIDTH; y++)
+  {
+    uint64_t row = screen[y];
+    if (row == m_shown[y])
+      continue;
+
+    uint32_t *out = m_pixels + y * HEIGHT;
+    for (int x = HEIGHT - 1; x >= 0; x--)
+      *out++ = m_colors[(row >> x) & 1];
+
+    m_shown[y] = row;
+  }
+
+  m_texture.update((const sf::Uint8*) m_pixels);
+  window.draw(m_sprite);
+  window.display();
+
+  long elapsed = m_clock.getElapsedTime().asMicroseconds();
+
+  m_frames++;
+  m_totalTime += elapsed;
+  if (elapsed > m_worstTime)
+    m_worstTime = elapsed;
+}
+
+int Renderer::scale() const
+{
+  return m_scale;
+}
+
+long Renderer::frames() const
+{
+  return m_frames;
+}
+
+double Renderer::averageFrameTime() const
+{
+  return m_frames > 0 ? (double) m_totalTime / m_frames : 0.0;
+}
+
+long Renderer::worstFrameTime() const
+{
+  return m_worstTime;
+}
+
+palette Renderer::defaultPalette()
+{
+  palette colors = { {40, 40, 40, 255}, {169, 169, 169, 255} };
+  return colors;
+}
+
+bool Renderer::parsePalette(const char *text, palette *colors)
+{
+  unsigned int on = 0;
+  unsigned int off = 0;
+  char tail;
+
+  if (sscanf(text, "%6x,%6x%c", &on, &off, &tail) != 2)
+    return false;
+
+  for (int i = 0; i < 3; i++)
+  {
+    colors->on[i]  = (on >> (16 - 8 * i)) & 0xFF;
+    colors->off[i] = (off >> (16 - 8 * i)) & 0xFF;
+  }
+  colors->on[3]  = 255;
+  colors->off[3] = 255;
+
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef __RENDERER__H__
+#define __RENDERER__H__
+
+#include <SFML/Graphics.hpp>
+#include "../chip8/chip8.h"
+
+#define DEFAULTSCALE 10
+
+/* RGBA colours of lit and dark pixels */
+struct palette
+{
+    uint8_t on[4];
+    uint8_t off[4];
+};
+
+/* Draws the Chip8 display as one scaled sprite: the rows that changed
+   since the last frame are expanded into a HEIGHT x WIDTH RGBA buffer and
+   the buffer is uploaded with one texture update per frame. */
+
+class Renderer
+{
+    public :
+
+        Renderer(int scale, const palette& colors);
+
+        bool okConstruct;
+
+        /* Uploads and shows WIDTH packed rows laid out as Chip8::screen() */
+        void present(sf::RenderWindow& window, const uint64_t *screen);
+
+        int scale() const;
+
+        /* Frame-time counter, in microseconds of present() */
+        long frames() const;
+        double averageFrameTime() const;
+        long worstFrameTime() const;
+
+        /* "RRGGBB,RRGGBB" (lit, dark); false if malformed */
+        static bool parsePalette(const char *text, palette *colors);
+        static palette defaultPalette();
+
+    private :
+
+        int m_scale;
+        uint32_t m_colors[2];
+        uint32_t m_pixels[SCREENSIZE];
+        uint64_t m_shown[WIDTH];
+
+        sf::Texture m_texture;
+        sf::Sprite m_sprite;
+        sf::Clock m_clock;
+
+        long m_frames;
+        long m_totalTime;
+        long m_worstTime;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+#include "stateSearch.h"
+
+/* count state blocks starting on a cache line; NULL when out of memory */
+
+static uint8_t* allocBlocks(long count)
+{
+  void *blocks;
+
+  if (posix_memalign(&blocks, CACHELINE, count * Chip8::stateBlockSize()) != 0)
+    return NULL;
+  return (uint8_t*) blocks;
+}
+
+StateSearch::StateSearch(const char *rom, const char *engineName, int holdFrames,
+                         long instrPerFrame, long maxStates,
+                         int threads) : m_status(OK),
+                                        m_holdFrames(holdFrames),
+                                        m_instrPerFrame(instrPerFrame),
+                                        m_maxStates(maxStates),
+                                        m_pool(threads),
+                                        m_seen(maxStates),
+                                        m_frontier(NULL),
+                                        m_frontierCount(0),
+                                        m_cursor(0),
+                                        m_next(NULL),
+                                        m_nextCapacity(0),
+                                        m_nextCount(0),
+                                        m_depth(0),
+                                        m_hasGoal(false),
+                                        m_goalAddress(0),
+                                        m_goalValue(0),
+                                        m_goal(-1),
+                                        m_truncated(false)
+{
+    if (m_holdFrames <= 0)
+      m_holdFrames = DEFAULTHOLDFRAMES;
+    if (m_maxStates <= 0)
+      m_maxStates = DEFAULTMAXSTATES;
+
+    memset(m_parents, 0, sizeof(m_parents));
+    memset(m_actions, 0, sizeof(m_actions));
+
+    m_threads = m_pool.threads();
+    m_cpus    = (Chip8**) calloc(m_threads, sizeof(Chip8*));
+    m_engines = (Engine**) calloc(m_threads, sizeof(Engine*));
+
+    if (m_cpus == NULL || m_engines == NULL || !m_seen.okConstruct)
+    {
+      m_status = BADALLOC;
+      m_threads = 0;
+      return;
+    }
+
+    for (int i = 0; i < m_threads; i++)
+    {
+      m_cpus[i] = new Chip8();
+      if (m_cpus[i] == NULL || !m_cpus[i]->okConstruct)
+      {
+        m_status = BADALLOC;
+        return;
+      }
+
+      m_engines[i] = createEngine(engineName, *m_cpus[i]);
+      if (m_engines[i] == NULL)
+      {
+        m_status = BADARGUMENT;
+        return;
+      }
+    }
+
+    /* the first worker's machine loads the ROM, the others only ever
+       take states over */
+    m_status = m_cpus[0]->loadBinary(rom);
+    if (m_status != OK)
+      return;
+    m_cpus[0]->seed(0);
+
+    m_frontier = allocBlocks(1);
+    if (m_frontier == NULL)
+    {
+      m_status = BADALLOC;
+      return;
+    }
+
+    m_cpus[0]->copyStateTo(m_frontier);
+    m_seen.insert(m_cpus[0]->checksum());
+    m_frontierCount = 1;
+}
+
+StateSearch::~StateSearch()
+{
+    /* the arrays are calloc'ed, a failed construction leaves NULLs */
+    for (int i = 0; i < m_threads; i++)
+    {
+      delete m_engines[i];
+      delete m_cpus[i];
+    }
+
+    for (int d = 0; d < MAXSEARCHDEPTH; d++)
+    {
+      free(m_parents[d]);
+      free(m_actions[d]);
+    }
+
+    free(m_cpus);
+    free(m_engines);
+    free(m_frontier);
+    free(m_next);
+}
+
+int StateSearch::status() const
+{
+  return m_status;
+}
+
+void StateSearch::setGoal(uint16_t address, uint8_t value)
+{
+  m_hasGoal = true;
+  m_goalAddress = ADDRESSMASK(address);
+  m_goalValue = value;
+}
+
+/* Forks the state the worker's machine holds into the outcome of action:
+   key down for holdFrames frames, up for as many; false when the guest
+   stopped on an error */
+
+bool StateSearch::play(Chip8& cpu, Engine& engine, int action)
+{
+  for (int phase = 0; phase < 2; phase++)
+  {
+    if (action != NOKEY)
+    {
+      if (phase == 0)
+        cpu.pressKey(action);
+      else
+        cpu.releaseKey(action);
+    }
+
+    for (int f = 0; f < m_holdFrames && cpu.errorCode() == OK; f++)
+    {
+      engine.run(m_instrPerFrame);
+      cpu.decreaseTimers();
+    }
+  }
+
+  return cpu.errorCode() == OK;
+}
+
+void StateSearch::expandWith(int worker)
+{
+  Chip8& cpu = *m_cpus[worker];
+  Engine& engine = *m_engines[worker];
+  size_t blockSize = Chip8::stateBlockSize();
+  long parent;
+
+  while (m_goal < 0 && (parent = m_cursor.fetch_add(1)) < m_frontierCount)
+  {
+    const uint8_t *from = m_frontier + parent * blockSize;
+
+    for (int action = 0; action < SEARCHACTIONS; action++)
+    {
+      cpu.copyStateFrom(from);
+      /* translations may be of another state's memory */
+      engine.flush();
+
+      if (!play(cpu, engine, action) || !m_seen.insert(cpu.checksum()))
+        continue;
+
+      long slot = m_nextCount.fetch_add(1);
+      if (slot >= m_nextCapacity)
+      {
+        m_truncated = true;
+        continue;
+      }
+
+      cpu.copyStateTo(m_next + slot * blockSize);
+      m_parents[m_depth][slot] = parent;
+      m_actions[m_depth][slot] = action;
+
+      long none = -1;
+      if (m_hasGoal && cpu.memory()[m_goalAddress] == m_goalValue)
+        m_goal.compare_exchange_strong(none, slot);
+    }
+  }
+}
+
+void StateSearch::workerJob(long index, void *context)
+{
+  ((StateSearch*) context)->expandWith(index);
+}
+
+bool StateSearch::expand()
+{
+  if (m_status != OK || m_goal >= 0 || m_frontierCount == 0 || m_depth >= MAXSEARCHDEPTH)
+    return false;
+
+  /* every state of the frontier may lead to SEARCHACTIONS new ones */
+  long room = m_maxStates - m_seen.size();
+  m_nextCapacity = m_frontierCount * SEARCHACTIONS;
+  if (m_nextCapacity > room)
+    m_nextCapacity = room;
+  if (m_nextCapacity <= 0)
+  {
+    m_truncated = true;
+    return false;
+  }
+
+  m_next = allocBlocks(m_nextCapacity);
+  m_parents[m_depth] = (uint32_t*) malloc(m_nextCapacity * sizeof(uint32_t));
+  m_actions[m_depth] = (uint8_t*) malloc(m_nextCapacity * sizeof(uint8_t));
+
+  if (m_next == NULL || m_parents[m_depth] == NULL || m_actions[m_depth] == NULL)
+  {
+    m_status = BADALLOC;
+    return false;
+  }
+
+  m_cursor = 0;
+  m_nextCount = 0;
+
+  /* the pool wakes its workers, each of them pulls frontier states until
+     none are left */
+  if (m_threads > 1)
+    m_pool.run(m_threads, workerJob, this);
+  else
+    expandWith(0);
+
+  free(m_frontier);
+  m_frontier = m_next;
+  m_next = NULL;
+
+  m_frontierCount = m_nextCount < m_nextCapacity ? (long) m_nextCount : m_nextCapacity;
+  m_depth++;
+
+  if (m_seen.full())
+    m_truncated = true;
+
+  return true;
+}
+
+int StateSearch::depth() const
+{
+  return m_depth;
+}
+
+long StateSearch::frontier() const
+{
+  return m_frontierCount;
+}
+
+long StateSearch::visited() const
+{
+  return m_seen.size();
+}
+
+bool StateSearch::truncated() const
+{
+  return m_truncated;
+}
+
+bool StateSearch::found() const
+{
+  return m_goal >= 0;
+}
+
+int StateSearch::path(uint8_t *actions) const
+{
+  if (m_goal < 0)
+    return -1;
+
+  long slot = m_goal;
+
+  for (int d = m_depth - 1; d >= 0; d--)
+  {
+    actions[d] = m_actions[d][slot];
+    slot = m_parents[d][slot];
+  }
+
+  return m_depth;
+}
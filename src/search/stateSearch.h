@@ -0,0 +1,106 @@
+#ifndef __STATESEARCH__H__
+#define __STATESEARCH__H__
+
+#include <atomic>
+#include "../chip8/chip8.h"
+#include "../engine/engine.h"
+#include "../thread/workPool.h"
+#include "stateSet.h"
+
+#define SEARCHACTIONS (KEYCOUNT + 1)
+#define NOKEY KEYCOUNT
+#define MAXSEARCHDEPTH 64
+#define DEFAULTHOLDFRAMES 4
+#define DEFAULTMAXSTATES (1L << 18)
+
+/* Breadth-first search over the key inputs of one ROM. An action holds
+   one key for holdFrames guest frames and lets it go for as many more,
+   or holds none for both; every state of the frontier is expanded by all
+   SEARCHACTIONS of them. Machines reached before, by their checksum in a
+   StateSet, are dropped, so each level only holds states never seen at a
+   smaller depth.
+   A level is an arena of Chip8::stateBlockSize() blocks: a worker forks
+   a state by copying its block into the worker's own Chip8, plays the
+   action and copies the result into the next arena, at a slot taken from
+   a shared counter. The threads pull frontier states from a shared
+   cursor too, so nothing but the StateSet is contended.
+   The parent and action of every state are kept for all levels, for the
+   path to the goal: the byte at an address taking a value, e.g. the flag
+   a puzzle sets once solved. */
+
+class StateSearch
+{
+    public:
+
+        /* threads as for WorkPool; at most maxStates states are kept */
+        StateSearch(const char *rom, const char *engineName, int holdFrames,
+                    long instrPerFrame, long maxStates, int threads);
+        ~StateSearch();
+
+        /* OK, or the error that stopped the construction */
+        int status() const;
+
+        void setGoal(uint16_t address, uint8_t value);
+
+        /* Expands the frontier into the next level; false when there was
+           nothing to do: the goal was reached, the frontier is empty or
+           maxStates or MAXSEARCHDEPTH were reached */
+        bool expand();
+
+        /* Levels expanded, states in the last one and states seen */
+        int depth() const;
+        long frontier() const;
+        long visited() const;
+
+        /* Some new states were dropped for lack of room */
+        bool truncated() const;
+
+        bool found() const;
+
+        /* The actions from the start to the goal, NOKEY for none, into
+           actions[MAXSEARCHDEPTH]; returns how many, -1 when not found */
+        int path(uint8_t *actions) const;
+
+    private:
+
+        static void workerJob(long index, void *context);
+
+        void expandWith(int worker);
+        bool play(Chip8& cpu, Engine& engine, int action);
+
+        int m_status;
+        int m_holdFrames;
+        long m_instrPerFrame;
+        long m_maxStates;
+        int m_threads;
+
+        WorkPool m_pool;
+        StateSet m_seen;
+
+        /* one machine and engine per worker */
+        Chip8 **m_cpus;
+        Engine **m_engines;
+
+        uint8_t *m_frontier;
+        long m_frontierCount;
+        std::atomic<long> m_cursor;
+
+        uint8_t *m_next;
+        long m_nextCapacity;
+        std::atomic<long> m_nextCount;
+
+        /* parent slot and action of the states of level d + 1 */
+        uint32_t *m_parents[MAXSEARCHDEPTH];
+        uint8_t *m_actions[MAXSEARCHDEPTH];
+        int m_depth;
+
+        bool m_hasGoal;
+        uint16_t m_goalAddress;
+        uint8_t m_goalValue;
+
+        /* slot of the goal in the last level, -1 until found */
+        std::atomic<long> m_goal;
+        std::atomic<bool> m_truncated;
+};
+
+#endif
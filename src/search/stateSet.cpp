@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include "stateSet.h"
+
+StateSet::StateSet(long capacity) : m_size(0), m_full(false)
+{
+    uint64_t slots = 64;
+    while (slots < (uint64_t) capacity * 2)
+      slots <<= 1;
+
+    m_mask = slots - 1;
+
+    /* all bits zero is an empty slot, the atomics are lock-free words */
+    m_slots = (std::atomic<uint64_t>*) calloc(slots, sizeof(std::atomic<uint64_t>));
+    okConstruct = m_slots != NULL;
+}
+
+StateSet::~StateSet()
+{
+    free(m_slots);
+}
+
+bool StateSet::insert(uint64_t hash)
+{
+  if (hash == 0)
+    hash = 1;
+
+  /* the low bits of the state hash are as good as the high ones */
+  for (uint64_t probe = 0; probe <= m_mask; probe++)
+  {
+    std::atomic<uint64_t>& slot = m_slots[(hash + probe) & m_mask];
+    uint64_t seen = slot.load(std::memory_order_relaxed);
+
+    if (seen == 0)
+    {
+      if (slot.compare_exchange_strong(seen, hash, std::memory_order_relaxed))
+      {
+        m_size.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      /* lost the race; seen now holds the winner's hash */
+    }
+
+    if (seen == hash)
+      return false;
+  }
+
+  m_full = true;
+  return false;
+}
+
+long StateSet::size() const
+{
+  return m_size;
+}
+
+bool StateSet::full() const
+{
+  return m_full;
+}
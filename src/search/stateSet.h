@@ -0,0 +1,38 @@
+#ifndef __STATESET__H__
+#define __STATESET__H__
+
+#include <atomic>
+#include <stdint.h>
+
+/* Set of state hashes shared by the threads of a search, without locks:
+   open addressing with linear probing over a power-of-two table of
+   atomic words, an insert claims an empty slot with one compare-and-swap.
+   0 marks an empty slot, a hash of 0 is stored as 1. Entries are never
+   removed. Two states with the same 64-bit hash count as one. */
+
+class StateSet
+{
+    public:
+
+        /* Room for at least capacity hashes at half load */
+        StateSet(long capacity);
+        ~StateSet();
+
+        bool okConstruct;
+
+        /* true when hash was not in the set yet and is now; false when it
+           was, or when the table is full */
+        bool insert(uint64_t hash);
+
+        long size() const;
+        bool full() const;
+
+    private:
+
+        std::atomic<uint64_t> *m_slots;
+        uint64_t m_mask;
+        std::atomic<long> m_size;
+        std::atomic<bool> m_full;
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include "rewindBuffer.h"
+
+/* shorter zero runs stay inside a literal, a token header costs 4 bytes */
+#define RUNMIN 4
+#define RUNMAX 0xFFFF
+
+RewindBuffer::RewindBuffer(size_t budget, int keyframeInterval) : m_budget(budget),
+                                                                  m_interval(keyframeInterval),
+                                                                  m_stateSize(Chip8::stateSize()),
+                                                                  m_write(0),
+                                                                  m_used(0),
+                                                                  m_sinceKey(0),
+                                                                  m_captures(0),
+                                                                  m_storedBytes(0),
+                                                                  m_captureTime(0)
+{
+    if (m_interval < 1)
+      m_interval = 1;
+
+    m_arena = (uint8_t*) malloc(m_budget);
+    m_key   = (uint8_t*) malloc(m_stateSize);
+    m_state = (uint8_t*) malloc(m_stateSize);
+
+    /* worst case: a 4-byte header for every RUNMIN + 1 bytes */
+    m_delta = (uint8_t*) malloc(2 * m_stateSize + 2 * RUNMIN);
+
+    okConstruct = m_arena != NULL && m_key != NULL && m_state != NULL && m_delta != NULL &&
+                  m_budget >= m_stateSize;
+}
+
+RewindBuffer::~RewindBuffer()
+{
+    free(m_arena);
+    free(m_key);
+    free(m_state);
+    free(m_delta);
+}
+
+static inline void put16(uint8_t *out, size_t value)
+{
+  out[0] = value & 0xFF;
+  out[1] = value >> BYTESIZE;
+}
+
+static inline size_t get16(const uint8_t *in)
+{
+  return in[0] | (in[1] << BYTESIZE);
+}
+
+/* Tokens of (zero run, literal count, literal bytes) covering state XOR
+   key; returns the encoded size */
+
+size_t RewindBuffer::encode(const uint8_t *state, const uint8_t *key, size_t size, uint8_t *out)
+{
+  size_t pos = 0;
+  size_t i = 0;
+
+  while (i < size)
+  {
+    size_t start = i;
+
+    /* unchanged bytes, a word at a time while possible */
+    while (i + sizeof(uint64_t) <= size && i - start + sizeof(uint64_t) <= RUNMAX &&
+           memcmp(state + i, key + i, sizeof(uint64_t)) == 0)
+      i += sizeof(uint64_t);
+    while (i < size && i - start < RUNMAX && state[i] == key[i])
+      i++;
+
+    size_t skip = i - start;
+    size_t literal = i;
+
+    while (i < size && i - literal < RUNMAX)
+    {
+      if (state[i] != key[i])
+      {
+        i++;
+        continue;
+      }
+
+      size_t zero = i;
+      while (zero < size && zero - i < RUNMIN && state[zero] == key[zero])
+        zero++;
+
+      if (zero - i >= RUNMIN || zero == size || zero - literal > RUNMAX)
+        break;
+      i = zero;
+    }
+
+    put16(out + pos, skip);
+    put16(out + pos + 2, i - literal);
+    pos += 4;
+
+    for (size_t j = literal; j < i; j++)
+      out[pos++] = state[j] ^ key[j];
+  }
+
+  return pos;
+}
+
+/* XORs a delta into state, which holds the keyframe */
+
+void RewindBuffer::decode(const uint8_t *delta, size_t size, uint8_t *state)
+{
+  size_t pos = 0;
+  size_t i = 0;
+
+  while (pos + 4 <= size)
+  {
+    i += get16(delta + pos);
+    size_t count = get16(delta + pos + 2);
+    pos += 4;
+
+    for (size_t j = 0; j < count; j++)
+      state[i++] ^= delta[pos++];
+  }
+}
+
+bool RewindBuffer::overlaps(const entry& e, size_t offset, size_t size) const
+{
+  return e.offset < offset + size && offset < e.offset + e.size;
+}
+
+/* Drops the oldest entry, and the deltas left without their keyframe */
+
+void RewindBuffer::dropFront()
+{
+  m_used -= m_entries.front().size;
+  m_entries.pop_front();
+
+  while (!m_entries.empty() && !m_entries.front().key)
+  {
+    m_used -= m_entries.front().size;
+    m_entries.pop_front();
+  }
+}
+
+/* Room for size bytes after the newest entry, evicting the oldest ones */
+
+uint8_t* RewindBuffer::store(size_t size)
+{
+  if (m_entries.empty())
+    m_write = 0;
+
+  if (m_write + size > m_budget)
+  {
+    /* the entries past the write position are the oldest ones */
+    while (!m_entries.empty() && m_entries.front().offset >= m_write)
+      dropFront();
+    m_write = 0;
+  }
+
+  while (!m_entries.empty() && overlaps(m_entries.front(), m_write, size))
+    dropFront();
+
+  entry e = { m_write, size, false };
+  m_entries.push_back(e);
+
+  m_used += size;
+  m_write += size;
+  return m_arena + e.offset;
+}
+
+void RewindBuffer::capture(const Chip8& cpu)
+{
+  if (!okConstruct)
+    return;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  cpu.saveState(m_state);
+
+  size_t size = m_stateSize;
+  bool key = m_entries.empty() || m_sinceKey + 1 >= m_interval;
+
+  if (!key)
+  {
+    size = encode(m_state, m_key, m_stateSize, m_delta);
+    key = size >= m_stateSize;
+  }
+
+  if (key)
+  {
+    /* evicting can drop the old keyframe, but not the new one */
+    memcpy(store(m_stateSize), m_state, m_stateSize);
+    memcpy(m_key, m_state, m_stateSize);
+    m_entries.back().key = true;
+    m_sinceKey = 0;
+    size = m_stateSize;
+  }
+  else
+  {
+    /* a delta is useless once its keyframe was evicted to make room */
+    uint8_t *out = store(size);
+    if (m_entries.size() == 1)
+    {
+      m_entries.pop_back();
+      m_used -= size;
+      m_write -= size;
+      m_sinceKey = m_interval;
+      capture(cpu);
+      return;
+    }
+    memcpy(out, m_delta, size);
+    m_sinceKey++;
+  }
+
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  m_captureTime += elapsed.count();
+  m_storedBytes += size;
+  m_captures++;
+}
+
+/* After the newest keyframe was dropped: the one before becomes the base
+   of the remaining deltas */
+
+void RewindBuffer::reloadKey()
+{
+  m_sinceKey = 0;
+
+  for (size_t i = m_entries.size(); i-- > 0; m_sinceKey++)
+    if (m_entries[i].key)
+    {
+      memcpy(m_key, m_arena + m_entries[i].offset, m_stateSize);
+      return;
+    }
+}
+
+bool RewindBuffer::stepBack(Chip8& cpu)
+{
+  if (m_entries.size() < 2)
+    return false;
+
+  entry newest = m_entries.back();
+  m_entries.pop_back();
+  m_used -= newest.size;
+  m_write = newest.offset;
+
+  if (newest.key)
+    reloadKey();
+  else
+    m_sinceKey--;
+
+  const entry& target = m_entries.back();
+
+  if (target.key)
+    memcpy(m_state, m_arena + target.offset, m_stateSize);
+  else
+  {
+    memcpy(m_state, m_key, m_stateSize);
+    decode(m_arena + target.offset, target.size, m_state);
+  }
+
+  return cpu.loadState(m_state, m_stateSize) == OK;
+}
+
+int RewindBuffer::frames() const
+{
+  return m_entries.size();
+}
+
+size_t RewindBuffer::bytesUsed() const
+{
+  return m_used;
+}
+
+size_t RewindBuffer::budget() const
+{
+  return m_budget;
+}
+
+int RewindBuffer::keyframeInterval() const
+{
+  return m_interval;
+}
+
+double RewindBuffer::averageEntrySize() const
+{
+  return m_captures > 0 ? (double) m_storedBytes / m_captures : 0.0;
+}
+
+double RewindBuffer::averageCaptureTime() const
+{
+  return m_captures > 0 ? m_captureTime / m_captures : 0.0;
+}
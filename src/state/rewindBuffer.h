@@ -0,0 +1,83 @@
+#ifndef __REWINDBUFFER__H__
+#define __REWINDBUFFER__H__
+
+#include <cstddef>
+#include <deque>
+#include "../chip8/chip8.h"
+
+#define DEFAULTREWINDKB 1024
+#define DEFAULTKEYFRAME 60
+
+/* History of the machine for rewinding, one entry per guest frame, kept
+   in a circular arena of a fixed byte budget. Every keyframeInterval
+   frames the whole save state is stored; the frames in between store the
+   state XOR the last keyframe, run-length encoded, which for a CHIP-8
+   game is a few dozen bytes since most of memory never changes. When the
+   arena is full the oldest keyframe goes, with the deltas that depend on
+   it. */
+
+class RewindBuffer
+{
+    public:
+
+        RewindBuffer(size_t budget, int keyframeInterval);
+        ~RewindBuffer();
+
+        bool okConstruct;
+
+        /* Records the state of cpu after a guest frame */
+        void capture(const Chip8& cpu);
+
+        /* Drops the newest frame and restores cpu to the one before it;
+           false when no older frame is held. Engines driving cpu must be
+           flushed afterwards. */
+        bool stepBack(Chip8& cpu);
+
+        int frames() const;
+        size_t bytesUsed() const;
+        size_t budget() const;
+        int keyframeInterval() const;
+
+        /* Bytes stored per captured frame and host time per capture */
+        double averageEntrySize() const;
+        double averageCaptureTime() const;
+
+    private:
+
+        struct entry
+        {
+            size_t offset;
+            size_t size;
+            bool key;
+        };
+
+        static size_t encode(const uint8_t *state, const uint8_t *key, size_t size, uint8_t *out);
+        static void decode(const uint8_t *delta, size_t size, uint8_t *state);
+
+        uint8_t* store(size_t size);
+        bool overlaps(const entry& e, size_t offset, size_t size) const;
+        void dropFront();
+        void reloadKey();
+
+        size_t m_budget;
+        int m_interval;
+        size_t m_stateSize;
+
+        uint8_t *m_arena;
+        size_t m_write;
+        size_t m_used;
+        std::deque<entry> m_entries;
+
+        /* newest keyframe, and the frames stored since it */
+        uint8_t *m_key;
+        int m_sinceKey;
+
+        uint8_t *m_state;
+        uint8_t *m_delta;
+
+        long m_captures;
+        long m_storedBytes;
+        double m_captureTime;
+};
+
+#endif
@@ -3,8 +3,6 @@
 
 #include <stdint.h>
 
-extern int error;
-
 enum ERROR
 {
     OK,
@@ -16,10 +14,12 @@ enum ERROR
     ADDRESSERR,
     BADARGUMENT,
     UNKNOWN,
-    BIGFILE
+    BIGFILE,
+    BADSTATE,
+    BADLOG
 };
 
-static uint8_t Chip8_fontset[80] =
+static const uint8_t Chip8_fontset[80] =
 {
   0xF0, 0x90, 0x90, 0x90, 0xF0, //0
   0x20, 0x60, 0x20, 0x20, 0x70, //1
@@ -75,7 +75,8 @@ enum command
     LD_SPR      = 0xF29,
     LD_BCD      = 0xF33,
     LD_REG_MEM  = 0xF55,
-    LD_REG_LOAD = 0xF65
+    LD_REG_LOAD = 0xF65,
+    TRAP        = 0xFFFF
 };
 
 
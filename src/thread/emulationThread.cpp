@@ -0,0 +1,337 @@
+#include <cstdio>
+#include <cstring>
+#include "emulationThread.h"
+
+EmulationThread::EmulationThread(Chip8& cpu, Engine& engine, TripleBuffer& frames,
+                                 InputQueue& input, long ips) : m_cpu(cpu),
+                                                                m_engine(engine),
+                                                                m_frames(frames),
+                                                                m_input(input),
+                                                                m_running(false),
+                                                                m_failed(false),
+                                                                m_scheduler(ips),
+                                                                m_published(0),
+                                                                m_rewind(NULL),
+                                                                m_rewinding(false),
+                                                                m_log(NULL),
+                                                                m_replay(false),
+                                                                m_netplay(NULL),
+                                                                m_localKeys(0),
+                                                                m_turbo(TURBOOFF),
+                                                                m_guestFrames(0),
+                                                                m_instructions(0)
+{
+}
+
+EmulationThread::~EmulationThread()
+{
+    stop();
+}
+
+void EmulationThread::setTurbo(int renderEvery)
+{
+  m_turbo = renderEvery;
+}
+
+void EmulationThread::setRewind(RewindBuffer *rewind)
+{
+  m_rewind = rewind;
+}
+
+void EmulationThread::setRecording(InputLog *log)
+{
+  m_log = log;
+  m_replay = false;
+}
+
+void EmulationThread::setReplay(InputLog *log)
+{
+  m_log = log;
+  m_replay = log != NULL;
+}
+
+void EmulationThread::setNetplay(RollbackSession *session)
+{
+  m_netplay = session;
+}
+
+void EmulationThread::start()
+{
+  if (m_thread.joinable())
+    return;
+
+  m_started = std::chrono::steady_clock::now();
+  m_stopped = m_started;
+  m_running = true;
+  m_thread = std::thread(&EmulationThread::loop, this);
+}
+
+void EmulationThread::stop()
+{
+  m_running = false;
+  m_input.interrupt();
+
+  if (m_thread.joinable())
+    m_thread.join();
+}
+
+bool EmulationThread::running() const
+{
+  return m_running;
+}
+
+bool EmulationThread::failed() const
+{
+  return m_failed;
+}
+
+const Scheduler& EmulationThread::scheduler() const
+{
+  return m_scheduler;
+}
+
+long EmulationThread::guestFrames() const
+{
+  return m_guestFrames;
+}
+
+long EmulationThread::instructions() const
+{
+  return m_instructions;
+}
+
+double EmulationThread::seconds() const
+{
+  std::chrono::duration<double> elapsed = m_stopped - m_started;
+  return elapsed.count();
+}
+
+void EmulationThread::applyInput()
+{
+  keyEvent event;
+
+  while (m_input.pop(&event))
+  {
+    if (event.key == REWINDKEY)
+      m_rewinding = event.pressed;
+    else if (m_replay)
+      continue;
+    else if (m_netplay != NULL)
+    {
+      if (event.pressed)
+        m_localKeys |= 1 << event.key;
+      else
+        m_localKeys &= ~(1 << event.key);
+    }
+    else
+    {
+      if (event.pressed)
+        m_cpu.pressKey(event.key);
+      else
+        m_cpu.releaseKey(event.key);
+
+      if (m_log != NULL)
+        m_log->record(m_guestFrames, event.key, event.pressed);
+    }
+  }
+
+  if (m_replay)
+    m_log->replay(m_guestFrames, m_cpu);
+}
+
+bool EmulationThread::replayDone() const
+{
+  return m_replay && m_guestFrames >= m_log->frames();
+}
+
+void EmulationThread::publishFrame()
+{
+  frame& next = m_frames.back();
+
+  memcpy(next.rows, m_cpu.screen(), ROWBYTES);
+  next.number = ++m_published;
+
+  m_frames.publish();
+  m_cpu.clearChangedRows();
+}
+
+/* Blocked on Fx0A with nothing to count down: sleeps until a key event.
+   Returns false when it did not have to wait; a replay never waits, its
+   events are applied already. */
+
+bool EmulationThread::waitForKey()
+{
+  if (m_replay || !m_cpu.waitingForKey() || m_cpu.timersRunning())
+    return false;
+
+  m_input.waitEvent();
+  return true;
+}
+
+/* One guest frame: its instruction budget, then a timer tick. Returns
+   false when the engine stopped on an error. */
+
+bool EmulationThread::runFrame()
+{
+  long budget = m_scheduler.frameBudget(m_guestFrames);
+  long executed = 0;
+
+  while (executed < budget)
+  {
+    long ran = m_engine.run(budget - executed);
+    if (m_cpu.errorCode() != OK)
+    {
+      m_failed = true;
+      return false;
+    }
+    if (ran <= 0)
+      break;
+    executed += ran;
+  }
+
+  m_cpu.decreaseTimers();
+
+  m_instructions += executed;
+  m_guestFrames++;
+  return true;
+}
+
+/* Restores the frame before the newest one and shows it; the engine may
+   hold translations of the memory that was just replaced. The undone
+   frame will run again, with the keys logged for it forgotten. */
+
+void EmulationThread::stepBack()
+{
+  if (!m_rewind->stepBack(m_cpu))
+    return;
+
+  m_guestFrames--;
+  if (m_log != NULL)
+    m_log->truncate(m_guestFrames);
+
+  m_engine.flush();
+  publishFrame();
+}
+
+void EmulationThread::loop()
+{
+  if (m_turbo != TURBOOFF)
+    loopTurbo();
+  else
+  {
+    m_scheduler.start();
+
+    while (m_running)
+    {
+      m_scheduler.waitTick();
+
+      applyInput();
+
+      if (replayDone())
+        break;
+
+      if (m_netplay != NULL)
+      {
+        if (!m_netplay->advance(m_localKeys))
+        {
+          m_failed = true;
+          break;
+        }
+
+        m_guestFrames = m_netplay->frame();
+        if (m_cpu.drawStatus())
+          publishFrame();
+        continue;
+      }
+
+      if (m_rewinding && m_rewind != NULL)
+      {
+        stepBack();
+        continue;
+      }
+
+      /* restart the tick grid after a key wait rather than catch up */
+      if (waitForKey())
+      {
+        m_scheduler.start();
+        continue;
+      }
+
+      if (!runFrame())
+        break;
+
+      if (m_rewind != NULL)
+        m_rewind->capture(m_cpu);
+
+      if (m_cpu.drawStatus())
+        publishFrame();
+    }
+  }
+
+  m_stopped = std::chrono::steady_clock::now();
+
+  if (m_log != NULL && !m_replay)
+    m_log->finish(m_guestFrames, m_cpu);
+
+  m_running = false;
+}
+
+void EmulationThread::loopTurbo()
+{
+  typedef std::chrono::steady_clock clock;
+
+  const clock::duration renderPeriod = std::chrono::microseconds(1000000 / TIMERHZ);
+  const clock::duration reportPeriod = std::chrono::seconds(SPEEDREPORTSECONDS);
+
+  clock::time_point nextRender = clock::now();
+  clock::time_point nextReport = nextRender + reportPeriod;
+  long reportFrames = 0;
+  long reportInstructions = 0;
+  int skipped = 0;
+
+  while (m_running)
+  {
+    applyInput();
+
+    if (replayDone())
+      break;
+
+    if (waitForKey())
+      continue;
+
+    if (!runFrame())
+      break;
+
+    if (m_turbo > 0 && ++skipped >= m_turbo && m_cpu.drawStatus())
+    {
+      publishFrame();
+      skipped = 0;
+    }
+
+    /* frames can be a few dozen instructions, so the clock is sampled */
+    if (m_guestFrames % TURBOCLOCKFRAMES != 0)
+      continue;
+
+    clock::time_point now = clock::now();
+
+    if (m_turbo == 0 && now >= nextRender && m_cpu.drawStatus())
+    {
+      publishFrame();
+      nextRender = now + renderPeriod;
+    }
+
+    if (now >= nextReport)
+    {
+      std::chrono::duration<double> span = now - nextReport + reportPeriod;
+      double frames = m_guestFrames - reportFrames;
+      double instructions = m_instructions - reportInstructions;
+
+      fprintf(stderr, "turbo: %.1fx, %.0f instr/s\n",
+              frames / span.count() / TIMERHZ, instructions / span.count());
+
+      reportFrames = m_guestFrames;
+      reportInstructions = m_instructions;
+      nextReport = now + reportPeriod;
+    }
+  }
+}
@@ -0,0 +1,123 @@
+#ifndef __EMULATIONTHREAD__H__
+#define __EMULATIONTHREAD__H__
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "../engine/engine.h"
+#include "../keyboard/inputLog.h"
+#include "../keyboard/inputQueue.h"
+#include "../net/rollbackSession.h"
+#include "../state/rewindBuffer.h"
+#include "scheduler.h"
+#include "tripleBuffer.h"
+
+/* Runs the guest on a thread of its own, paced by a Scheduler: on every
+   60 Hz tick it applies the key events queued by the UI thread, runs
+   the guest frame's share of ips instructions, decreases the timers and,
+   when the display changed, publishes the screen to the triple buffer.
+   It sleeps until the next tick, or until the next key event while the
+   guest waits on Fx0A with both timers stopped; presentation never
+   stalls it.
+   In turbo mode nothing sleeps: a guest frame of ips / 60 instructions
+   and one timer tick follow each other as fast as the host allows, and
+   the screen is published every renderEvery guest frames, or at 60 Hz
+   of wall-clock time when renderEvery is 0. The effective speed is
+   printed every second.
+   With a RewindBuffer the paced loop captures the machine after every
+   guest frame, and while REWINDKEY is held it steps back one frame per
+   tick instead of running the guest.
+   An InputLog either records the key events by guest frame, forgetting
+   the rewound ones, or replaces the queued keys with its own events and
+   ends the loop once all its frames ran.
+   In a netplay session the queued keys are only held locally; every tick
+   hands them to the RollbackSession, which runs the frame and any
+   rollback itself. */
+
+#define TURBOOFF -1
+#define SPEEDREPORTSECONDS 1
+#define TURBOCLOCKFRAMES 64
+
+class EmulationThread
+{
+    public:
+
+        EmulationThread(Chip8& cpu, Engine& engine, TripleBuffer& frames, InputQueue& input,
+                        long ips);
+        ~EmulationThread();
+
+        /* TURBOOFF, or how many guest frames make one published frame;
+           call it before start() */
+        void setTurbo(int renderEvery);
+
+        /* NULL for no rewinding; call it before start() */
+        void setRewind(RewindBuffer *rewind);
+
+        /* Logs the session into log, or replays log, which must have been
+           prepared on the Chip8; call them before start() */
+        void setRecording(InputLog *log);
+        void setReplay(InputLog *log);
+
+        /* Plays through a connected session, paced only; call it before
+           start() */
+        void setNetplay(RollbackSession *session);
+
+        void start();
+
+        /* Asks the loop to finish and joins it */
+        void stop();
+
+        bool running() const;
+
+        /* The engine stopped on an error, the code is left in error */
+        bool failed() const;
+
+        /* Pacing statistics; read them after stop() */
+        const Scheduler& scheduler() const;
+
+        /* Guest frames and instructions run, and their host time in
+           seconds, since start() */
+        long guestFrames() const;
+        long instructions() const;
+        double seconds() const;
+
+    private:
+
+        void loop();
+        void loopTurbo();
+        bool waitForKey();
+        bool replayDone() const;
+        bool runFrame();
+        void stepBack();
+        void applyInput();
+        void publishFrame();
+
+        Chip8& m_cpu;
+        Engine& m_engine;
+        TripleBuffer& m_frames;
+        InputQueue& m_input;
+
+        std::thread m_thread;
+        std::atomic<bool> m_running;
+        std::atomic<bool> m_failed;
+
+        Scheduler m_scheduler;
+        uint64_t m_published;
+
+        RewindBuffer *m_rewind;
+        bool m_rewinding;
+
+        InputLog *m_log;
+        bool m_replay;
+
+        RollbackSession *m_netplay;
+        uint16_t m_localKeys;
+
+        int m_turbo;
+        long m_guestFrames;
+        long m_instructions;
+        std::chrono::steady_clock::time_point m_started;
+        std::chrono::steady_clock::time_point m_stopped;
+};
+
+#endif
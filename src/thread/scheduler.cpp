@@ -0,0 +1,105 @@
+#include <thread>
+#include "scheduler.h"
+
+#define NANOSECONDS 1000000000LL
+
+Scheduler::Scheduler(long ips) : m_ips(ips),
+                                 m_tick(0),
+                                 m_ticks(0),
+                                 m_totalOvershoot(0),
+                                 m_worstOvershoot(0),
+                                 m_undershoots(0),
+                                 m_missed(0),
+                                 m_resyncs(0)
+{
+}
+
+void Scheduler::start()
+{
+  m_start = clock::now();
+  m_tick = 0;
+}
+
+Scheduler::clock::time_point Scheduler::deadline() const
+{
+  return m_start + std::chrono::nanoseconds(m_tick * NANOSECONDS / TIMERHZ);
+}
+
+void Scheduler::waitTick()
+{
+  m_tick++;
+
+  clock::time_point due = deadline();
+  clock::time_point now = clock::now();
+
+  if (now < due)
+  {
+    std::this_thread::sleep_until(due);
+    now = clock::now();
+
+    long late = std::chrono::duration_cast<std::chrono::microseconds>(now - due).count();
+    if (late < 0)
+      m_undershoots++;
+    else
+    {
+      m_totalOvershoot += late;
+      if (late > m_worstOvershoot)
+        m_worstOvershoot = late;
+    }
+  }
+  else
+  {
+    m_missed++;
+
+    /* too far behind: restart the tick grid from now */
+    if (now - due > std::chrono::nanoseconds(MAXLAGTICKS * NANOSECONDS / TIMERHZ))
+    {
+      m_start = now;
+      m_tick = 0;
+      m_resyncs++;
+    }
+  }
+
+  m_ticks++;
+}
+
+long Scheduler::frameBudget(long frame) const
+{
+  return (frame + 1) * m_ips / TIMERHZ - frame * m_ips / TIMERHZ;
+}
+
+long Scheduler::ips() const
+{
+  return m_ips;
+}
+
+long Scheduler::ticks() const
+{
+  return m_ticks;
+}
+
+double Scheduler::averageOvershoot() const
+{
+  long woken = m_ticks - m_missed - m_undershoots;
+  return woken > 0 ? (double) m_totalOvershoot / woken : 0.0;
+}
+
+long Scheduler::worstOvershoot() const
+{
+  return m_worstOvershoot;
+}
+
+long Scheduler::undershoots() const
+{
+  return m_undershoots;
+}
+
+long Scheduler::missed() const
+{
+  return m_missed;
+}
+
+long Scheduler::resyncs() const
+{
+  return m_resyncs;
+}
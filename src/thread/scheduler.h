@@ -0,0 +1,66 @@
+#ifndef __SCHEDULER__H__
+#define __SCHEDULER__H__
+
+#include <chrono>
+
+#define TIMERHZ 60
+#define DEFAULTIPS 600
+#define MAXLAGTICKS 6
+
+/* Fixed-timestep pacing of the guest. Time is cut into 1/TIMERHZ s ticks
+   whose deadlines are computed from the start time, so rounding never
+   accumulates into drift; between two ticks the host thread sleeps.
+   Guest frame n owns the instructions between n * ips / TIMERHZ and
+   (n + 1) * ips / TIMERHZ, so any rate is met on average and a frame's
+   budget depends on its number only, not on the ticks the host skipped
+   or spent waiting; replays rely on it. A host that falls
+   more than MAXLAGTICKS behind is resynchronised instead of replaying
+   the backlog in a burst. */
+
+class Scheduler
+{
+    public:
+
+        typedef std::chrono::steady_clock clock;
+
+        Scheduler(long ips);
+
+        void start();
+
+        /* Sleeps until the next tick is due */
+        void waitTick();
+
+        /* Instruction budget of guest frame number frame */
+        long frameBudget(long frame) const;
+
+        long ips() const;
+
+        /* Wake-up error, in microseconds: oversleep past the deadline and
+           wake-ups before it */
+        long ticks() const;
+        double averageOvershoot() const;
+        long worstOvershoot() const;
+        long undershoots() const;
+
+        /* ticks that were already due when waitTick was called */
+        long missed() const;
+        long resyncs() const;
+
+    private:
+
+        clock::time_point deadline() const;
+
+        long m_ips;
+
+        clock::time_point m_start;
+        long m_tick;
+
+        long m_ticks;
+        long m_totalOvershoot;
+        long m_worstOvershoot;
+        long m_undershoots;
+        long m_missed;
+        long m_resyncs;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include <cstring>
+#include "tripleBuffer.h"
+
+#define FRESHFRAME 4
+#define FRAMEINDEX 3
+
+TripleBuffer::TripleBuffer() : m_back(0), m_front(1), m_middle(2)
+{
+    memset(m_frames, 0, sizeof(m_frames));
+}
+
+frame& TripleBuffer::back()
+{
+  return m_frames[m_back];
+}
+
+void TripleBuffer::publish()
+{
+  int previous = m_middle.exchange(m_back | FRESHFRAME, std::memory_order_acq_rel);
+  m_back = previous & FRAMEINDEX;
+}
+
+bool TripleBuffer::acquire()
+{
+  if ((m_middle.load(std::memory_order_relaxed) & FRESHFRAME) == 0)
+    return false;
+
+  int previous = m_middle.exchange(m_front, std::memory_order_acq_rel);
+  m_front = previous & FRAMEINDEX;
+  return true;
+}
+
+const frame& TripleBuffer::front() const
+{
+  return m_frames[m_front];
+}
@@ -0,0 +1,46 @@
+#ifndef __TRIPLEBUFFER__H__
+#define __TRIPLEBUFFER__H__
+
+#include <atomic>
+#include <stdint.h>
+#include "../chip8/chip8.h"
+
+/* A completed display, numbered from 1 in publishing order */
+struct alignas(CACHELINE) frame
+{
+    uint64_t rows[WIDTH];
+    uint64_t number;
+};
+
+/* Lock-free triple buffer between the emulation thread, which fills
+   back() and publishes it, and the UI thread, which only ever looks at
+   the newest published frame. Neither side waits for the other: the
+   writer swaps its buffer with the middle one, the reader takes the
+   middle one only when it holds a frame it has not seen. */
+
+class TripleBuffer
+{
+    public:
+
+        TripleBuffer();
+
+        /* producer side */
+        frame& back();
+        void publish();
+
+        /* consumer side: true when front() changed to a newer frame */
+        bool acquire();
+        const frame& front() const;
+
+    private:
+
+        frame m_frames[3];
+
+        int m_back;
+        int m_front;
+
+        /* index of the middle buffer, FRESHFRAME while unread */
+        alignas(CACHELINE) std::atomic<int> m_middle;
+};
+
+#endif
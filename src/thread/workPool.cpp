@@ -0,0 +1,145 @@
+#include "workPool.h"
+
+WorkPool::WorkPool(int threads) : m_threads(threads),
+                                  m_steals(0),
+                                  m_work(NULL),
+                                  m_context(NULL),
+                                  m_generation(0),
+                                  m_busy(0),
+                                  m_stopping(false)
+{
+    if (m_threads <= 0)
+      m_threads = std::thread::hardware_concurrency();
+    if (m_threads <= 0)
+      m_threads = 1;
+
+    for (int i = 0; i < m_threads; i++)
+      m_queues.push_back(new Queue);
+
+    /* the calling thread of run() is worker 0 */
+    for (int i = 1; i < m_threads; i++)
+      m_workers.push_back(std::thread(&WorkPool::worker, this, i));
+}
+
+WorkPool::~WorkPool()
+{
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+      m_workers[i].join();
+
+    for (int i = 0; i < m_threads; i++)
+      delete m_queues[i];
+}
+
+int WorkPool::threads() const
+{
+  return m_threads;
+}
+
+long WorkPool::steals() const
+{
+  return m_steals;
+}
+
+/* Own jobs from the back, then the oldest job of the other workers */
+
+bool WorkPool::take(int self, long *index)
+{
+  {
+    Queue *own = m_queues[self];
+    std::lock_guard<std::mutex> guard(own->lock);
+
+    if (!own->jobs.empty())
+    {
+      *index = own->jobs.back();
+      own->jobs.pop_back();
+      return true;
+    }
+  }
+
+  for (int i = 1; i < m_threads; i++)
+  {
+    Queue *victim = m_queues[(self + i) % m_threads];
+    std::lock_guard<std::mutex> guard(victim->lock);
+
+    if (!victim->jobs.empty())
+    {
+      *index = victim->jobs.front();
+      victim->jobs.pop_front();
+      m_steals++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* No job adds jobs, so a worker that finds every queue empty is done */
+
+void WorkPool::drain(int self, job work, void *context)
+{
+  long index;
+
+  while (take(self, &index))
+    work(index, context);
+}
+
+/* Sleeps until run() hands out a batch, drains it, reports back */
+
+void WorkPool::worker(int self)
+{
+  long seen = 0;
+
+  for (;;)
+  {
+    job work;
+    void *context;
+
+    {
+      std::unique_lock<std::mutex> guard(m_lock);
+      while (m_generation == seen && !m_stopping)
+        m_wake.wait(guard);
+
+      if (m_stopping)
+        return;
+
+      seen = m_generation;
+      work = m_work;
+      context = m_context;
+    }
+
+    drain(self, work, context);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (--m_busy == 0)
+      m_finished.notify_one();
+  }
+}
+
+void WorkPool::run(long count, job work, void *context)
+{
+  for (long index = 0; index < count; index++)
+    m_queues[index % m_threads]->jobs.push_back(index);
+
+  if (m_threads > 1)
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_work = work;
+    m_context = context;
+    m_busy = m_threads - 1;
+    m_generation++;
+  }
+  m_wake.notify_all();
+
+  drain(0, work, context);
+
+  /* a worker may still be on the last job it took */
+  std::unique_lock<std::mutex> guard(m_lock);
+  while (m_busy > 0)
+    m_finished.wait(guard);
+}
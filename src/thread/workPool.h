@@ -0,0 +1,67 @@
+#ifndef __WORKPOOL__H__
+#define __WORKPOOL__H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Work-stealing pool for independent jobs. run() deals the job indexes
+   round-robin onto one deque per worker; a worker takes its own jobs from
+   the back and, once it runs dry, steals from the front of the others, so
+   a few long jobs cannot leave the rest of the cores idle.
+   The workers are started once and sleep on a condition variable between
+   two run() calls, so a caller can hand over short batches, e.g. one step
+   of every instance, without paying for thread creation each time. */
+
+class WorkPool
+{
+    public:
+
+        typedef void (*job)(long index, void *context);
+
+        /* 0 threads for one per hardware thread */
+        WorkPool(int threads);
+        ~WorkPool();
+
+        int threads() const;
+
+        /* Runs work(index, context) for every index in [0, count) and
+           returns once all of them finished */
+        void run(long count, job work, void *context);
+
+        /* Jobs that ran on another worker than the one they were dealt to */
+        long steals() const;
+
+    private:
+
+        struct Queue
+        {
+            std::mutex lock;
+            std::deque<long> jobs;
+        };
+
+        void drain(int self, job work, void *context);
+        void worker(int self);
+        bool take(int self, long *index);
+
+        int m_threads;
+        std::vector<Queue*> m_queues;
+        std::vector<std::thread> m_workers;
+        std::atomic<long> m_steals;
+
+        /* the current batch; a new generation wakes the workers, m_busy
+           counts those still on it */
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        std::condition_variable m_finished;
+        job m_work;
+        void *m_context;
+        long m_generation;
+        int m_busy;
+        bool m_stopping;
+};
+
+#endif